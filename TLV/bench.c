@@ -0,0 +1,154 @@
+/*
+ *  Field lookup cost of tlv_box by number of fields, to place
+ *  KEY_LIST_HASH_THRESHOLD, then the cost of tlv_box_parse against
+ *  tlv_box_parse_trusted. Build it once per index to compare:
+ *
+ *    cc -O2 -DKEY_LIST_HASH_THRESHOLD=1000000 bench.c tlv_box.c key_list.c -o bench_scan
+ *    cc -O2 -DKEY_LIST_HASH_THRESHOLD=0 bench.c tlv_box.c key_list.c -o bench_hash
+ *
+ *  Add -DWITH_PERF -I.. ../perfcount.c to count cycles, instructions,
+ *  cache and branch misses per operation as well, where perf events are
+ *  available.
+ */
+#include <stdio.h>
+#include <time.h>
+#include "tlv_box.h"
+#ifdef WITH_PERF
+#include "perfcount.h"
+#endif
+
+#define LOG(format,...) printf(format, ##__VA_ARGS__)
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char const *argv[])
+{
+    static const int sizes[] = { 2, 4, 8, 16, 24, 32, 48, 64, 96, 128, 256, 1024, 5000 };
+    int s = 0;
+
+#ifdef WITH_PERF
+    perf_group *perf = perf_open();
+    perf_stage gets = { .name = "get" }, puts = { .name = "put" }, other = { .name = "other" };
+    int event = 0;
+    long long total_gets = 0, total_puts = 0;
+#endif
+
+    LOG("index threshold %d\n", KEY_LIST_HASH_THRESHOLD);
+    LOG("%8s %12s %12s\n", "fields", "ns/get", "ns/put");
+    for (s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+        int fields = sizes[s], type = 0, round = 0;
+        int rounds = 2000000 / fields + 1;
+        long long sum = 0;
+
+#ifdef WITH_PERF
+        if (perf != NULL) {
+            perf_lap(perf, &other);
+        }
+#endif
+        double start = now_ns();
+        tlv_box_t *box = NULL;
+        for (round = 0; round < 10; round++) {
+            if (box != NULL) {
+                tlv_box_destroy(box);
+            }
+            box = tlv_box_create();
+            for (type = 1; type <= fields; type++) {
+                tlv_box_put_int(box, type * 7, type);
+            }
+        }
+        double put = (now_ns() - start) / (10.0 * fields);
+#ifdef WITH_PERF
+        if (perf != NULL) {
+            perf_lap(perf, &puts);
+        }
+        total_puts += 10LL * fields;
+#endif
+
+        start = now_ns();
+        for (round = 0; round < rounds; round++) {
+            for (type = 1; type <= fields; type++) {
+                int value;
+                tlv_box_get_int(box, type * 7, &value);
+                sum += value;
+            }
+        }
+        double get = (now_ns() - start) / ((double)rounds * fields);
+#ifdef WITH_PERF
+        if (perf != NULL) {
+            perf_lap(perf, &gets);
+        }
+        total_gets += (long long)rounds * fields;
+#endif
+
+        LOG("%8d %12.2f %12.2f\n", fields, get, put);
+        tlv_box_destroy(box);
+        if (sum == 42) {
+            LOG("\n");
+        }
+    }
+
+    /* validated against trusted parsing of the same serialized box */
+    LOG("\n%8s %12s %12s %12s\n", "fields", "ns/parse", "ns/trusted", "ns/validate");
+    for (s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+        int fields = sizes[s], type = 0, round = 0;
+        int rounds = 200000 / fields + 1;
+        tlv_box_t *box = tlv_box_create();
+        for (type = 1; type <= fields; type++) {
+            tlv_box_put_int(box, type * 7, type);
+        }
+        tlv_box_serialize(box);
+        unsigned char *buffer = tlv_box_get_buffer(box);
+        int size = tlv_box_get_size(box);
+        int failed = 0;
+
+        double start = now_ns();
+        for (round = 0; round < rounds; round++) {
+            tlv_box_t *parsed = tlv_box_parse(buffer, size);
+            failed |= parsed == NULL;
+            tlv_box_destroy(parsed);
+        }
+        double checked = (now_ns() - start) / rounds;
+
+        start = now_ns();
+        for (round = 0; round < rounds; round++) {
+            tlv_box_t *parsed = tlv_box_parse_trusted(buffer, size);
+            failed |= parsed == NULL;
+            tlv_box_destroy(parsed);
+        }
+        double trusted = (now_ns() - start) / rounds;
+
+        start = now_ns();
+        for (round = 0; round < rounds; round++) {
+            failed |= tlv_box_validate(buffer, size);
+        }
+        double validate = (now_ns() - start) / rounds;
+
+        LOG("%8d %12.1f %12.1f %12.1f\n", fields, checked, trusted, validate);
+        tlv_box_destroy(box);
+        if (failed) {
+            LOG("parse failed !\n");
+            return -1;
+        }
+    }
+
+#ifdef WITH_PERF
+    if (perf != NULL) {
+        LOG("\n%-14s %12s %12s\n", "event", "per get", "per put");
+        for (event = 0; event < PERF_EVENTS; event++) {
+            if (perf_available(perf, event)) {
+                LOG("%-14s %12.2f %12.2f\n", perf_event_name(event),
+                    (double)gets.counts[event] / total_gets, (double)puts.counts[event] / total_puts);
+            } else {
+                LOG("%-14s %12s %12s\n", perf_event_name(event), "-", "-");
+            }
+        }
+        perf_close(perf);
+    }
+#endif
+    return 0;
+}
@@ -10,14 +10,148 @@
  *  by the Free Software Foundation; either version 2.1 of the License, 
  *  or (at your option) any later version.
  */
+#include <string.h>
 #include "key_list.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KEY_LIST_HAVE_SIMD 1
+#endif
+
+#define KEY_LIST_INITIAL_CAPACITY 8
+
+static inline int key_list_scan_scalar(const key_t *keys, int count, key_t key)
+{
+    int i = 0;
+    for (i = 0; i < count; i++) {
+        if (key_compare(key, keys[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+#ifdef KEY_LIST_HAVE_SIMD
+__attribute__((target("avx2")))
+static int key_list_scan_avx2(const key_t *keys, int count, key_t key)
+{
+    __m256i needle = _mm256_set1_epi32(key);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(keys + i));
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(block, needle)));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    int found = key_list_scan_scalar(keys + i, count - i, key);
+    return found < 0 ? -1 : i + found;
+}
+
+__attribute__((target("avx512f")))
+static int key_list_scan_avx512(const key_t *keys, int count, key_t key)
+{
+    __m512i needle = _mm512_set1_epi32(key);
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m512i block = _mm512_loadu_si512((const void *)(keys + i));
+        __mmask16 mask = _mm512_cmpeq_epi32_mask(block, needle);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    /* the remaining keys fit in one masked compare */
+    if (i < count) {
+        __mmask16 tail = (__mmask16)((1u << (count - i)) - 1);
+        __m512i block = _mm512_maskz_loadu_epi32(tail, keys + i);
+        __mmask16 mask = _mm512_mask_cmpeq_epi32_mask(tail, block, needle);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return -1;
+}
+#endif
+
+static int (*key_list_scan)(const key_t *keys, int count, key_t key) = key_list_scan_scalar;
+
+__attribute__((constructor))
+static void key_list_select_scan(void)
+{
+#ifdef KEY_LIST_HAVE_SIMD
+    if (__builtin_cpu_supports("avx512f")) {
+        key_list_scan = key_list_scan_avx512;
+    }
+    else if (__builtin_cpu_supports("avx2")) {
+        key_list_scan = key_list_scan_avx2;
+    }
+#endif
+}
+
+static unsigned int key_list_hash(key_t key, int slot_capacity)
+{
+    return ((unsigned int)key * 2654435761u) & (unsigned int)(slot_capacity - 1);
+}
+
+/* (Re)build the hash index with room for twice the current keys. */
+static int key_list_build_slots(key_list_t *list)
+{
+    int slot_capacity = 16;
+    while (slot_capacity < list->count * 2) {
+        slot_capacity <<= 1;
+    }
+    int *slots = (int *)malloc(slot_capacity * sizeof(int));
+    if (slots == NULL) {
+        return -1;
+    }
+    memset(slots, -1, slot_capacity * sizeof(int));
+
+    int i = 0;
+    for (i = 0; i < list->count; i++) {
+        unsigned int h = key_list_hash(list->keys[i], slot_capacity);
+        while (slots[h] != -1) {
+            h = (h + 1) & (slot_capacity - 1);
+        }
+        slots[h] = i;
+    }
+
+    free(list->slots);
+    list->slots = slots;
+    list->slot_capacity = slot_capacity;
+    return 0;
+}
+
+/* Return the position of key in list->keys, or -1. */
+static int key_list_position(key_list_t *list, key_t key)
+{
+    if (list->slots == NULL) {
+        /* below one vector, a plain loop beats the indirect call */
+        if (list->count < 8) {
+            return key_list_scan_scalar(list->keys, list->count, key);
+        }
+        return key_list_scan(list->keys, list->count, key);
+    }
+    unsigned int h = key_list_hash(key, list->slot_capacity);
+    while (list->slots[h] != -1) {
+        if (key_compare(key, list->keys[list->slots[h]])) {
+            return list->slots[h];
+        }
+        h = (h + 1) & (list->slot_capacity - 1);
+    }
+    return -1;
+}
+
 key_list_t *key_list_create(value_releaser releaser) 
 {
     key_list_t * list = (key_list_t * )malloc(sizeof(key_list_t));
     list->count = 0;
     list->header = NULL;
     list->releaser = releaser;
+    list->keys = NULL;
+    list->nodes = NULL;
+    list->capacity = 0;
+    list->slots = NULL;
+    list->slot_capacity = 0;
     return list;
 }
 
@@ -30,6 +164,9 @@ int key_list_destroy(key_list_t *list)
         free(current);        
         current = next;
     }
+    free(list->nodes);
+    free(list->keys);
+    free(list->slots);
     free(list);
     return 0;
 }
@@ -58,18 +195,20 @@ int key_list_keyset(key_list_t *list, key_t* array, int array_size)
 
 static key_list_node_t* key_list_get_node(key_list_t *list, key_t key) 
 {
-    key_list_node_t *current = list->header;    
-    while (current != NULL) {
-        if (key_compare(key,current->key)) {
-            return current;
-        }       
-        current = current->next;
+    int position = key_list_position(list, key);
+    if (position < 0) {
+        return NULL;
     }
-    return NULL;
+    return list->nodes[position];
 }
 
 static int key_list_remove_node(key_list_t *list, key_list_node_t *node) 
 {
+    /* move the last key into the hole, then reindex */
+    int position = key_list_position(list, node->key);
+    list->keys[position] = list->keys[list->count - 1];
+    list->nodes[position] = list->nodes[list->count - 1];
+
     if (node == list->header) {
         list->header = node->next;
     }
@@ -86,6 +225,16 @@ static int key_list_remove_node(key_list_t *list, key_list_node_t *node)
     free(node);
     list->count--;
 
+    if (list->slots != NULL) {
+        if (list->count <= KEY_LIST_HASH_THRESHOLD / 2) {
+            free(list->slots);
+            list->slots = NULL;
+        }
+        else {
+            key_list_build_slots(list);
+        }
+    }
+
     return 0;
 }
 
@@ -100,6 +249,21 @@ int key_list_add(key_list_t *list, key_t key, value_t value)
         return -1;
     }
 
+    if (list->count == list->capacity) {
+        int capacity = list->capacity == 0 ? KEY_LIST_INITIAL_CAPACITY : list->capacity * 2;
+        key_t *keys = (key_t *)realloc(list->keys, capacity * sizeof(key_t));
+        if (keys == NULL) {
+            return -1;
+        }
+        list->keys = keys;
+        key_list_node_t **nodes = (key_list_node_t **)realloc(list->nodes, capacity * sizeof(key_list_node_t *));
+        if (nodes == NULL) {
+            return -1;
+        }
+        list->nodes = nodes;
+        list->capacity = capacity;
+    }
+
     key_list_node_t* node = calloc(1, sizeof(key_list_node_t));
     if (node == NULL) {
         return -1;
@@ -115,8 +279,22 @@ int key_list_add(key_list_t *list, key_t key, value_t value)
         list->header->prev = node;                
     }
     list->header = node;      
+    list->keys[list->count] = key;
+    list->nodes[list->count] = node;
     list->count++;
 
+    if (list->slots != NULL && list->count * 2 <= list->slot_capacity) {
+        unsigned int h = key_list_hash(key, list->slot_capacity);
+        while (list->slots[h] != -1) {
+            h = (h + 1) & (list->slot_capacity - 1);
+        }
+        list->slots[h] = list->count - 1;
+    }
+    else if (list->slots != NULL || list->count > KEY_LIST_HASH_THRESHOLD) {
+        /* a failed build leaves the scan in place, which still works */
+        key_list_build_slots(list);
+    }
+
     return 0;   
 }
 
@@ -31,10 +31,25 @@ typedef struct key_list_node {
     struct key_list_node *next;
 } key_list_node_t;
 
+/*
+ * Lookups go through an index chosen by size: a packed array of keys,
+ * scanned with SIMD compares, while the list is small, plus an
+ * open-addressing table of positions once it grows past
+ * KEY_LIST_HASH_THRESHOLD keys (see TLV/bench.c for the crossover).
+ */
+#ifndef KEY_LIST_HASH_THRESHOLD
+#define KEY_LIST_HASH_THRESHOLD 16
+#endif
+
 typedef struct key_list {
     int count;
     key_list_node_t *header;      
     value_releaser releaser;
+    key_t *keys;                  /* packed keys, keys[i] is in nodes[i] */
+    key_list_node_t **nodes;
+    int capacity;                 /* size of keys and nodes */
+    int *slots;                   /* positions by key hash, -1 if empty; NULL while small */
+    int slot_capacity;
 } key_list_t;
 
 key_list_t *key_list_create(value_releaser releaser);
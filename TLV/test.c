@@ -11,8 +11,10 @@
  *  or (at your option) any later version.
  */
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include "tlv_box.h"
+#include "tlv_parser.h"
 
 #define TEST_TYPE_0 0x00
 #define TEST_TYPE_1 0x01
@@ -25,8 +27,46 @@
 #define TEST_TYPE_8 0x08
 #define TEST_TYPE_9 0x09
 
+typedef struct {
+    char c;
+    short s;
+    int i;
+    double d;
+    char *str;
+    tlv_t bytes;
+} test_record_t;
+
 #define LOG(format,...) printf(format, ##__VA_ARGS__)
 
+/* walks the serialized box alongside the parser */
+typedef struct {
+    unsigned char *buffer;
+    int size;
+    int offset;
+    int fields;
+} field_check_t;
+
+/* each field delivered must be the next one encoded in the box */
+static int check_field(void *ctx, int type, unsigned char *value, int length)
+{
+    field_check_t *check = (field_check_t *)ctx;
+    int expected_type, expected_length;
+    if (check->size - check->offset < (int)sizeof(int) * 2) {
+        return -1;
+    }
+    memcpy(&expected_type, check->buffer + check->offset, sizeof(int));
+    memcpy(&expected_length, check->buffer + check->offset + sizeof(int), sizeof(int));
+    check->offset += sizeof(int) * 2;
+    if (type != expected_type || length != expected_length ||
+        length > check->size - check->offset ||
+        memcmp(value, check->buffer + check->offset, length) != 0) {
+        return -1;
+    }
+    check->offset += length;
+    check->fields++;
+    return 0;
+}
+
 int main(int argc, char const *argv[])
 {
     tlv_box_t *box = tlv_box_create();    
@@ -149,6 +189,137 @@ int main(int argc, char const *argv[])
         LOG("\n");
     }
 
+    {
+        static const tlv_field_t fields[] = {
+            { TEST_TYPE_1, TLV_FIELD_CHAR,   offsetof(test_record_t, c) },
+            { TEST_TYPE_2, TLV_FIELD_SHORT,  offsetof(test_record_t, s) },
+            { TEST_TYPE_3, TLV_FIELD_INT,    offsetof(test_record_t, i) },
+            { TEST_TYPE_6, TLV_FIELD_DOUBLE, offsetof(test_record_t, d) },
+            { TEST_TYPE_7, TLV_FIELD_STRING, offsetof(test_record_t, str) },
+            { TEST_TYPE_8, TLV_FIELD_BYTES,  offsetof(test_record_t, bytes) },
+        };
+        test_record_t record;
+        int decoded = tlv_box_decode(parsedBox, fields, sizeof(fields) / sizeof(fields[0]), &record);
+        if (decoded != 6 || record.c != 'x' || record.s != 2 || record.i != 3 ||
+            strcmp(record.str, "hello world !") != 0 || record.bytes.length != 6) {
+            LOG("tlv_box_decode failed !\n");
+            return -1;
+        }
+        LOG("tlv_box_decode success %c %d %d %f %s %d bytes \n", record.c, record.s,
+            record.i, record.d, record.str, record.bytes.length);
+
+        /* descriptor counts the index can't hold are refused, not looped on */
+        if (tlv_box_decode(parsedBox, fields, 0, &record) != -1 ||
+            tlv_box_decode(parsedBox, fields, -1, &record) != -1 ||
+            tlv_box_decode(parsedBox, fields, 1 << 30, &record) != -1) {
+            LOG("tlv_box_decode bad count failed !\n");
+            return -1;
+        }
+        LOG("tlv_box_decode bad count success \n");
+    }
+
+    {
+        /* a string field must end in NUL within its length */
+        typedef struct { char *str; } string_record_t;
+        const tlv_field_t fields[] = {
+            { TEST_TYPE_7, TLV_FIELD_STRING, offsetof(string_record_t, str) },
+        };
+        const char *values[] = { "abc", "", "abc" };
+        const int lengths[] = { 3, 0, 4 };
+        int i;
+        for (i = 0; i < 3; i++) {
+            tlv_box_t *strings = tlv_box_create();
+            tlv_box_t *parsed;
+            string_record_t record;
+            int decoded;
+            tlv_box_put_bytes(strings, TEST_TYPE_7, (unsigned char *)values[i], lengths[i]);
+            tlv_box_serialize(strings);
+            parsed = tlv_box_parse(tlv_box_get_buffer(strings), tlv_box_get_size(strings));
+            decoded = parsed != NULL ? tlv_box_decode(parsed, fields, 1, &record) : -2;
+            if (decoded != (i == 2 ? 1 : -1)) {
+                LOG("tlv_box_decode unterminated string failed !\n");
+                return -1;
+            }
+            tlv_box_destroy(parsed);
+            tlv_box_destroy(strings);
+        }
+        LOG("tlv_box_decode unterminated string success \n");
+    }
+
+    {
+        /* truncated and corrupted copies must be rejected, never overread */
+        unsigned char *buffer = tlv_box_get_buffer(box);
+        int size = tlv_box_get_size(box);
+        int inputs = 0, rejected = 0, i, bit;
+        for (i = 0; i < size; i++) {
+            unsigned char *truncated = (unsigned char *) malloc(i + 1);
+            memcpy(truncated, buffer, i);
+            tlv_box_t *parsed = tlv_box_parse(truncated, i);
+            inputs++;
+            if (parsed == NULL) {
+                rejected++;
+            } else {
+                tlv_box_destroy(parsed);
+            }
+            free(truncated);
+        }
+        for (i = 0; i < size; i++) {
+            for (bit = 0; bit < 8; bit++) {
+                unsigned char *mutated = (unsigned char *) malloc(size);
+                memcpy(mutated, buffer, size);
+                mutated[i] ^= (unsigned char)(1 << bit);
+                tlv_box_t *parsed = tlv_box_parse(mutated, size);
+                inputs++;
+                if (parsed == NULL) {
+                    rejected++;
+                } else {
+                    tlv_box_destroy(parsed);
+                }
+                free(mutated);
+            }
+        }
+        /* a repeated tag is well framed but can't be indexed */
+        unsigned char *twice = (unsigned char *) malloc((size_t)size * 2);
+        memcpy(twice, buffer, size);
+        memcpy(twice + size, buffer, size);
+        tlv_box_t *duplicate = tlv_box_parse(twice, size * 2);
+        free(twice);
+        if (tlv_box_validate(buffer, size) != 0 || rejected == 0 || duplicate != NULL) {
+            LOG("tlv_box_validate failed !\n");
+            return -1;
+        }
+        LOG("tlv_box_validate success, %d of %d damaged inputs rejected \n", rejected, inputs);
+    }
+
+    {
+        /* feed the box one byte at a time, then in uneven chunks */
+        unsigned char *buffer = tlv_box_get_buffer(box);
+        int size = tlv_box_get_size(box);
+        field_check_t bytewise = {buffer, size, 0, 0};
+        field_check_t chunked = {buffer, size, 0, 0};
+        int i;
+        tlv_parser_t *parser = tlv_parser_create(check_field, &bytewise, 1024);
+        for (i = 0; i < size; i++) {
+            tlv_parser_feed(parser, buffer + i, 1);
+        }
+        int finished = tlv_parser_finish(parser);
+        tlv_parser_destroy(parser);
+
+        parser = tlv_parser_create(check_field, &chunked, 1024);
+        for (i = 0; i < size; i += 7) {
+            tlv_parser_feed(parser, buffer + i, size - i < 7 ? size - i : 7);
+        }
+        finished |= tlv_parser_finish(parser);
+        tlv_parser_destroy(parser);
+
+        if (finished != 0 || bytewise.fields != 8 || chunked.fields != 8 ||
+            bytewise.offset != size || chunked.offset != size) {
+            LOG("tlv_parser failed !\n");
+            return -1;
+        }
+        LOG("tlv_parser success, %d fields \n", bytewise.fields);
+    }
+
     tlv_box_destroy(box);
     tlv_box_destroy(boxes);
     tlv_box_destroy(parsedBox);
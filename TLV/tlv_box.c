@@ -45,26 +45,68 @@ int tlv_box_putobject(tlv_box_t *box, int type, void *value, int length)
     object.value = tlv;
 
     if (key_list_add(box->m_list, type, object) != 0) {
+        tlv_box_release_tlv(object);
         return -1;
     }    
     box->m_serialized_bytes += sizeof(int) * 2 + length;
     
     return 0;
 }
-tlv_box_t *tlv_box_parse(unsigned char *buffer, int buffersize)
+/*
+ * Check that the headers in buffer tile it exactly: every length is
+ * non-negative and fits in the bytes that follow it. The loop has no
+ * early exit; a bad length is folded into a flag and clamped, so the
+ * common (valid) case runs without unpredictable branches.
+ */
+int tlv_box_validate(const unsigned char *buffer, int buffersize)
+{
+    if (buffersize < 0) {
+        return -1;
+    }
+
+    unsigned int size = (unsigned int)buffersize, offset = 0, bad = 0;
+    while (size - offset >= sizeof(int) * 2) {
+        int length;
+        memcpy(&length, buffer + offset + sizeof(int), sizeof(int));
+        unsigned int left = size - offset - sizeof(int) * 2;
+        unsigned int overrun = (unsigned int)length > left;
+        bad |= overrun;
+        offset += sizeof(int) * 2 + (overrun ? left : (unsigned int)length);
+    }
+    bad |= offset != size;
+
+    return bad ? -1 : 0;
+}
+
+/*
+ * Parse a buffer already known to be well formed (produced by
+ * tlv_box_serialize, or passed through tlv_box_validate). No length is
+ * checked, so untrusted input must go through tlv_box_parse instead.
+ */
+tlv_box_t *tlv_box_parse_trusted(unsigned char *buffer, int buffersize)
 {
     tlv_box_t *box = tlv_box_create();
 
     unsigned char *cached = (unsigned char*) malloc(buffersize);
+    if (cached == NULL) {
+        tlv_box_destroy(box);
+        return NULL;
+    }
     memcpy(cached, buffer, buffersize);
 
-    int offset = 0, length = 0;
+    /* a duplicate tag would leave the index disagreeing with the buffer */
+    int offset = 0;
     while (offset < buffersize) {
-        int type = (*(int *)(cached + offset));
+        int type, length;
+        memcpy(&type, cached + offset, sizeof(int));
         offset += sizeof(int);
-        int length = (*(int *)(cached + offset));
+        memcpy(&length, cached + offset, sizeof(int));
         offset += sizeof(int);
-        tlv_box_putobject(box, type, cached+offset, length);
+        if (tlv_box_putobject(box, type, cached+offset, length) != 0) {
+            free(cached);
+            tlv_box_destroy(box);
+            return NULL;
+        }
         offset += length;
     }
 
@@ -74,6 +116,14 @@ tlv_box_t *tlv_box_parse(unsigned char *buffer, int buffersize)
     return box;
 }
 
+tlv_box_t *tlv_box_parse(unsigned char *buffer, int buffersize)
+{
+    if (tlv_box_validate(buffer, buffersize) != 0) {
+        return NULL;
+    }
+    return tlv_box_parse_trusted(buffer, buffersize);
+}
+
 int tlv_box_destroy(tlv_box_t *box)
 {
     key_list_destroy(box->m_list);
@@ -288,5 +338,115 @@ int tlv_box_get_object(tlv_box_t *box, int type, tlv_box_t **object)
     }
     tlv_t *tlv = (tlv_t *) value.value;
     *object = (tlv_box_t *)tlv_box_parse(tlv->value, tlv->length);
+    if (*object == NULL) {
+        return -1;
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+#define TLV_DECODE_STACK_SLOTS 64
+#define TLV_DECODE_MAX_FIELDS (1 << 20)
+
+static int tlv_field_size(int kind)
+{
+    switch (kind) {
+    case TLV_FIELD_CHAR:     return sizeof(char);
+    case TLV_FIELD_SHORT:    return sizeof(short);
+    case TLV_FIELD_INT:      return sizeof(int);
+    case TLV_FIELD_LONG:     return sizeof(long);
+    case TLV_FIELD_LONGLONG: return sizeof(long long);
+    case TLV_FIELD_FLOAT:    return sizeof(float);
+    case TLV_FIELD_DOUBLE:   return sizeof(double);
+    default:                 return -1;
+    }
+}
+
+static unsigned int tlv_field_hash(int type, unsigned int mask)
+{
+    return ((unsigned int)type * 2654435761u) & mask;
+}
+
+/*
+ * Fill the caller's struct in one sweep over the box: the descriptors are
+ * indexed by tag in a small open-addressing table, so each field of the
+ * box costs one probe instead of a key_list walk per requested tag.
+ * Return the number of descriptors filled, or -1 if a field's length
+ * doesn't match its kind, a string field isn't NUL-terminated, or count
+ * is out of range.
+ */
+int tlv_box_decode(tlv_box_t *box, const tlv_field_t *fields, int count, void *out)
+{
+    if (count <= 0 || count > TLV_DECODE_MAX_FIELDS) {
+        return -1;
+    }
+
+    unsigned int slots = 1;
+    while (slots < (unsigned int)count * 2) {
+        slots <<= 1;
+    }
+
+    int stack_index[TLV_DECODE_STACK_SLOTS];
+    int *index = stack_index;
+    if (slots > TLV_DECODE_STACK_SLOTS) {
+        index = (int *)malloc(slots * sizeof(int));
+        if (index == NULL) {
+            return -1;
+        }
+    }
+    memset(index, -1, slots * sizeof(int));
+
+    unsigned int mask = slots - 1;
+    int i = 0;
+    for (i = 0; i < count; i++) {
+        unsigned int h = tlv_field_hash(fields[i].type, mask);
+        while (index[h] != -1) {
+            h = (h + 1) & mask;
+        }
+        index[h] = i;
+    }
+
+    int decoded = 0;
+    key_list_foreach(box->m_list, node) {
+        tlv_t *tlv = (tlv_t *) node->value.value;
+        unsigned int h = tlv_field_hash(tlv->type, mask);
+        int found = -1;
+        while (index[h] != -1) {
+            if (fields[index[h]].type == tlv->type) {
+                found = index[h];
+                break;
+            }
+            h = (h + 1) & mask;
+        }
+        if (found == -1) {
+            continue;
+        }
+
+        const tlv_field_t *field = &fields[found];
+        unsigned char *dest = (unsigned char *)out + field->offset;
+        if (field->kind == TLV_FIELD_STRING) {
+            /* parsing doesn't check strings: a field that isn't
+               NUL-terminated would be read past its end */
+            if (tlv->length <= 0 || tlv->value[tlv->length - 1] != '\0') {
+                decoded = -1;
+                break;
+            }
+            *(char **)dest = (char *)tlv->value;
+        }
+        else if (field->kind == TLV_FIELD_BYTES) {
+            memcpy(dest, tlv, sizeof(tlv_t));
+        }
+        else if (tlv_field_size(field->kind) == tlv->length) {
+            memcpy(dest, tlv->value, tlv->length);
+        }
+        else {
+            decoded = -1;
+            break;
+        }
+        decoded++;
+    }
+
+    if (index != stack_index) {
+        free(index);
+    }
+    return decoded;
+}
@@ -21,6 +21,25 @@ typedef struct _tlv {
     unsigned char *value;
 } tlv_t;
 
+/* value kinds for tlv_box_decode */
+enum {
+    TLV_FIELD_CHAR,
+    TLV_FIELD_SHORT,
+    TLV_FIELD_INT,
+    TLV_FIELD_LONG,
+    TLV_FIELD_LONGLONG,
+    TLV_FIELD_FLOAT,
+    TLV_FIELD_DOUBLE,
+    TLV_FIELD_STRING,   /* char* into the box, valid until it is destroyed */
+    TLV_FIELD_BYTES,    /* tlv_t whose value points into the box */
+};
+
+typedef struct _tlv_field {
+    int type;           /* tag to look for */
+    int kind;           /* TLV_FIELD_* */
+    size_t offset;      /* where to store the value in the caller's struct */
+} tlv_field_t;
+
 typedef struct _tlv_box {
     key_list_t *m_list;
     unsigned char *m_serialized_buffer;
@@ -31,6 +50,8 @@ static void tlv_box_release_tlv(value_t value);
 
 tlv_box_t *tlv_box_create();
 tlv_box_t *tlv_box_parse(unsigned char *buffer,int buffersize);
+tlv_box_t *tlv_box_parse_trusted(unsigned char *buffer,int buffersize);
+int tlv_box_validate(const unsigned char *buffer,int buffersize);
 int tlv_box_destroy(tlv_box_t *box);
 
 unsigned char *tlv_box_get_buffer(tlv_box_t *box);
@@ -60,4 +81,6 @@ int tlv_box_get_bytes(tlv_box_t *box,int type,unsigned char *value,int* length);
 int tlv_box_get_bytes_ptr(tlv_box_t *box,int type,unsigned char **value,int* length);
 int tlv_box_get_object(tlv_box_t *box,int type,tlv_box_t **object);
 
+int tlv_box_decode(tlv_box_t *box,const tlv_field_t *fields,int count,void *out);
+
 #endif //_TLV_BOX_H_
@@ -0,0 +1,137 @@
+/*
+ *  Incremental (push) parser for TLV streams, see tlv_parser.h.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "tlv_parser.h"
+
+#define TLV_HEADER_SIZE ((int)sizeof(int) * 2)
+
+tlv_parser_t *tlv_parser_create(tlv_field_handler handler, void *ctx, int max_length)
+{
+    tlv_parser_t *parser = (tlv_parser_t *)calloc(1, sizeof(tlv_parser_t));
+    if (parser == NULL) {
+        return NULL;
+    }
+    parser->m_handler = handler;
+    parser->m_ctx = ctx;
+    parser->m_max_length = max_length;
+    parser->m_length = -1;
+    return parser;
+}
+
+int tlv_parser_destroy(tlv_parser_t *parser)
+{
+    free(parser->m_partial);
+    free(parser);
+    return 0;
+}
+
+static int tlv_parser_emit(tlv_parser_t *parser, unsigned char *value)
+{
+    int result = parser->m_handler(parser->m_ctx, parser->m_type, value, parser->m_length);
+    parser->m_header_bytes = 0;
+    parser->m_length = -1;
+    parser->m_partial_bytes = 0;
+    if (result != 0) {
+        parser->m_error = result;
+    }
+    return result;
+}
+
+/*
+ * Consume data, emitting every field it completes. Return 0 on success,
+ * -1 if a field length is negative or above the parser's maximum, or the
+ * handler's non-zero result; after an error the parser stays stopped.
+ */
+int tlv_parser_feed(tlv_parser_t *parser, const unsigned char *data, int size)
+{
+    int offset = 0;
+    if (parser->m_error != 0) {
+        return parser->m_error;
+    }
+
+    while (offset < size) {
+        /* finish the header, possibly spread over several chunks */
+        if (parser->m_length < 0) {
+            if (parser->m_header_bytes == 0 && size - offset >= TLV_HEADER_SIZE) {
+                memcpy(parser->m_header, data + offset, TLV_HEADER_SIZE);
+                parser->m_header_bytes = TLV_HEADER_SIZE;
+                offset += TLV_HEADER_SIZE;
+            }
+            else {
+                int take = TLV_HEADER_SIZE - parser->m_header_bytes;
+                if (take > size - offset) {
+                    take = size - offset;
+                }
+                memcpy(parser->m_header + parser->m_header_bytes, data + offset, take);
+                parser->m_header_bytes += take;
+                offset += take;
+                if (parser->m_header_bytes < TLV_HEADER_SIZE) {
+                    break;
+                }
+            }
+            int length;
+            memcpy(&parser->m_type, parser->m_header, sizeof(int));
+            memcpy(&length, parser->m_header + sizeof(int), sizeof(int));
+            if (length < 0 || length > parser->m_max_length) {
+                parser->m_error = -1;
+                return -1;
+            }
+            parser->m_length = length;
+        }
+
+        /* a value already complete in this chunk is handed out in place */
+        int left = size - offset;
+        if (parser->m_partial_bytes == 0 && left >= parser->m_length) {
+            unsigned char *value = (unsigned char *)data + offset;
+            offset += parser->m_length;
+            if (tlv_parser_emit(parser, value) != 0) {
+                return parser->m_error;
+            }
+            continue;
+        }
+
+        /* otherwise keep just this field's bytes until the rest arrives */
+        if (parser->m_partial_capacity < parser->m_length) {
+            unsigned char *grown = (unsigned char *)realloc(parser->m_partial, parser->m_length);
+            if (grown == NULL) {
+                parser->m_error = -1;
+                return -1;
+            }
+            parser->m_partial = grown;
+            parser->m_partial_capacity = parser->m_length;
+        }
+        int take = parser->m_length - parser->m_partial_bytes;
+        if (take > left) {
+            take = left;
+        }
+        memcpy(parser->m_partial + parser->m_partial_bytes, data + offset, take);
+        parser->m_partial_bytes += take;
+        offset += take;
+        if (parser->m_partial_bytes == parser->m_length) {
+            if (tlv_parser_emit(parser, parser->m_partial) != 0) {
+                return parser->m_error;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Return the number of bytes held for a field that isn't complete yet. */
+int tlv_parser_pending(tlv_parser_t *parser)
+{
+    if (parser->m_length < 0) {
+        return parser->m_header_bytes;
+    }
+    return TLV_HEADER_SIZE + parser->m_partial_bytes;
+}
+
+/* Return 0 if the stream ended on a field boundary, -1 if it was truncated. */
+int tlv_parser_finish(tlv_parser_t *parser)
+{
+    if (parser->m_error != 0) {
+        return parser->m_error;
+    }
+    return tlv_parser_pending(parser) == 0 ? 0 : -1;
+}
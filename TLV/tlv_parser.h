@@ -0,0 +1,38 @@
+/*
+ *  Incremental (push) parser for TLV streams.
+ *
+ *  Bytes can be fed in chunks of any size as they arrive from a pipe or
+ *  socket. Every complete field is passed to a callback; fields that lie
+ *  entirely within one chunk are passed in place, and only a field split
+ *  across chunks is copied into the parser's buffer, so memory stays
+ *  bounded by the largest field and nothing is scanned twice.
+ */
+#ifndef _TLV_PARSER_H_
+#define _TLV_PARSER_H_
+
+/* Called for each complete field; value is only valid during the call.
+ * Return 0 to continue, non-zero to stop parsing with that result. */
+typedef int (*tlv_field_handler)(void *ctx, int type, unsigned char *value, int length);
+
+typedef struct _tlv_parser {
+    tlv_field_handler m_handler;
+    void *m_ctx;
+    int m_max_length;              /* longest field accepted */
+    unsigned char m_header[sizeof(int) * 2];
+    int m_header_bytes;            /* bytes of the current header seen */
+    int m_type;
+    int m_length;
+    unsigned char *m_partial;      /* value of a field split across chunks */
+    int m_partial_bytes;
+    int m_partial_capacity;
+    int m_error;                   /* sticky result once parsing stopped */
+} tlv_parser_t;
+
+tlv_parser_t *tlv_parser_create(tlv_field_handler handler, void *ctx, int max_length);
+int tlv_parser_destroy(tlv_parser_t *parser);
+
+int tlv_parser_feed(tlv_parser_t *parser, const unsigned char *data, int size);
+int tlv_parser_finish(tlv_parser_t *parser);
+int tlv_parser_pending(tlv_parser_t *parser);
+
+#endif //_TLV_PARSER_H_
@@ -0,0 +1,541 @@
+#include "aio.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "ring.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define AIO_URING 1
+#endif
+#endif
+#endif
+
+#define MAX_IO_THREADS 4  // pread/pwrite threads of the fallback
+
+// One read or write of a buffer.
+typedef struct {
+    unsigned char* buffer;
+    size_t size;             // bytes to transfer
+    off_t offset;
+    ssize_t result;          // bytes transferred, or -1
+    _Atomic bool done;
+    bool busy;               // submitted and not yet waited for
+    struct iovec iov;
+} aio_request;
+
+#ifdef AIO_URING
+// io_uring instance, driven through raw system calls. Only the thread
+// owning the reader or writer touches it.
+typedef struct {
+    int fd;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+} uring;
+#endif
+
+// Submits requests for one file descriptor and waits for them.
+typedef struct {
+    int fd;
+    bool writing;
+    bool seekable;
+    bool use_uring;
+#ifdef AIO_URING
+    uring ring;
+#endif
+    mpmc_ring* queue;        // fallback: requests for the I/O threads
+    pthread_t threads[MAX_IO_THREADS];
+    size_t thread_count;
+    ring_event done;         // fallback: notified as requests complete
+} aio_engine;
+
+struct aio_reader {
+    aio_engine engine;
+    aio_request* requests;
+    size_t depth;
+    size_t block_size;
+    size_t current;          // index of the next block to hand out
+    off_t next_offset;       // offset of the next block to request
+    bool held;               // the previous block is still the caller's
+    bool eof;                // a read came back short: no more requests
+    const unsigned char* data;  // current block, for aio_reader_getline
+    size_t data_size;
+    size_t data_pos;
+};
+
+struct aio_writer {
+    aio_engine engine;
+    aio_request* requests;
+    size_t depth;
+    size_t block_size;
+    size_t current;          // buffer being filled
+    size_t fill;             // bytes in the current buffer
+    off_t offset;            // where the current buffer goes
+    bool failed;
+};
+
+// Transfer what's left of req synchronously, after a short or failed
+// asynchronous transfer. Reads stop at end of file.
+static void finish_request(aio_engine* e, aio_request* req) {
+    size_t done = req->result > 0 ? (size_t)req->result : 0;
+    while (done < req->size) {
+        ssize_t n;
+        if (e->seekable) {
+            n = e->writing ? pwrite(e->fd, req->buffer + done, req->size - done, req->offset + done)
+                           : pread(e->fd, req->buffer + done, req->size - done, req->offset + done);
+        } else {
+            n = e->writing ? write(e->fd, req->buffer + done, req->size - done)
+                           : read(e->fd, req->buffer + done, req->size - done);
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            req->result = -1;
+            return;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    req->result = e->writing && done < req->size ? -1 : (ssize_t)done;
+}
+
+static void* io_thread(void* arg) {
+    aio_engine* e = arg;
+    void* item;
+    while (mpmc_ring_pop_wait(e->queue, &item, 1) == 1) {
+        aio_request* req = item;
+        req->result = 0;
+        finish_request(e, req);
+        atomic_store_explicit(&req->done, true, memory_order_release);
+        ring_event_notify(&e->done);
+    }
+    return NULL;
+}
+
+#ifdef AIO_URING
+static int uring_setup(uring* u, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    u->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (u->fd < 0) {
+        return -1;
+    }
+    u->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+        if (u->cq_ring_size > u->sq_ring_size) {
+            u->sq_ring_size = u->cq_ring_size;
+        }
+        u->cq_ring_size = u->sq_ring_size;
+    }
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->cq_ring = single ? u->sq_ring
+                        : mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+        if (u->sq_ring != MAP_FAILED) {
+            munmap(u->sq_ring, u->sq_ring_size);
+        }
+        if (!single && u->cq_ring != MAP_FAILED) {
+            munmap(u->cq_ring, u->cq_ring_size);
+        }
+        if (u->sqes != MAP_FAILED) {
+            munmap(u->sqes, u->sqes_size);
+        }
+        close(u->fd);
+        return -1;
+    }
+    unsigned char* sq = u->sq_ring;
+    unsigned char* cq = u->cq_ring;
+    u->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    u->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    u->sq_array = (unsigned*)(sq + params.sq_off.array);
+    u->cq_head = (unsigned*)(cq + params.cq_off.head);
+    u->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    u->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+static void uring_free(uring* u) {
+    munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring != u->sq_ring) {
+        munmap(u->cq_ring, u->cq_ring_size);
+    }
+    munmap(u->sq_ring, u->sq_ring_size);
+    close(u->fd);
+}
+
+// Queue req and hand it to the kernel. Return -1 if that failed.
+static int uring_submit(uring* u, int fd, bool writing, aio_request* req) {
+    unsigned tail = *u->sq_tail;
+    unsigned index = tail & *u->sq_mask;
+    struct io_uring_sqe* sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    req->iov.iov_base = req->buffer;
+    req->iov.iov_len = req->size;
+    sqe->opcode = writing ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)&req->iov;
+    sqe->len = 1;
+    sqe->off = req->offset;
+    sqe->user_data = (uintptr_t)req;
+    u->sq_array[index] = index;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    while (syscall(__NR_io_uring_enter, u->fd, 1, 0, 0, NULL, 0) < 0) {
+        if (errno != EINTR && errno != EAGAIN) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Reap completions until req is done.
+static void uring_wait(uring* u, aio_request* req) {
+    while (!atomic_load_explicit(&req->done, memory_order_relaxed)) {
+        unsigned head = *u->cq_head;
+        if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+            syscall(__NR_io_uring_enter, u->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            continue;
+        }
+        struct io_uring_cqe* cqe = &u->cqes[head & *u->cq_mask];
+        aio_request* completed = (aio_request*)(uintptr_t)cqe->user_data;
+        completed->result = cqe->res < 0 ? 0 : cqe->res;
+        atomic_store_explicit(&completed->done, true, memory_order_relaxed);
+        __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+    }
+}
+#endif
+
+static int engine_init(aio_engine* e, int fd, bool writing, size_t depth) {
+    memset(e, 0, sizeof(*e));
+    e->fd = fd;
+    e->writing = writing;
+    e->seekable = lseek(fd, 0, SEEK_CUR) >= 0;
+    ring_event_init(&e->done);
+#ifdef AIO_URING
+    if (e->seekable && uring_setup(&e->ring, depth) == 0) {
+        e->use_uring = true;
+        return 0;
+    }
+#endif
+    // Requests on a pipe must run in order, on a single thread.
+    size_t threads = e->seekable ? (depth < MAX_IO_THREADS ? depth : MAX_IO_THREADS) : 1;
+    e->queue = mpmc_ring_create(depth);
+    if (e->queue == NULL) {
+        return -1;
+    }
+    for (; e->thread_count < threads; e->thread_count++) {
+        if (pthread_create(&e->threads[e->thread_count], NULL, io_thread, e) != 0) {
+            break;
+        }
+    }
+    return e->thread_count > 0 ? 0 : -1;
+}
+
+static void engine_free(aio_engine* e) {
+#ifdef AIO_URING
+    if (e->use_uring) {
+        uring_free(&e->ring);
+        return;
+    }
+#endif
+    if (e->queue != NULL) {
+        mpmc_ring_close(e->queue);
+        for (size_t i = 0; i < e->thread_count; i++) {
+            pthread_join(e->threads[i], NULL);
+        }
+        mpmc_ring_destroy(e->queue);
+    }
+}
+
+static void engine_submit(aio_engine* e, aio_request* req) {
+    atomic_store_explicit(&req->done, false, memory_order_relaxed);
+    req->result = 0;
+    req->busy = true;
+#ifdef AIO_URING
+    if (e->use_uring) {
+        if (uring_submit(&e->ring, e->fd, e->writing, req) != 0) {
+            // Leave it to engine_wait to do synchronously.
+            atomic_store_explicit(&req->done, true, memory_order_relaxed);
+        }
+        return;
+    }
+#endif
+    void* item = req;
+    mpmc_ring_push_wait(e->queue, &item, 1);
+}
+
+// Wait for req, finishing a short transfer synchronously. Return its result.
+static ssize_t engine_wait(aio_engine* e, aio_request* req) {
+#ifdef AIO_URING
+    if (e->use_uring) {
+        uring_wait(&e->ring, req);
+        req->busy = false;
+        if ((size_t)req->result < req->size) {
+            finish_request(e, req);
+        }
+        return req->result;
+    }
+#endif
+    while (!atomic_load_explicit(&req->done, memory_order_acquire)) {
+        uint32_t seen = ring_event_prepare(&e->done);
+        if (atomic_load_explicit(&req->done, memory_order_acquire)) {
+            ring_event_cancel(&e->done);
+            break;
+        }
+        ring_event_wait(&e->done, seen);
+    }
+    req->busy = false;
+    return req->result;
+}
+
+// Allocate depth requests with buffers of block_size bytes.
+static aio_request* requests_create(size_t depth, size_t block_size) {
+    aio_request* requests = calloc(depth, sizeof(aio_request));
+    if (requests == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < depth; i++) {
+        requests[i].buffer = malloc(block_size);
+        if (requests[i].buffer == NULL) {
+            for (size_t j = 0; j < i; j++) {
+                free(requests[j].buffer);
+            }
+            free(requests);
+            return NULL;
+        }
+    }
+    return requests;
+}
+
+static void requests_free(aio_request* requests, size_t depth) {
+    for (size_t i = 0; i < depth; i++) {
+        free(requests[i].buffer);
+    }
+    free(requests);
+}
+
+static void reader_request(aio_reader* reader, aio_request* req) {
+    req->size = reader->block_size;
+    req->offset = reader->next_offset;
+    reader->next_offset += reader->block_size;
+    engine_submit(&reader->engine, req);
+}
+
+aio_reader* aio_reader_open(int fd, off_t offset, size_t block_size, size_t depth) {
+    aio_reader* reader = calloc(1, sizeof(aio_reader));
+    if (reader == NULL) {
+        return NULL;
+    }
+    reader->depth = depth > 0 ? depth : 1;
+    reader->block_size = block_size > 0 ? block_size : AIO_DEFAULT_BLOCK;
+    reader->next_offset = offset;
+    reader->requests = requests_create(reader->depth, reader->block_size);
+    if (reader->requests == NULL) {
+        free(reader);
+        return NULL;
+    }
+    if (engine_init(&reader->engine, fd, false, reader->depth) != 0) {
+        engine_free(&reader->engine);
+        requests_free(reader->requests, reader->depth);
+        free(reader);
+        return NULL;
+    }
+    for (size_t i = 0; i < reader->depth; i++) {
+        reader_request(reader, &reader->requests[i]);
+    }
+    return reader;
+}
+
+void aio_reader_close(aio_reader* reader) {
+    for (size_t i = 0; i < reader->depth; i++) {
+        if (reader->requests[i].busy) {
+            engine_wait(&reader->engine, &reader->requests[i]);
+        }
+    }
+    engine_free(&reader->engine);
+    requests_free(reader->requests, reader->depth);
+    free(reader);
+}
+
+ssize_t aio_reader_next(aio_reader* reader, const unsigned char** data) {
+    // The caller is done with the previous block: reuse its buffer.
+    if (reader->held) {
+        reader->held = false;
+        if (!reader->eof) {
+            reader_request(reader, &reader->requests[(reader->current - 1) % reader->depth]);
+        }
+    }
+    aio_request* req = &reader->requests[reader->current % reader->depth];
+    if (!req->busy) {
+        return 0;
+    }
+    ssize_t n = engine_wait(&reader->engine, req);
+    if (n < 0) {
+        return -1;
+    }
+    if ((size_t)n < req->size) {
+        reader->eof = true;
+    }
+    if (n == 0) {
+        return 0;
+    }
+    *data = req->buffer;
+    reader->held = true;
+    reader->current++;
+    return n;
+}
+
+ssize_t aio_reader_getline(aio_reader* reader, char** line, size_t* capacity) {
+    size_t length = 0;
+    for (;;) {
+        if (reader->data_pos == reader->data_size) {
+            ssize_t n = aio_reader_next(reader, &reader->data);
+            if (n <= 0) {
+                return n < 0 || length == 0 ? -1 : (ssize_t)length;
+            }
+            reader->data_size = n;
+            reader->data_pos = 0;
+        }
+        const unsigned char* start = reader->data + reader->data_pos;
+        size_t available = reader->data_size - reader->data_pos;
+        const unsigned char* newline = memchr(start, '\n', available);
+        size_t take = newline != NULL ? (size_t)(newline - start) + 1 : available;
+        if (length + take + 1 > *capacity) {
+            size_t grown_capacity = *capacity > 0 ? *capacity : 128;
+            while (grown_capacity < length + take + 1) {
+                grown_capacity *= 2;
+            }
+            char* grown = realloc(*line, grown_capacity);
+            if (grown == NULL) {
+                return -1;
+            }
+            *line = grown;
+            *capacity = grown_capacity;
+        }
+        memcpy(*line + length, start, take);
+        length += take;
+        (*line)[length] = '\0';
+        reader->data_pos += take;
+        if (newline != NULL) {
+            return length;
+        }
+    }
+}
+
+aio_writer* aio_writer_open(int fd, off_t offset, size_t block_size, size_t depth) {
+    aio_writer* writer = calloc(1, sizeof(aio_writer));
+    if (writer == NULL) {
+        return NULL;
+    }
+    writer->depth = depth > 0 ? depth : 1;
+    writer->block_size = block_size > 0 ? block_size : AIO_DEFAULT_BLOCK;
+    writer->offset = offset;
+    writer->requests = requests_create(writer->depth, writer->block_size);
+    if (writer->requests == NULL) {
+        free(writer);
+        return NULL;
+    }
+    if (engine_init(&writer->engine, fd, true, writer->depth) != 0) {
+        engine_free(&writer->engine);
+        requests_free(writer->requests, writer->depth);
+        free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+// Hand the current buffer to the engine and move to the next one.
+static void writer_submit(aio_writer* writer) {
+    aio_request* req = &writer->requests[writer->current];
+    req->size = writer->fill;
+    req->offset = writer->offset;
+    writer->offset += writer->fill;
+    engine_submit(&writer->engine, req);
+    writer->current = (writer->current + 1) % writer->depth;
+    writer->fill = 0;
+}
+
+int aio_writer_write(void* ctx, const void* data, size_t size) {
+    aio_writer* writer = ctx;
+    const unsigned char* p = data;
+    while (size > 0) {
+        aio_request* req = &writer->requests[writer->current];
+        if (writer->fill == 0 && req->busy &&
+            engine_wait(&writer->engine, req) != (ssize_t)req->size) {
+            writer->failed = true;
+        }
+        if (writer->failed) {
+            return -1;
+        }
+        size_t n = writer->block_size - writer->fill;
+        if (n > size) {
+            n = size;
+        }
+        memcpy(req->buffer + writer->fill, p, n);
+        writer->fill += n;
+        p += n;
+        size -= n;
+        if (writer->fill == writer->block_size) {
+            writer_submit(writer);
+        }
+    }
+    return 0;
+}
+
+int aio_writer_close(aio_writer* writer) {
+    aio_request* req = &writer->requests[writer->current];
+    if (writer->fill > 0 && !writer->failed) {
+        writer_submit(writer);
+    }
+    for (size_t i = 0; i < writer->depth; i++) {
+        req = &writer->requests[i];
+        if (req->busy && engine_wait(&writer->engine, req) != (ssize_t)req->size) {
+            writer->failed = true;
+        }
+    }
+    int result = writer->failed ? -1 : 0;
+    engine_free(&writer->engine);
+    requests_free(writer->requests, writer->depth);
+    free(writer);
+    return result;
+}
+
+bool aio_reader_uring(aio_reader* reader) {
+    return reader->engine.use_uring;
+}
+
+bool aio_writer_uring(aio_writer* writer) {
+    return writer->engine.use_uring;
+}
@@ -0,0 +1,58 @@
+// Overlapped file I/O with a fixed number of buffers in flight.
+//
+// An aio_reader keeps reading the next blocks of a file while the caller
+// works on the current one; an aio_writer fills one buffer while earlier
+// ones are still being written. Requests go through io_uring when the
+// kernel allows it, and otherwise to I/O threads doing pread/pwrite (or
+// read/write, one at a time, for pipes). Either way the caller only blocks
+// on the disk when every buffer is busy.
+
+#ifndef _aio_H
+#define _aio_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define AIO_DEFAULT_BLOCK (1 << 20)
+#define AIO_DEFAULT_DEPTH 3          // triple buffering
+
+// Reader and writer: open with aio_*_open, free with aio_*_close.
+typedef struct aio_reader aio_reader;
+typedef struct aio_writer aio_writer;
+
+// Start reading fd from offset, keeping depth blocks of block_size bytes
+// in flight. fd stays open and owned by the caller. Return NULL if out of
+// memory.
+aio_reader* aio_reader_open(int fd, off_t offset, size_t block_size, size_t depth);
+
+// Wait for any reads in flight and free the reader.
+void aio_reader_close(aio_reader* reader);
+
+// Set *data to the next block of the file, valid until the next call, and
+// return its size: block_size, less at the end of the file, 0 once the
+// file is exhausted, or -1 on error.
+ssize_t aio_reader_next(aio_reader* reader, const unsigned char** data);
+
+// Read the next line like getline: store it, with its newline and a
+// terminating NUL, in *line (grown along with *capacity as needed). Return
+// its length, or -1 at end of file or on error.
+ssize_t aio_reader_getline(aio_reader* reader, char** line, size_t* capacity);
+
+// Start writing to fd at offset, with depth buffers of block_size bytes.
+// fd stays open and owned by the caller. Return NULL if out of memory.
+aio_writer* aio_writer_open(int fd, off_t offset, size_t block_size, size_t depth);
+
+// Append size bytes; a block_sink and pipeline_sink over an aio_writer.
+// Return 0 on success, -1 if a write has failed.
+int aio_writer_write(void* writer, const void* data, size_t size);
+
+// Write out the last buffer, wait for every write and free the writer.
+// Return 0 if everything was written, -1 otherwise.
+int aio_writer_close(aio_writer* writer);
+
+// Return true if requests of reader or writer go through io_uring.
+bool aio_reader_uring(aio_reader* reader);
+bool aio_writer_uring(aio_writer* writer);
+
+#endif // _aio_H
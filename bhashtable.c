@@ -0,0 +1,231 @@
+#include "bhashtable.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Hash table entry (slot may be filled or empty).
+typedef struct {
+    const void* key;  // key is NULL if this slot is empty
+    size_t size;
+    uint64_t hash;
+    void* value;
+} bhashtable_entry;
+
+// Hash table structure: create with bhashtable_create, free with bhashtable_destroy.
+struct bhashtable {
+    bhashtable_entry* entries;  // hash slots
+    size_t capacity;            // size of entries array
+    size_t length;              // number of items in hash table
+    bhashtable_hash_fn hash;
+    bhashtable_equal_fn equal;  // NULL for memcmp
+};
+
+#define INITIAL_CAPACITY 16  // must be a power of two
+#define SHRINK_MIN_CAPACITY 16
+
+#define FNV_OFFSET 14695981039346656037UL
+#define FNV_PRIME 1099511628211UL
+
+// Return 64-bit FNV-1a hash of size bytes of key.
+static uint64_t fnv1a(const void* key, size_t size) {
+    const unsigned char* p = key;
+    uint64_t hash = FNV_OFFSET;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (uint64_t)p[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+bhashtable* bhashtable_create(bhashtable_hash_fn hash, bhashtable_equal_fn equal) {
+    bhashtable* table = malloc(sizeof(bhashtable));
+    if (table == NULL) {
+        return NULL;
+    }
+    table->length = 0;
+    table->capacity = INITIAL_CAPACITY;
+    table->hash = hash != NULL ? hash : fnv1a;
+    table->equal = equal;
+    table->entries = calloc(table->capacity, sizeof(bhashtable_entry));
+    if (table->entries == NULL) {
+        free(table);
+        return NULL;
+    }
+    return table;
+}
+
+void bhashtable_destroy(bhashtable* table) {
+    for (size_t i = 0; i < table->capacity; i++) {
+        free((void*)table->entries[i].key);
+    }
+    free(table->entries);
+    free(table);
+}
+
+uint64_t bhashtable_hash(bhashtable* table, const void* key, size_t size) {
+    return table->hash(key, size);
+}
+
+// Return true if entry holds key (whose hash is hash).
+static bool entry_matches(bhashtable* table, const bhashtable_entry* entry,
+                          const void* key, size_t size, uint64_t hash) {
+    if (entry->hash != hash) {
+        return false;
+    }
+    if (table->equal != NULL) {
+        return table->equal(entry->key, entry->size, key, size);
+    }
+    return entry->size == size && memcmp(entry->key, key, size) == 0;
+}
+
+// Return index of key's slot, or of the empty slot where it would go.
+static size_t find_slot(bhashtable* table, const void* key, size_t size,
+                        uint64_t hash) {
+    size_t mask = table->capacity - 1;
+    size_t index = (size_t)(hash & mask);
+    while (table->entries[index].key != NULL &&
+            !entry_matches(table, &table->entries[index], key, size, hash)) {
+        index = (index + 1) & mask;
+    }
+    return index;
+}
+
+void* bhashtable_get_hashed(bhashtable* table, const void* key, size_t size,
+                            uint64_t hash) {
+    size_t index = find_slot(table, key, size, hash);
+    return table->entries[index].key != NULL ? table->entries[index].value : NULL;
+}
+
+void* bhashtable_get(bhashtable* table, const void* key, size_t size) {
+    return bhashtable_get_hashed(table, key, size, table->hash(key, size));
+}
+
+// Move all entries to a new array of new_capacity slots, reusing their
+// stored hashes. Return true on success, false if out of memory.
+static bool bhashtable_resize(bhashtable* table, size_t new_capacity) {
+    bhashtable_entry* new_entries = calloc(new_capacity, sizeof(bhashtable_entry));
+    if (new_entries == NULL) {
+        return false;
+    }
+    size_t mask = new_capacity - 1;
+    for (size_t i = 0; i < table->capacity; i++) {
+        bhashtable_entry entry = table->entries[i];
+        if (entry.key == NULL) {
+            continue;
+        }
+        size_t index = (size_t)(entry.hash & mask);
+        while (new_entries[index].key != NULL) {
+            index = (index + 1) & mask;
+        }
+        new_entries[index] = entry;
+    }
+    free(table->entries);
+    table->entries = new_entries;
+    table->capacity = new_capacity;
+    return true;
+}
+
+const void* bhashtable_set_hashed(bhashtable* table, const void* key, size_t size,
+                                  uint64_t hash, void* value) {
+    assert(value != NULL);
+    if (value == NULL) {
+        return NULL;
+    }
+
+    // If length will exceed half of current capacity, expand it.
+    if (table->length >= table->capacity / 2) {
+        size_t new_capacity = table->capacity * 2;
+        if (new_capacity < table->capacity || !bhashtable_resize(table, new_capacity)) {
+            return NULL;
+        }
+    }
+
+    size_t index = find_slot(table, key, size, hash);
+    bhashtable_entry* entry = &table->entries[index];
+    if (entry->key != NULL) {
+        entry->value = value;
+        return entry->key;
+    }
+
+    // Copy at least one byte so empty keys still get a non-NULL address.
+    void* copy = malloc(size > 0 ? size : 1);
+    if (copy == NULL) {
+        return NULL;
+    }
+    memcpy(copy, key, size);
+    entry->key = copy;
+    entry->size = size;
+    entry->hash = hash;
+    entry->value = value;
+    table->length++;
+    return copy;
+}
+
+const void* bhashtable_set(bhashtable* table, const void* key, size_t size,
+                           void* value) {
+    return bhashtable_set_hashed(table, key, size, table->hash(key, size), value);
+}
+
+void* bhashtable_remove(bhashtable* table, const void* key, size_t size) {
+    size_t mask = table->capacity - 1;
+    size_t index = find_slot(table, key, size, table->hash(key, size));
+    if (table->entries[index].key == NULL) {
+        return NULL;
+    }
+    void* value = table->entries[index].value;
+    free((void*)table->entries[index].key);
+
+    // Backward-shift deletion, as in hashtable_remove.
+    size_t hole = index, next = index;
+    for (;;) {
+        next = (next + 1) & mask;
+        if (table->entries[next].key == NULL) {
+            break;
+        }
+        size_t home = (size_t)(table->entries[next].hash & mask);
+        bool stays = hole <= next ? (hole < home && home <= next)
+                                  : (hole < home || home <= next);
+        if (!stays) {
+            table->entries[hole] = table->entries[next];
+            hole = next;
+        }
+    }
+    memset(&table->entries[hole], 0, sizeof(bhashtable_entry));
+    table->length--;
+
+    if (table->capacity > SHRINK_MIN_CAPACITY && table->length < table->capacity / 8) {
+        size_t new_capacity = table->capacity;
+        while (new_capacity > SHRINK_MIN_CAPACITY && table->length < new_capacity / 8) {
+            new_capacity /= 2;
+        }
+        bhashtable_resize(table, new_capacity);  // on failure, just stay large
+    }
+    return value;
+}
+
+size_t bhashtable_length(bhashtable* table) {
+    return table->length;
+}
+
+bhashtablei bhashtable_iterator(bhashtable* table) {
+    bhashtablei it;
+    it._table = table;
+    it._index = 0;
+    return it;
+}
+
+bool bhashtable_next(bhashtablei* it) {
+    bhashtable* table = it->_table;
+    while (it->_index < table->capacity) {
+        size_t i = it->_index;
+        it->_index++;
+        if (table->entries[i].key != NULL) {
+            it->key = table->entries[i].key;
+            it->size = table->entries[i].size;
+            it->value = table->entries[i].value;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,80 @@
+// Hash table keyed by arbitrary byte strings, implemented in C.
+//
+// Same design as hashtable (open addressing, linear probing, at most half
+// full), but keys are (pointer, size) pairs, so they may hold embedded NULs
+// or encoded TLV records. Each entry keeps its key's hash, which is compared
+// before the keys themselves and reused when the table is resized. Callers
+// that already know a key's hash can pass it to the *_hashed functions.
+
+#ifndef _bhashtable_H
+#define _bhashtable_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Hash of size bytes of key.
+typedef uint64_t (*bhashtable_hash_fn)(const void* key, size_t size);
+
+// Return true if the two keys are equal.
+typedef bool (*bhashtable_equal_fn)(const void* a, size_t a_size,
+                                    const void* b, size_t b_size);
+
+// Hash table structure: create with bhashtable_create, free with bhashtable_destroy.
+typedef struct bhashtable bhashtable;
+
+// Create hash table and return pointer to it, or NULL if out of memory.
+// hash and equal may be NULL for 64-bit FNV-1a and byte-wise comparison.
+bhashtable* bhashtable_create(bhashtable_hash_fn hash, bhashtable_equal_fn equal);
+
+// Free memory allocated for hash table, including copied keys.
+void bhashtable_destroy(bhashtable* table);
+
+// Return hash of key as computed by this table's hash function.
+uint64_t bhashtable_hash(bhashtable* table, const void* key, size_t size);
+
+// Get item with given key from hash table. Return value (which was set
+// with bhashtable_set), or NULL if key not found.
+void* bhashtable_get(bhashtable* table, const void* key, size_t size);
+
+// Same as bhashtable_get, with hash already computed by bhashtable_hash.
+void* bhashtable_get_hashed(bhashtable* table, const void* key, size_t size,
+                            uint64_t hash);
+
+// Set item with given key to value (which must not be NULL). If not
+// already present in table, size bytes of key are copied to newly
+// allocated memory. Return address of copied key, or NULL if out of memory.
+const void* bhashtable_set(bhashtable* table, const void* key, size_t size,
+                           void* value);
+
+// Same as bhashtable_set, with hash already computed by bhashtable_hash.
+const void* bhashtable_set_hashed(bhashtable* table, const void* key, size_t size,
+                                  uint64_t hash, void* value);
+
+// Remove item with given key, freeing its copied key. Return its value,
+// or NULL if key not found. Shrinks the table once it's below an eighth full.
+void* bhashtable_remove(bhashtable* table, const void* key, size_t size);
+
+// Return number of items in hash table.
+size_t bhashtable_length(bhashtable* table);
+
+// Hash table iterator: create with bhashtable_iterator, iterate with bhashtable_next.
+typedef struct {
+    const void* key;  // current key
+    size_t size;      // size of current key
+    void* value;      // current value
+
+    // Don't use these fields directly.
+    bhashtable* _table;  // reference to hash table being iterated
+    size_t _index;       // current index into bhashtable.entries
+} bhashtablei;
+
+// Return new hash table iterator (for use with bhashtable_next).
+bhashtablei bhashtable_iterator(bhashtable* table);
+
+// Move iterator to next item in hash table, update iterator's key, size
+// and value to current item, and return true. If there are no more items,
+// return false. Don't change the table during iteration.
+bool bhashtable_next(bhashtablei* it);
+
+#endif // _bhashtable_H
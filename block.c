@@ -0,0 +1,295 @@
+#include "block.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "crc32c.h"
+
+// Block writer structure: create with block_writer_create, free with block_writer_destroy.
+struct block_writer {
+    block_sink sink;
+    void* ctx;
+    unsigned char* buffer;  // header followed by payload
+    size_t capacity;        // size of buffer
+    size_t size;            // bytes used in buffer, header included
+    uint32_t records;       // records in the current block
+    uint32_t crc;           // running CRC-32C of the payload
+};
+
+#define FRAME_SIZE (sizeof(int) * 2)
+
+block_writer* block_writer_create(block_sink sink, void* ctx, size_t block_size) {
+    block_writer* writer = malloc(sizeof(block_writer));
+    if (writer == NULL) {
+        return NULL;
+    }
+    writer->capacity = BLOCK_HEADER_SIZE + block_size;
+    writer->buffer = malloc(writer->capacity);
+    if (writer->buffer == NULL) {
+        free(writer);
+        return NULL;
+    }
+    writer->sink = sink;
+    writer->ctx = ctx;
+    writer->size = BLOCK_HEADER_SIZE;
+    writer->records = 0;
+    writer->crc = 0;
+    return writer;
+}
+
+void block_writer_destroy(block_writer* writer) {
+    free(writer->buffer);
+    free(writer);
+}
+
+int block_writer_flush(block_writer* writer) {
+    if (writer->records == 0) {
+        return 0;
+    }
+    block_header header;
+    header.magic = BLOCK_MAGIC;
+    header.size = (uint32_t)(writer->size - BLOCK_HEADER_SIZE);
+    header.records = writer->records;
+    header.crc = writer->crc;
+    memcpy(writer->buffer, &header, BLOCK_HEADER_SIZE);
+
+    int result = writer->sink(writer->ctx, writer->buffer, writer->size);
+    writer->size = BLOCK_HEADER_SIZE;
+    writer->records = 0;
+    writer->crc = 0;
+    return result;
+}
+
+int block_writer_add(block_writer* writer, const void* record, size_t size) {
+    size_t needed = FRAME_SIZE + size;
+    if (size > INT32_MAX) {
+        return -1;
+    }
+    if (writer->size + needed > writer->capacity) {
+        if (block_writer_flush(writer) != 0) {
+            return -1;
+        }
+        // An oversized record gets a block of its own.
+        if (BLOCK_HEADER_SIZE + needed > writer->capacity) {
+            unsigned char* grown = realloc(writer->buffer, BLOCK_HEADER_SIZE + needed);
+            if (grown == NULL) {
+                return -1;
+            }
+            writer->buffer = grown;
+            writer->capacity = BLOCK_HEADER_SIZE + needed;
+        }
+    }
+
+    // Checksum the frame while it's still in cache from the copy.
+    unsigned char* out = writer->buffer + writer->size;
+    int type = BLOCK_RECORD_TYPE, length = (int)size;
+    memcpy(out, &type, sizeof(int));
+    memcpy(out + sizeof(int), &length, sizeof(int));
+    memcpy(out + FRAME_SIZE, record, size);
+    writer->crc = crc32c_update(writer->crc, out, needed);
+    writer->size += needed;
+    writer->records++;
+    return 0;
+}
+
+int block_scan(const block_header* header, const unsigned char* payload,
+               block_record_fn fn, void* ctx) {
+    if (header->magic != BLOCK_MAGIC) {
+        return -1;
+    }
+
+    // First pass: walk the frames, checking each length against the bytes
+    // left and extending the checksum frame by frame.
+    size_t offset = 0, size = header->size;
+    uint32_t crc = 0, records = 0;
+    while (offset < size) {
+        int type, length;
+        if (size - offset < FRAME_SIZE) {
+            return -1;
+        }
+        memcpy(&type, payload + offset, sizeof(int));
+        memcpy(&length, payload + offset + sizeof(int), sizeof(int));
+        if (type != BLOCK_RECORD_TYPE || length < 0 ||
+                (size_t)length > size - offset - FRAME_SIZE) {
+            return -1;
+        }
+        crc = crc32c_update(crc, payload + offset, FRAME_SIZE + (size_t)length);
+        offset += FRAME_SIZE + (size_t)length;
+        records++;
+    }
+    if (crc != header->crc || records != header->records) {
+        return -1;
+    }
+    if (fn == NULL) {
+        return 0;
+    }
+
+    // Second pass only hops between frame headers, which are now trusted.
+    offset = 0;
+    while (offset < size) {
+        int length;
+        memcpy(&length, payload + offset + sizeof(int), sizeof(int));
+        int result = fn(ctx, payload + offset + FRAME_SIZE, (size_t)length);
+        if (result != 0) {
+            return result;
+        }
+        offset += FRAME_SIZE + (size_t)length;
+    }
+    return 0;
+}
+
+void block_commit_marker(unsigned char* marker, uint64_t offset, uint32_t records) {
+    block_header header;
+    header.magic = BLOCK_COMMIT_MAGIC;
+    header.size = sizeof(uint64_t);
+    header.records = records;
+    header.crc = crc32c(&offset, sizeof(uint64_t));
+    memcpy(marker, &header, BLOCK_HEADER_SIZE);
+    memcpy(marker + BLOCK_HEADER_SIZE, &offset, sizeof(uint64_t));
+}
+
+bool block_check_commit(const block_header* header, const unsigned char* payload,
+                        uint64_t* offset) {
+    if (header->magic != BLOCK_COMMIT_MAGIC || header->size != sizeof(uint64_t) ||
+            header->crc != crc32c(payload, sizeof(uint64_t))) {
+        return false;
+    }
+    memcpy(offset, payload, sizeof(uint64_t));
+    return true;
+}
+
+// Return false if in is a regular file with fewer than size bytes left.
+static bool payload_fits(FILE* in, uint32_t size) {
+    struct stat st;
+    off_t position = ftello(in);
+    if (position < 0 || fstat(fileno(in), &st) != 0 || !S_ISREG(st.st_mode)) {
+        return true;
+    }
+    return position <= st.st_size && size <= (uint64_t)(st.st_size - position);
+}
+
+int block_read(FILE* in, block_header* header, unsigned char** buffer,
+               size_t* capacity) {
+    size_t got = fread(header, 1, BLOCK_HEADER_SIZE, in);
+    if (got == 0 && feof(in)) {
+        return 0;
+    }
+    if (got != BLOCK_HEADER_SIZE ||
+            (header->magic != BLOCK_MAGIC && header->magic != BLOCK_COMMIT_MAGIC)) {
+        return -1;
+    }
+    if ((header->magic == BLOCK_COMMIT_MAGIC && header->size != sizeof(uint64_t)) ||
+            !payload_fits(in, header->size)) {
+        return -1;
+    }
+
+    // The size isn't checked by the CRC yet, so the buffer only grows as
+    // payload actually arrives: a damaged header on a pipe can't allocate
+    // much more than the stream holds.
+    size_t got_payload = 0;
+    while (got_payload < header->size) {
+        if (got_payload == *capacity) {
+            size_t grown_capacity = *capacity < BLOCK_DEFAULT_SIZE ? BLOCK_DEFAULT_SIZE : *capacity * 2;
+            if (grown_capacity > header->size) {
+                grown_capacity = header->size;
+            }
+            unsigned char* grown = realloc(*buffer, grown_capacity);
+            if (grown == NULL) {
+                return -1;
+            }
+            *buffer = grown;
+            *capacity = grown_capacity;
+        }
+        size_t end = header->size < *capacity ? header->size : *capacity;
+        if (fread(*buffer + got_payload, 1, end - got_payload, in) != end - got_payload) {
+            return -1;
+        }
+        got_payload = end;
+    }
+    return 1;
+}
+
+bool block_find_commit(FILE* in) {
+    unsigned char window[64 * 1024];
+    size_t kept = 0, n;
+    while ((n = fread(window + kept, 1, sizeof(window) - kept, in)) > 0) {
+        size_t size = kept + n;
+        for (size_t i = 0; i + BLOCK_COMMIT_SIZE <= size; i++) {
+            block_header header;
+            uint64_t offset;
+            memcpy(&header, window + i, BLOCK_HEADER_SIZE);
+            if (header.magic == BLOCK_COMMIT_MAGIC &&
+                    block_check_commit(&header, window + i + BLOCK_HEADER_SIZE, &offset)) {
+                return true;
+            }
+        }
+        // Keep the bytes that may start a marker cut off by the window.
+        kept = size < BLOCK_COMMIT_SIZE - 1 ? size : BLOCK_COMMIT_SIZE - 1;
+        memmove(window, window + size - kept, kept);
+    }
+    return false;
+}
+
+static int count_record(void* ctx, const unsigned char* record, size_t size) {
+    (void)record;
+    (void)size;
+    (*(size_t*)ctx)++;
+    return 0;
+}
+
+int block_verify(FILE* in, block_verification* result) {
+    block_header header;
+    unsigned char* payload = NULL;
+    size_t capacity = 0, blocks = 0, records = 0;
+    uint64_t offset = 0, marker;
+    bool damaged = false, followed = false;
+    int status;
+    memset(result, 0, sizeof(*result));
+
+    while (!followed && (status = block_read(in, &header, &payload, &capacity)) != 0) {
+        if (status != 1) {
+            // Without a header to find the next block by, look for a commit
+            // marker anywhere further on instead.
+            if (!damaged) {
+                damaged = true;
+                result->bad_offset = offset;
+            }
+            followed = block_find_commit(in);
+            break;
+        }
+        bool valid;
+        if (header.magic == BLOCK_COMMIT_MAGIC) {
+            valid = block_check_commit(&header, payload, &marker) && marker == offset;
+            if (valid && !damaged) {
+                result->has_markers = true;
+                result->end = offset + BLOCK_COMMIT_SIZE;
+                result->blocks = blocks;
+                result->records = records;
+            }
+        } else {
+            // Records of blocks past the damage aren't counted.
+            valid = block_scan(&header, payload, damaged ? NULL : count_record, &records) == 0;
+            blocks += valid && !damaged;
+        }
+        if (!valid && !damaged) {
+            damaged = true;
+            result->bad_offset = offset;
+        }
+        followed = valid && damaged;
+        offset += BLOCK_HEADER_SIZE + header.size;
+    }
+    free(payload);
+
+    if (damaged && (!result->has_markers || followed)) {
+        return -1;
+    }
+    if (result->has_markers) {
+        result->torn = damaged || offset != result->end;
+    } else {
+        result->end = offset;
+        result->blocks = blocks;
+        result->records = records;
+    }
+    return 0;
+}
@@ -0,0 +1,110 @@
+// Checksummed blocks of TLV records.
+//
+// A block is a 16-byte header followed by a payload of records. Each record
+// is framed as a TLV entry with type BLOCK_RECORD_TYPE (tag 0, which the
+// converter never assigns to a key), so a block payload can also be read
+// with tlv_parser. The header holds the payload size, the number of records
+// and the CRC-32C of the payload:
+//
+//     uint32 magic | uint32 payload bytes | uint32 records | uint32 crc32c
+//
+// A durable writer also emits commit markers: a header with magic
+// BLOCK_COMMIT_MAGIC whose 8-byte payload is the file offset of the marker.
+// Everything before a valid marker had been synced to disk when the marker
+// was written; readers ignore whatever follows the last one.
+//
+// All integers are in host byte order, like the rest of the TLV format.
+
+#ifndef _block_H
+#define _block_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define BLOCK_MAGIC 0x42564c54u  // "TLVB"
+#define BLOCK_COMMIT_MAGIC 0x43564c54u  // "TLVC"
+#define BLOCK_HEADER_SIZE 16
+#define BLOCK_RECORD_TYPE 0
+#define BLOCK_DEFAULT_SIZE (1 << 20)
+#define BLOCK_COMMIT_SIZE (BLOCK_HEADER_SIZE + 8)
+
+// Header of one block, as stored in the file.
+typedef struct {
+    uint32_t magic;
+    uint32_t size;     // payload bytes following the header
+    uint32_t records;  // number of records in the payload
+    uint32_t crc;      // CRC-32C of the payload
+} block_header;
+
+// Destination of finished blocks. Return 0 on success, -1 on error.
+typedef int (*block_sink)(void* ctx, const void* data, size_t size);
+
+// Block writer: create with block_writer_create, free with block_writer_destroy.
+typedef struct block_writer block_writer;
+
+// Create a writer that hands blocks of about block_size bytes to sink.
+// Return NULL if out of memory.
+block_writer* block_writer_create(block_sink sink, void* ctx, size_t block_size);
+
+// Free the writer. Records not yet flushed are discarded.
+void block_writer_destroy(block_writer* writer);
+
+// Append one encoded record, flushing the current block first if the
+// record doesn't fit. Return 0 on success, -1 on error.
+int block_writer_add(block_writer* writer, const void* record, size_t size);
+
+// Write out the current block, if it holds any records. Return 0 on
+// success, -1 on error.
+int block_writer_flush(block_writer* writer);
+
+// Called with each record of a verified block. Return 0 to continue, or
+// non-zero to stop.
+typedef int (*block_record_fn)(void* ctx, const unsigned char* record, size_t size);
+
+// Verify one block payload against its header and pass its records to fn.
+// The checksum is computed in the same pass that walks the record frames;
+// fn only sees records once the whole payload has checked out. Return 0 on
+// success, -1 if the block is corrupt, or fn's non-zero result.
+int block_scan(const block_header* header, const unsigned char* payload,
+               block_record_fn fn, void* ctx);
+
+// Fill marker (BLOCK_COMMIT_SIZE bytes) with a commit marker placed at
+// offset, after a total of records records.
+void block_commit_marker(unsigned char* marker, uint64_t offset, uint32_t records);
+
+// Return true if header and payload form a valid commit marker, and set
+// *offset to the offset it was written at.
+bool block_check_commit(const block_header* header, const unsigned char* payload,
+                        uint64_t* offset);
+
+// Read the next block or commit marker from in, reusing *buffer (grown as needed) for its
+// payload; check it with block_scan. Return 1 if a block was read, 0 at end
+// of file, or -1 if the block is truncated or its header is invalid,
+// including a payload size larger than what is left of the file.
+int block_read(FILE* in, block_header* header, unsigned char** buffer,
+               size_t* capacity);
+
+// Scan in from its current position for a valid commit marker. Return
+// true if one is found; the stream is then somewhere past it.
+bool block_find_commit(FILE* in);
+
+// Result of block_verify.
+typedef struct {
+    size_t blocks;          // valid blocks, up to the last commit if there are markers
+    size_t records;         // records in those blocks
+    bool has_markers;       // the file was written by a durable writer
+    uint64_t end;           // bytes that checked out (with markers, up to the last one)
+    bool torn;              // something after the last marker was ignored
+    uint64_t bad_offset;    // offset of the first damaged block or marker
+} block_verification;
+
+// Check every block and commit marker of in, from its start. If the file
+// has markers, a damaged block after the last valid one is a torn tail from
+// an unfinished write, and is ignored as long as no valid block or marker
+// follows it. Return 0 if the file (or its committed part) is intact, -1
+// if it's corrupt, with result->bad_offset set.
+int block_verify(FILE* in, block_verification* result);
+
+#endif // _block_H
@@ -0,0 +1,236 @@
+#include "checkpoint.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+
+#define CHECKPOINT_MAGIC 0x4b564c54u  // "TLVK"
+#define CHECKPOINT_VERSION 1
+
+// Checkpoint being serialized or parsed.
+typedef struct {
+    unsigned char* data;
+    size_t size;
+    size_t capacity;
+    size_t pos;     // read position
+    bool failed;
+} buffer;
+
+static void put(buffer* b, const void* data, size_t size) {
+    if (b->size + size > b->capacity) {
+        size_t capacity = b->capacity > 0 ? b->capacity : 4096;
+        while (capacity < b->size + size) {
+            capacity *= 2;
+        }
+        unsigned char* grown = realloc(b->data, capacity);
+        if (grown == NULL) {
+            b->failed = true;
+            return;
+        }
+        b->data = grown;
+        b->capacity = capacity;
+    }
+    memcpy(b->data + b->size, data, size);
+    b->size += size;
+}
+
+static void put_u32(buffer* b, uint32_t v) {
+    put(b, &v, sizeof(v));
+}
+
+static void put_u64(buffer* b, uint64_t v) {
+    put(b, &v, sizeof(v));
+}
+
+static bool get(buffer* b, void* data, size_t size) {
+    if (size > b->size - b->pos) {
+        return false;
+    }
+    memcpy(data, b->data + b->pos, size);
+    b->pos += size;
+    return true;
+}
+
+// Keys read from a checkpoint, with their tags.
+typedef struct {
+    char** keys;
+    int** tags;
+    size_t count;
+    size_t capacity;
+} dictionary;
+
+static bool add_key(dictionary* d, const char* key, size_t length, uint32_t tag) {
+    if (d->count == d->capacity) {
+        size_t capacity = d->capacity > 0 ? d->capacity * 2 : 256;
+        char** keys = realloc(d->keys, capacity * sizeof(char*));
+        if (keys == NULL) {
+            return false;
+        }
+        d->keys = keys;
+        int** tags = realloc(d->tags, capacity * sizeof(int*));
+        if (tags == NULL) {
+            return false;
+        }
+        d->tags = tags;
+        d->capacity = capacity;
+    }
+    char* copy = strndup(key, length);
+    int* value = malloc(sizeof(int));
+    if (copy == NULL || value == NULL) {
+        free(copy);
+        free(value);
+        return false;
+    }
+    *value = (int)tag;
+    d->keys[d->count] = copy;
+    d->tags[d->count] = value;
+    d->count++;
+    return true;
+}
+
+// Make the rename of a file in the directory of path durable.
+static void sync_directory(const char* path) {
+    const char* slash = strrchr(path, '/');
+    char* dir = slash != NULL ? strndup(path, slash == path ? 1 : (size_t)(slash - path)) : strdup(".");
+    if (dir == NULL) {
+        return;
+    }
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+int checkpoint_save(const char* path, const char* input, const checkpoint* cp,
+                    const converter* conv) {
+    size_t tags = conv->counter - 1;
+    const char** keys = calloc(tags + 1, sizeof(char*));
+    if (keys == NULL) {
+        return -1;
+    }
+    hashtablei it = hashtable_iterator(conv->key_hashtable);
+    while (hashtable_next(&it)) {
+        int tag = *(int*)it.value;
+        if (tag >= 1 && (size_t)tag <= tags) {
+            keys[tag - 1] = it.key;
+        }
+    }
+
+    buffer b = { 0 };
+    put_u32(&b, CHECKPOINT_MAGIC);
+    put_u32(&b, CHECKPOINT_VERSION);
+    put_u64(&b, cp->input_offset);
+    put_u64(&b, cp->output_length);
+    put_u64(&b, conv->counter);
+    put_u32(&b, strlen(input));
+    put(&b, input, strlen(input));
+    for (size_t i = 0; i < tags; i++) {
+        if (keys[i] == NULL) {
+            continue;  // a tag given back by a rolled-back record
+        }
+        put_u32(&b, i + 1);
+        put_u32(&b, strlen(keys[i]));
+        put(&b, keys[i], strlen(keys[i]));
+    }
+    put_u32(&b, 0);  // end of keys
+    put_u32(&b, crc32c(b.data, b.size));
+    free(keys);
+    if (b.failed) {
+        free(b.data);
+        return -1;
+    }
+
+    // Write it aside, sync it and rename it over the previous one.
+    size_t length = strlen(path);
+    char* temp = malloc(length + sizeof(".tmp"));
+    int result = -1;
+    if (temp != NULL) {
+        memcpy(temp, path, length);
+        memcpy(temp + length, ".tmp", sizeof(".tmp"));
+        int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            bool written = write(fd, b.data, b.size) == (ssize_t)b.size && fsync(fd) == 0;
+            if (close(fd) == 0 && written && rename(temp, path) == 0) {
+                sync_directory(path);
+                result = 0;
+            } else {
+                unlink(temp);
+            }
+        }
+        free(temp);
+    }
+    free(b.data);
+    return result;
+}
+
+int checkpoint_load(const char* path, const char* input, checkpoint* cp, converter* conv) {
+    FILE* in = fopen(path, "rb");
+    if (in == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    buffer b = { 0 };
+    unsigned char chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+        put(&b, chunk, n);
+    }
+    bool ok = !ferror(in) && !b.failed && b.size >= 4;
+    fclose(in);
+
+    uint32_t magic, version, crc, input_length, tag, key_length;
+    uint64_t next_tag;
+    if (ok) {
+        memcpy(&crc, b.data + b.size - 4, 4);
+        b.size -= 4;
+        ok = crc32c(b.data, b.size) == crc &&
+             get(&b, &magic, 4) && magic == CHECKPOINT_MAGIC &&
+             get(&b, &version, 4) && version == CHECKPOINT_VERSION &&
+             get(&b, &cp->input_offset, 8) && get(&b, &cp->output_length, 8) &&
+             get(&b, &next_tag, 8) && get(&b, &input_length, 4) &&
+             input_length == strlen(input) && input_length <= b.size - b.pos &&
+             memcmp(b.data + b.pos, input, input_length) == 0;
+        b.pos += ok ? input_length : 0;
+    }
+    // Collect the keys with their recorded tags, then build the dictionary
+    // from them at once.
+    dictionary d = { 0 };
+    while (ok) {
+        ok = get(&b, &tag, 4);
+        if (!ok || tag == 0) {
+            break;
+        }
+        ok = tag < next_tag && get(&b, &key_length, 4) && key_length <= b.size - b.pos &&
+             add_key(&d, (char*)b.data + b.pos, key_length, tag);
+        b.pos += ok ? key_length : 0;
+    }
+    hashtable* table = NULL;
+    if (ok) {
+        table = hashtable_bulk_build((const char* const*)d.keys, (void* const*)d.tags, d.count);
+        ok = table != NULL && hashtable_length(table) == d.count;  // no key twice
+    }
+    if (ok) {
+        hashtable_destroy(conv->key_hashtable);
+        conv->key_hashtable = table;
+        conv->counter = next_tag;
+    } else if (table != NULL) {
+        hashtable_destroy(table);
+    }
+    for (size_t i = 0; i < d.count; i++) {
+        free(d.keys[i]);
+        if (!ok) {
+            free(d.tags[i]);
+        }
+    }
+    free(d.keys);
+    free(d.tags);
+    free(b.data);
+    return ok ? 1 : -1;
+}
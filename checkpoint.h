@@ -0,0 +1,36 @@
+// Checkpoints of a conversion, for resuming it after a crash.
+//
+// A checkpoint records how far the input has been converted, how long the
+// output was at that point, and the key dictionary, so a restarted
+// conversion can cut the output back, skip the converted input and carry
+// on with the same tags. The caller makes sure the output is on disk
+// before saving a checkpoint that claims it. Checkpoints are replaced
+// atomically and carry a checksum; a damaged one is refused.
+
+#ifndef _checkpoint_H
+#define _checkpoint_H
+
+#include <stdint.h>
+
+#include "convert.h"
+
+#define CHECKPOINT_DEFAULT_SECONDS 10
+
+// Progress stored in a checkpoint.
+typedef struct {
+    uint64_t input_offset;   // bytes of input converted
+    uint64_t output_length;  // bytes of output written for them
+} checkpoint;
+
+// Save cp and the dictionary of conv for input to path. Return 0 on
+// success, -1 on error.
+int checkpoint_save(const char* path, const char* input, const checkpoint* cp,
+                    const converter* conv);
+
+// Load the checkpoint at path into cp, and its dictionary into conv,
+// which must be empty; the dictionary is rebuilt with
+// hashtable_bulk_build. Return 1 if loaded, 0 if there is no checkpoint,
+// or -1 if it is damaged or was made for another input.
+int checkpoint_load(const char* path, const char* input, checkpoint* cp, converter* conv);
+
+#endif // _checkpoint_H
@@ -0,0 +1,340 @@
+#include "convert.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "TLV/tlv_box.h"
+#include "trace.h"
+
+bool converter_init(converter* conv) {
+    conv->key_hashtable = hashtable_create();
+    conv->counter = 1;
+    conv->record_schema = NULL;
+    conv->keys = NULL;
+    conv->projected = NULL;
+    conv->projected_capacity = 0;
+    conv->record_latency = NULL;
+    conv->lookup_latency = NULL;
+    conv->lookups = 0;
+    return conv->key_hashtable != NULL;
+}
+
+void converter_free(converter* conv) {
+    if (conv->record_schema != NULL) {
+        schema_destroy(conv->record_schema);
+    }
+    hashtablei it = hashtable_iterator(conv->key_hashtable);
+    while (hashtable_next(&it)) {
+        free(it.value);
+    }
+    hashtable_destroy(conv->key_hashtable);
+    free(conv->projected);
+}
+
+static int* lookup_tag(converter* conv, const char* key) {
+    int* tag = hashtable_get(conv->key_hashtable, key);
+    if (tag == NULL) {
+        tag = malloc(sizeof(int));
+        if (tag == NULL) {
+            return NULL;
+        }
+        *tag = conv->counter;
+
+        if (hashtable_set(conv->key_hashtable, key, tag) == NULL) {
+            free(tag);
+            return NULL;
+        }
+        conv->counter++;
+    }
+    return tag;
+}
+
+int* converter_tag(converter* conv, const char* key) {
+    if (conv->lookup_latency == NULL || conv->lookups++ % CONVERT_LOOKUP_SAMPLE != 0) {
+        return lookup_tag(conv, key);
+    }
+    uint64_t start = histogram_now();
+    int* tag = lookup_tag(conv, key);
+    histogram_record(conv->lookup_latency, histogram_now() - start);
+    return tag;
+}
+
+void converter_infer_schema(converter* conv, FILE* in, size_t samples) {
+    // The samples are read again after a rewind, which a pipe can't do.
+    if (fseeko(in, 0, SEEK_CUR) != 0) {
+        return;
+    }
+    schema* record_schema = schema_create();
+    char* line = NULL;
+    size_t len = 0, n = 0;
+    if (record_schema == NULL) {
+        return;
+    }
+
+    while (n < samples && getline(&line, &len, in) != -1) {
+        struct json_object* parsed_json;
+        if (!projection_parse(conv->keys, line, &conv->projected, &conv->projected_capacity,
+                              &parsed_json)) {
+            break;
+        }
+        if (parsed_json == NULL) {
+            continue;
+        }
+        if (json_object_get_type(parsed_json) == json_type_object) {
+            struct json_object_iter it;
+            json_object_object_foreachC(parsed_json, it) {
+                converter_tag(conv, it.key);
+            }
+        }
+        schema_observe(record_schema, parsed_json);
+        json_object_put(parsed_json);
+        n++;
+    }
+    free(line);
+    rewind(in);
+
+    if (!schema_finalize(record_schema, conv->key_hashtable)) {
+        schema_destroy(record_schema);
+        return;
+    }
+    conv->record_schema = record_schema;
+}
+
+// Encode record through a tlv_box, for records the schema doesn't cover.
+static int encode_generic(converter* conv, struct json_object* record,
+                          unsigned char** buffer, size_t* capacity) {
+    tlv_box_t* box = tlv_box_create();
+    int size = -1;
+    if (box == NULL) {
+        return -1;
+    }
+
+    json_object_object_foreach(record, key, val) {
+        int* tag = converter_tag(conv, key);
+        if (tag == NULL) {
+            goto done;
+        }
+        switch (json_object_get_type(val)) {
+            case json_type_int:
+                tlv_box_put_int(box, *tag, (int)json_object_get_int(val));
+                break;
+            case json_type_boolean:
+                tlv_box_put_short(box, *tag, (short)json_object_get_boolean(val));
+                break;
+            case json_type_string:
+                tlv_box_put_string(box, *tag, (char*)json_object_get_string(val));
+                break;
+            default:
+                printf("unknown data type!");
+                break;
+        }
+    }
+    if (tlv_box_serialize(box) != 0) {
+        goto done;
+    }
+
+    size = tlv_box_get_size(box);
+    if ((size_t)size > *capacity) {
+        unsigned char* grown = realloc(*buffer, size);
+        if (grown == NULL) {
+            size = -1;
+            goto done;
+        }
+        *buffer = grown;
+        *capacity = size;
+    }
+    if (size > 0) {
+        memcpy(*buffer, tlv_box_get_buffer(box), size);
+    }
+
+done:
+    tlv_box_destroy(box);
+    return size;
+}
+
+int converter_encode(converter* conv, struct json_object* record,
+                     unsigned char** buffer, size_t* capacity) {
+    if (json_object_get_type(record) != json_type_object) {
+        return CONVERT_SKIPPED;
+    }
+    if (conv->record_schema != NULL) {
+        int size = schema_encode(conv->record_schema, record, buffer, capacity);
+        if (size != 0) {
+            return size;
+        }
+    }
+    return encode_generic(conv, record, buffer, capacity);
+}
+
+static int encode_line(converter* conv, const char* line,
+                       unsigned char** buffer, size_t* capacity) {
+    uint64_t start = trace_begin();
+    struct json_object* parsed_json;
+    if (!projection_parse(conv->keys, line, &conv->projected, &conv->projected_capacity,
+                          &parsed_json)) {
+        return -1;
+    }
+    trace_end("tokenize", start);
+    if (parsed_json == NULL) {
+        return CONVERT_SKIPPED;
+    }
+    start = trace_begin();
+    int size = converter_encode(conv, parsed_json, buffer, capacity);
+    json_object_put(parsed_json);
+    trace_end("encode", start);
+    return size;
+}
+
+int converter_encode_line(converter* conv, const char* line,
+                          unsigned char** buffer, size_t* capacity) {
+    if (conv->record_latency == NULL) {
+        return encode_line(conv, line, buffer, capacity);
+    }
+    uint64_t start = histogram_now();
+    int size = encode_line(conv, line, buffer, capacity);
+    histogram_record(conv->record_latency, histogram_now() - start);
+    return size;
+}
+
+void convert_keys_init(convert_keys* keys) {
+    keys->table = NULL;
+    keys->keys = NULL;
+    keys->count = 0;
+    keys->capacity = 0;
+}
+
+void convert_keys_free(convert_keys* keys) {
+    if (keys->table != NULL) {
+        hashtable_destroy(keys->table);
+    }
+    free(keys->keys);
+    convert_keys_init(keys);
+}
+
+// Return the local tag for key, numbering it on first sight, or -1 if out
+// of memory.
+static int local_tag(convert_keys* keys, const char* key) {
+    if (keys->table == NULL && (keys->table = hashtable_create()) == NULL) {
+        return -1;
+    }
+    void* value = hashtable_get(keys->table, key);
+    if (value != NULL) {
+        return (int)((uintptr_t)value - 1);
+    }
+    if (keys->count == keys->capacity) {
+        size_t capacity = keys->capacity > 0 ? keys->capacity * 2 : 16;
+        const char** grown = realloc(keys->keys, capacity * sizeof(char*));
+        if (grown == NULL) {
+            return -1;
+        }
+        keys->keys = grown;
+        keys->capacity = capacity;
+    }
+    const char* copy = hashtable_set(keys->table, key, (void*)(uintptr_t)(keys->count + 1));
+    if (copy == NULL) {
+        return -1;
+    }
+    keys->keys[keys->count] = copy;
+    return (int)keys->count++;
+}
+
+// Bytes tlv_box stores for val, or -1 for types the converter doesn't write.
+static int value_length(struct json_object* val) {
+    switch (json_object_get_type(val)) {
+        case json_type_int:
+            return sizeof(int);
+        case json_type_boolean:
+            return sizeof(short);
+        case json_type_string:
+            return strlen(json_object_get_string(val)) + 1;
+        default:
+            return -1;
+    }
+}
+
+int convert_encode_local(convert_keys* keys, struct json_object* record,
+                         unsigned char** buffer, size_t* capacity, size_t offset) {
+    if (json_object_get_type(record) != json_type_object) {
+        return CONVERT_SKIPPED;
+    }
+
+    // Size the record first, numbering keys in the order the generic
+    // path would tag them.
+    size_t size = 0;
+    json_object_object_foreach(record, key, val) {
+        if (local_tag(keys, key) < 0) {
+            return -1;
+        }
+        int length = value_length(val);
+        if (length < 0) {
+            printf("unknown data type!");
+            continue;
+        }
+        size += 2 * sizeof(int) + length;
+    }
+    if (size > INT32_MAX) {
+        return -1;
+    }
+    if (offset + size > *capacity) {
+        size_t grown_capacity = *capacity > 0 ? *capacity : 256;
+        while (grown_capacity < offset + size) {
+            grown_capacity *= 2;
+        }
+        unsigned char* grown = realloc(*buffer, grown_capacity);
+        if (grown == NULL) {
+            return -1;
+        }
+        *buffer = grown;
+        *capacity = grown_capacity;
+    }
+
+    // Like tlv_box_serialize, write fields last to first: fill from the end.
+    unsigned char* p = *buffer + offset + size;
+    json_object_object_foreach(record, key2, val2) {
+        int length = value_length(val2);
+        if (length < 0) {
+            continue;
+        }
+        int header[2] = { (int)((uintptr_t)hashtable_get(keys->table, key2) - 1), length };
+        p -= 2 * sizeof(int) + length;
+        memcpy(p, header, sizeof(header));
+        switch (json_object_get_type(val2)) {
+            case json_type_int: {
+                int i = json_object_get_int(val2);
+                memcpy(p + sizeof(header), &i, sizeof(int));
+                break;
+            }
+            case json_type_boolean: {
+                short b = json_object_get_boolean(val2);
+                memcpy(p + sizeof(header), &b, sizeof(short));
+                break;
+            }
+            default:
+                memcpy(p + sizeof(header), json_object_get_string(val2), length);
+                break;
+        }
+    }
+    return (int)size;
+}
+
+bool converter_resolve(converter* conv, const convert_keys* keys, int* tags) {
+    for (size_t i = 0; i < keys->count; i++) {
+        int* tag = converter_tag(conv, keys->keys[i]);
+        if (tag == NULL) {
+            return false;
+        }
+        tags[i] = *tag;
+    }
+    return true;
+}
+
+void convert_retag(unsigned char* record, size_t size, const int* tags) {
+    size_t offset = 0;
+    while (offset + 2 * sizeof(int) <= size) {
+        int header[2];
+        memcpy(header, record + offset, sizeof(header));
+        header[0] = tags[header[0]];
+        memcpy(record + offset, header, sizeof(int));
+        offset += sizeof(header) + header[1];
+    }
+}
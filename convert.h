@@ -0,0 +1,104 @@
+// Conversion of JSON records to TLV records.
+//
+// A converter owns the key dictionary: each key gets the next free tag the
+// first time it is seen, starting at 1. Records matching the schema
+// inferred from the first records are encoded with the fixed-layout codec,
+// others through a tlv_box; both produce the same bytes.
+
+#ifndef _convert_H
+#define _convert_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <json-c/json.h>
+
+#include "hashtable.h"
+#include "histogram.h"
+#include "projection.h"
+#include "schema.h"
+
+// Returned by converter_encode_line for a line that isn't a JSON object.
+#define CONVERT_SKIPPED (-2)
+
+// One dictionary lookup in this many is timed: they take about as long as
+// reading the clock.
+#define CONVERT_LOOKUP_SAMPLE 16
+
+// Converter state. Not thread-safe: one thread encodes at a time.
+typedef struct {
+    hashtable* key_hashtable;  // key -> int* tag
+    size_t counter;            // next tag to assign
+    schema* record_schema;     // inferred fixed layout, or NULL
+    const projection* keys;    // keys to convert, or NULL for all; not owned
+    char* projected;           // line after projection
+    size_t projected_capacity;
+    histogram* record_latency; // time to encode each line, or NULL; not owned
+    histogram* lookup_latency; // time of sampled dictionary lookups, or NULL; not owned
+    size_t lookups;
+} converter;
+
+// Keys of a run of records encoded with local tags: 0, 1, ... in order of
+// first appearance. Workers encoding in parallel each number keys on their
+// own; converter_resolve then maps local tags to dictionary tags in input
+// order, so tags come out as if the records had been converted in turn.
+typedef struct {
+    hashtable* table;   // key -> local tag + 1
+    const char** keys;  // keys by local tag, owned by table
+    size_t count;
+    size_t capacity;
+} convert_keys;
+
+// Initialize conv with an empty dictionary, converting every key. Set
+// conv->keys before converting anything to project records. Return false
+// if out of memory.
+bool converter_init(converter* conv);
+
+// Free the dictionary and schema.
+void converter_free(converter* conv);
+
+// Return the tag for key, assigning the next free one on first sight, or
+// NULL if out of memory. One call in CONVERT_LOOKUP_SAMPLE is timed into
+// conv->lookup_latency, if set.
+int* converter_tag(converter* conv, const char* key);
+
+// Sample up to samples records from the start of in to infer a schema,
+// registering their keys in the order conversion would, then rewind in.
+// Leave record_schema NULL if the records don't share a fixed layout, or
+// if in can't seek.
+void converter_infer_schema(converter* conv, FILE* in, size_t samples);
+
+// Encode record into *buffer, growing it (and *capacity) as needed. Return
+// the number of bytes written, CONVERT_SKIPPED if record isn't an object,
+// or -1 on error.
+int converter_encode(converter* conv, struct json_object* record,
+                     unsigned char** buffer, size_t* capacity);
+
+// Project one NUL-terminated line with conv->keys, parse it and encode it
+// as converter_encode does. Lines json-c can't parse are CONVERT_SKIPPED.
+// The time taken goes to conv->record_latency, if set.
+int converter_encode_line(converter* conv, const char* line,
+                          unsigned char** buffer, size_t* capacity);
+
+// Initialize keys, empty.
+void convert_keys_init(convert_keys* keys);
+
+// Free keys, leaving them empty and ready for reuse.
+void convert_keys_free(convert_keys* keys);
+
+// Encode record with local tags at *buffer + offset, growing *buffer (and
+// *capacity) as needed. The bytes are those converter_encode would write,
+// but with local tags. Return as converter_encode.
+int convert_encode_local(convert_keys* keys, struct json_object* record,
+                         unsigned char** buffer, size_t* capacity, size_t offset);
+
+// Fill tags (keys->count entries) with the dictionary tag of each local
+// tag, assigning new tags in local order. Return false if out of memory.
+bool converter_resolve(converter* conv, const convert_keys* keys, int* tags);
+
+// Replace the local tags in the field headers of one encoded record.
+void convert_retag(unsigned char* record, size_t size, const int* tags);
+
+#endif // _convert_H
@@ -0,0 +1,20 @@
+// CRC-32C (Castagnoli) checksums.
+//
+// Uses the SSE4.2 crc32 instruction when the CPU has it, and a
+// slicing-by-8 table otherwise; both produce the same values.
+
+#ifndef _crc32c_H
+#define _crc32c_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Extend crc (0 for a fresh checksum) with size bytes of data and return
+// the new checksum. Checksumming a buffer in pieces gives the same result
+// as checksumming it at once.
+uint32_t crc32c_update(uint32_t crc, const void* data, size_t size);
+
+// Return CRC-32C of size bytes of data.
+uint32_t crc32c(const void* data, size_t size);
+
+#endif // _crc32c_H
@@ -0,0 +1,380 @@
+#define _GNU_SOURCE // fopencookie
+
+#include "decompress.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "ring.h"
+#include "trace.h"
+
+#define INPUT_SIZE (128 * 1024)  // compressed bytes read at a time
+
+typedef enum { FORMAT_PLAIN, FORMAT_GZIP, FORMAT_ZSTD } format;
+
+typedef struct {
+    size_t size;
+    unsigned char data[DECOMPRESS_BLOCK_SIZE];
+} block;
+
+// State behind a decompressed stream. The decompression thread owns in,
+// input and the codec; the reader owns current and position. Blocks go to
+// the reader through full and come back through empty.
+typedef struct {
+    FILE* in;
+    bool seekable;           // in is a file, not a pipe
+    format fmt;
+#ifdef HAVE_ZLIB
+    z_stream zs;
+    bool in_member;          // inside a gzip member
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_DStream* zstd;
+    ZSTD_inBuffer zstd_in;
+    size_t zstd_hint;        // 0 at a frame boundary
+#endif
+    unsigned char* input;
+    block* blocks[DECOMPRESS_BLOCKS];
+    spsc_ring* full;
+    spsc_ring* empty;
+    pthread_t thread;
+    bool running;
+    _Atomic bool failed;
+    block* current;          // block being read, or NULL
+    size_t pos;              // read position in current
+    off64_t position;        // decompressed bytes handed to stdio
+} decompressor;
+
+static format detect(FILE* in) {
+    unsigned char magic[4];
+    size_t n = fread(magic, 1, sizeof(magic), in);
+    // Push the bytes back rather than rewind: a pipe can't seek, and the
+    // failed seek would drop all it had buffered. glibc takes back bytes
+    // just read from the buffer however many there are.
+    for (size_t i = n; i > 0; i--) {
+        ungetc(magic[i - 1], in);
+    }
+    if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+        return FORMAT_GZIP;
+    }
+    if (n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+        return FORMAT_ZSTD;
+    }
+    return FORMAT_PLAIN;
+}
+
+#ifdef HAVE_ZLIB
+// Decompress gzip into the rest of b. Return 1 if b is full, 0 at the end
+// of the input, -1 on error. Members follow each other until the input
+// ends, which must be at a member boundary.
+static int fill_gzip(decompressor* d, block* b) {
+    z_stream* zs = &d->zs;
+    zs->next_out = b->data + b->size;
+    zs->avail_out = DECOMPRESS_BLOCK_SIZE - b->size;
+    int result = 1;
+    while (zs->avail_out > 0) {
+        if (zs->avail_in == 0) {
+            size_t n = fread(d->input, 1, INPUT_SIZE, d->in);
+            if (n == 0) {
+                result = ferror(d->in) || d->in_member ? -1 : 0;
+                break;
+            }
+            zs->next_in = d->input;
+            zs->avail_in = n;
+        }
+        if (!d->in_member) {
+            inflateReset(zs);
+            d->in_member = true;
+        }
+        int ret = inflate(zs, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            d->in_member = false;
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            result = -1;
+            break;
+        }
+    }
+    b->size = DECOMPRESS_BLOCK_SIZE - zs->avail_out;
+    return result;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+// Decompress zstd into the rest of b, returning as fill_gzip. Frames
+// follow each other until the input ends.
+static int fill_zstd(decompressor* d, block* b) {
+    ZSTD_outBuffer out = { b->data, DECOMPRESS_BLOCK_SIZE, b->size };
+    int result = 1;
+    while (out.pos < out.size) {
+        if (d->zstd_in.pos == d->zstd_in.size) {
+            size_t n = fread(d->input, 1, INPUT_SIZE, d->in);
+            if (n == 0) {
+                result = ferror(d->in) || d->zstd_hint != 0 ? -1 : 0;
+                break;
+            }
+            d->zstd_in.src = d->input;
+            d->zstd_in.size = n;
+            d->zstd_in.pos = 0;
+        }
+        d->zstd_hint = ZSTD_decompressStream(d->zstd, &out, &d->zstd_in);
+        if (ZSTD_isError(d->zstd_hint)) {
+            result = -1;
+            break;
+        }
+    }
+    b->size = out.pos;
+    return result;
+}
+#endif
+
+static int fill(decompressor* d, block* b) {
+    (void)b;  // unused when built without either library
+    switch (d->fmt) {
+#ifdef HAVE_ZLIB
+        case FORMAT_GZIP:
+            return fill_gzip(d, b);
+#endif
+#ifdef HAVE_ZSTD
+        case FORMAT_ZSTD:
+            return fill_zstd(d, b);
+#endif
+        default:
+            return -1;
+    }
+}
+
+static void* decompress_main(void* arg) {
+    decompressor* d = arg;
+    void* item;
+    trace_thread("decompress");
+    uint64_t start = trace_begin();
+    while (spsc_ring_pop_wait(d->empty, &item, 1) == 1) {
+        trace_end("wait", start);
+        block* b = item;
+        b->size = 0;
+        start = trace_begin();
+        int result = fill(d, b);
+        trace_end("decompress", start);
+        start = trace_begin();  // handing the block over, then the next empty one
+        if (result < 0) {
+            atomic_store(&d->failed, true);
+            break;
+        }
+        if (b->size > 0 && !spsc_ring_push_wait(d->full, &item, 1)) {
+            break;
+        }
+        if (result == 0) {
+            break;
+        }
+    }
+    spsc_ring_close(d->full);
+    return NULL;
+}
+
+static void stop(decompressor* d) {
+    if (d->running) {
+        spsc_ring_close(d->empty);
+        spsc_ring_close(d->full);
+        pthread_join(d->thread, NULL);
+        d->running = false;
+    }
+    if (d->full != NULL) {
+        spsc_ring_destroy(d->full);
+        d->full = NULL;
+    }
+    if (d->empty != NULL) {
+        spsc_ring_destroy(d->empty);
+        d->empty = NULL;
+    }
+}
+
+// Start decompressing from the current position of in, the beginning of
+// the file. Return 0 on success, -1 on error.
+static int start(decompressor* d) {
+    atomic_store(&d->failed, false);
+    d->current = NULL;
+    d->pos = 0;
+    d->position = 0;
+#ifdef HAVE_ZLIB
+    d->zs.avail_in = 0;
+    d->in_member = false;
+#endif
+#ifdef HAVE_ZSTD
+    d->zstd_in.pos = d->zstd_in.size = 0;
+    d->zstd_hint = 0;
+    if (d->fmt == FORMAT_ZSTD) {
+        ZSTD_initDStream(d->zstd);
+    }
+#endif
+    d->full = spsc_ring_create(DECOMPRESS_BLOCKS);
+    d->empty = spsc_ring_create(DECOMPRESS_BLOCKS);
+    if (d->full == NULL || d->empty == NULL) {
+        stop(d);
+        return -1;
+    }
+    spsc_ring_push(d->empty, (void* const*)d->blocks, DECOMPRESS_BLOCKS);
+    if (pthread_create(&d->thread, NULL, decompress_main, d) != 0) {
+        stop(d);
+        return -1;
+    }
+    d->running = true;
+    return 0;
+}
+
+static void decompressor_free(decompressor* d) {
+    stop(d);
+#ifdef HAVE_ZLIB
+    if (d->fmt == FORMAT_GZIP) {
+        inflateEnd(&d->zs);
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (d->zstd != NULL) {
+        ZSTD_freeDStream(d->zstd);
+    }
+#endif
+    for (size_t i = 0; i < DECOMPRESS_BLOCKS; i++) {
+        free(d->blocks[i]);
+    }
+    free(d->input);
+    fclose(d->in);
+    free(d);
+}
+
+static ssize_t cookie_read(void* cookie, char* buf, size_t size) {
+    decompressor* d = cookie;
+    size_t done = 0;
+    while (done < size) {
+        if (d->current == NULL || d->pos == d->current->size) {
+            void* item = d->current;
+            if (item != NULL) {
+                spsc_ring_push(d->empty, &item, 1);
+                d->current = NULL;
+            }
+            if (d->full == NULL || spsc_ring_pop_wait(d->full, &item, 1) == 0) {
+                break;
+            }
+            d->current = item;
+            d->pos = 0;
+        }
+        size_t n = d->current->size - d->pos;
+        if (n > size - done) {
+            n = size - done;
+        }
+        memcpy(buf + done, d->current->data + d->pos, n);
+        d->pos += n;
+        done += n;
+    }
+    if (done == 0 && atomic_load(&d->failed)) {
+        errno = EIO;
+        return -1;
+    }
+    d->position += done;
+    return done;
+}
+
+// Only what ftell and rewind need: the current position, and the start.
+// Over a pipe, which can't be read again, every seek fails as the pipe's
+// own would.
+static int cookie_seek(void* cookie, off64_t* offset, int whence) {
+    decompressor* d = cookie;
+    if (!d->seekable) {
+        errno = ESPIPE;
+        return -1;
+    }
+    if (whence == SEEK_CUR && *offset == 0) {
+        *offset = d->position;
+        return 0;
+    }
+    if (whence == SEEK_SET && *offset == 0) {
+        stop(d);
+        if (fseeko(d->in, 0, SEEK_SET) != 0 || start(d) != 0) {
+            atomic_store(&d->failed, true);  // reads fail rather than end
+            return -1;
+        }
+        return 0;
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+static int cookie_close(void* cookie) {
+    decompressor_free(cookie);
+    return 0;
+}
+
+FILE* decompress_open(const char* path) {
+    FILE* in = fopen(path, "r");
+    if (in == NULL) {
+        return NULL;
+    }
+    format fmt = detect(in);
+    if (fmt == FORMAT_PLAIN) {
+        return in;
+    }
+#ifndef HAVE_ZLIB
+    if (fmt == FORMAT_GZIP) {
+        fclose(in);
+        errno = ENOTSUP;
+        return NULL;
+    }
+#endif
+#ifndef HAVE_ZSTD
+    if (fmt == FORMAT_ZSTD) {
+        fclose(in);
+        errno = ENOTSUP;
+        return NULL;
+    }
+#endif
+
+    decompressor* d = calloc(1, sizeof(decompressor));
+    if (d == NULL) {
+        fclose(in);
+        return NULL;
+    }
+    d->in = in;
+    d->seekable = lseek(fileno(in), 0, SEEK_CUR) >= 0;
+    d->fmt = fmt;
+    bool ok = (d->input = malloc(INPUT_SIZE)) != NULL;
+    for (size_t i = 0; i < DECOMPRESS_BLOCKS; i++) {
+        ok = ok && (d->blocks[i] = malloc(sizeof(block))) != NULL;
+    }
+#ifdef HAVE_ZLIB
+    if (ok && fmt == FORMAT_GZIP && inflateInit2(&d->zs, 15 + 16) != Z_OK) {
+        d->fmt = FORMAT_PLAIN;  // nothing for decompressor_free to end
+        ok = false;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (ok && fmt == FORMAT_ZSTD) {
+        ok = (d->zstd = ZSTD_createDStream()) != NULL;
+    }
+#endif
+    if (!ok || start(d) != 0) {
+        decompressor_free(d);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    static const cookie_io_functions_t functions = {
+        cookie_read, NULL, cookie_seek, cookie_close,
+    };
+    FILE* stream = fopencookie(d, "r", functions);
+    if (stream == NULL) {
+        decompressor_free(d);
+        return NULL;
+    }
+    return stream;
+}
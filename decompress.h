@@ -0,0 +1,27 @@
+// Transparent decompression of input files.
+//
+// decompress_open recognizes gzip and zstd files by their magic bytes and
+// returns a stdio stream of the decompressed text, so every conversion
+// mode reads them like plain files. The data is decompressed on its own
+// thread, a few blocks ahead of the reader, with no temporary file.
+// Multi-member gzip (including BGZF) and multi-frame zstd are read through.
+//
+// Support is compiled in with HAVE_ZLIB (link with -lz) and HAVE_ZSTD
+// (link with -lzstd).
+
+#ifndef _decompress_H
+#define _decompress_H
+
+#include <stdio.h>
+
+#define DECOMPRESS_BLOCK_SIZE (256 * 1024)  // decompressed bytes per block
+#define DECOMPRESS_BLOCKS 4                 // blocks in flight to the reader
+
+// Open path for reading: a stream of its decompressed contents if it is
+// compressed, or the file itself otherwise. Decompressed streams have no
+// file descriptor (fileno returns -1) and can only be rewound, not seeked
+// elsewhere; over a pipe they can't seek at all. Return NULL on error (errno set), including compressed input
+// this build can't read (ENOTSUP).
+FILE* decompress_open(const char* path);
+
+#endif // _decompress_H
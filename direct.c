@@ -0,0 +1,135 @@
+#define _GNU_SOURCE // O_DIRECT
+
+#include "direct.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Direct writer structure: open with direct_open, finish with direct_close.
+struct direct_writer {
+    int fd;                 // O_DIRECT when direct is set
+    int tail_fd;            // ordinary descriptor for the last partial block
+    bool direct;
+    unsigned char* buffer;  // DIRECT_ALIGN-aligned
+    size_t capacity;        // multiple of DIRECT_ALIGN
+    size_t fill;
+    uint64_t offset;        // file offset of the buffer, always aligned
+    bool failed;
+};
+
+// Write all of data at offset, retrying short writes. Return 0 on success,
+// -1 on error.
+static int pwrite_all(int fd, const unsigned char* data, size_t size, uint64_t offset) {
+    while (size > 0) {
+        ssize_t n = pwrite(fd, data, size, (off_t)offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        size -= (size_t)n;
+        offset += (size_t)n;
+    }
+    return 0;
+}
+
+// Write the first size bytes of the buffer, a multiple of DIRECT_ALIGN,
+// and move what's left after them to the front.
+static int flush_blocks(direct_writer* writer, size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+    if (pwrite_all(writer->fd, writer->buffer, size, writer->offset) != 0) {
+        writer->failed = true;
+        return -1;
+    }
+    writer->offset += size;
+    writer->fill -= size;
+    memmove(writer->buffer, writer->buffer + size, writer->fill);
+    return 0;
+}
+
+direct_writer* direct_open(const char* path, size_t buffer_size) {
+    direct_writer* writer = malloc(sizeof(direct_writer));
+    if (writer == NULL) {
+        return NULL;
+    }
+    if (buffer_size == 0) {
+        buffer_size = DIRECT_DEFAULT_BUFFER;
+    }
+    writer->capacity = (buffer_size + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+    writer->fill = 0;
+    writer->offset = 0;
+    writer->failed = false;
+    if (posix_memalign((void**)&writer->buffer, DIRECT_ALIGN, writer->capacity) != 0) {
+        free(writer);
+        errno = ENOMEM;
+        return NULL;
+    }
+    writer->tail_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (writer->tail_fd < 0) {
+        free(writer->buffer);
+        free(writer);
+        return NULL;
+    }
+    // tmpfs and some network filesystems reject O_DIRECT with EINVAL.
+    writer->fd = open(path, O_WRONLY | O_DIRECT | O_CLOEXEC);
+    writer->direct = writer->fd >= 0;
+    if (!writer->direct) {
+        writer->fd = writer->tail_fd;
+    }
+    return writer;
+}
+
+int direct_write(void* ctx, const void* data, size_t size) {
+    direct_writer* writer = ctx;
+    const unsigned char* p = data;
+    if (writer->failed) {
+        return -1;
+    }
+    while (size > 0) {
+        size_t n = writer->capacity - writer->fill;
+        if (n > size) {
+            n = size;
+        }
+        memcpy(writer->buffer + writer->fill, p, n);
+        writer->fill += n;
+        p += n;
+        size -= n;
+        if (writer->fill == writer->capacity && flush_blocks(writer, writer->capacity) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+bool direct_bypasses_cache(direct_writer* writer) {
+    return writer->direct;
+}
+
+int direct_close(direct_writer* writer) {
+    int result = writer->failed ? -1 : 0;
+    if (result == 0) {
+        // Whole blocks still go direct; only the remainder is cached.
+        size_t tail = writer->fill % DIRECT_ALIGN;
+        if (flush_blocks(writer, writer->fill - tail) != 0 ||
+            pwrite_all(writer->tail_fd, writer->buffer, tail, writer->offset) != 0) {
+            result = -1;
+        }
+    }
+    if (writer->direct && close(writer->fd) != 0) {
+        result = -1;
+    }
+    if (close(writer->tail_fd) != 0) {
+        result = -1;
+    }
+    free(writer->buffer);
+    free(writer);
+    return result;
+}
@@ -0,0 +1,40 @@
+// Output file written with O_DIRECT.
+//
+// Data is gathered into an aligned buffer and written a whole number of
+// aligned blocks at a time, bypassing the page cache: a large conversion
+// neither evicts other processes' cached data nor builds up dirty pages
+// for writeback to stall on. The last partial block goes through a second,
+// ordinary descriptor at close. Filesystems without O_DIRECT get ordinary
+// writes of the same buffers.
+
+#ifndef _direct_H
+#define _direct_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define DIRECT_ALIGN 4096
+#define DIRECT_DEFAULT_BUFFER (1 << 20)
+
+// Direct writer: open with direct_open, finish with direct_close.
+typedef struct direct_writer direct_writer;
+
+// Create (or truncate) path for direct writing through a buffer of
+// buffer_size bytes (rounded up to DIRECT_ALIGN). Return NULL on error
+// (errno set).
+direct_writer* direct_open(const char* path, size_t buffer_size);
+
+// block_sink and pipeline_sink appending size bytes to the direct writer
+// passed as ctx. Return 0 on success, -1 on error.
+int direct_write(void* ctx, const void* data, size_t size);
+
+// Return true if writes bypass the page cache, false if the filesystem
+// refused O_DIRECT.
+bool direct_bypasses_cache(direct_writer* writer);
+
+// Write out the buffer, its partial last block through the ordinary
+// descriptor, close the file and free the writer. Return 0 on success, -1
+// on error.
+int direct_close(direct_writer* writer);
+
+#endif // _direct_H
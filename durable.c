@@ -0,0 +1,123 @@
+#include "durable.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "block.h"
+
+// Durable writer structure: open with durable_open, finish with durable_close.
+struct durable_writer {
+    int fd;
+    uint64_t offset;        // bytes written to the file
+    uint64_t synced;        // offset covered by the last commit
+    uint32_t records;       // records in all blocks written
+    size_t sync_bytes;
+    long sync_ms;
+    struct timespec last_sync;
+};
+
+static long elapsed_ms(const struct timespec* since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 +
+           (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+// Write all of data, retrying short writes. Return 0 on success, -1 on error.
+static int write_all(int fd, const void* data, size_t size) {
+    const unsigned char* p = data;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        size -= (size_t)n;
+    }
+    return 0;
+}
+
+durable_writer* durable_open(const char* path, size_t sync_bytes, long sync_ms) {
+    durable_writer* writer = malloc(sizeof(durable_writer));
+    if (writer == NULL) {
+        return NULL;
+    }
+    writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (writer->fd < 0) {
+        free(writer);
+        return NULL;
+    }
+    writer->offset = 0;
+    writer->synced = 0;
+    writer->records = 0;
+    writer->sync_bytes = sync_bytes;
+    writer->sync_ms = sync_ms;
+    clock_gettime(CLOCK_MONOTONIC, &writer->last_sync);
+    return writer;
+}
+
+bool durable_due(const durable_writer* writer) {
+    return elapsed_ms(&writer->last_sync) >= writer->sync_ms;
+}
+
+int durable_commit(durable_writer* writer) {
+    if (writer->offset == writer->synced) {
+        return 0;
+    }
+
+    // Sync the data first; the marker written after it then only claims
+    // bytes that are already on disk. The marker itself becomes durable
+    // with the next group's sync (or at close).
+    if (fdatasync(writer->fd) != 0) {
+        return -1;
+    }
+    unsigned char marker[BLOCK_COMMIT_SIZE];
+    block_commit_marker(marker, writer->offset, writer->records);
+    if (write_all(writer->fd, marker, sizeof(marker)) != 0) {
+        return -1;
+    }
+    writer->offset += sizeof(marker);
+    writer->synced = writer->offset;
+    clock_gettime(CLOCK_MONOTONIC, &writer->last_sync);
+    return 0;
+}
+
+int durable_write(void* ctx, const void* data, size_t size) {
+    durable_writer* writer = ctx;
+    if (write_all(writer->fd, data, size) != 0) {
+        return -1;
+    }
+    if (size >= BLOCK_HEADER_SIZE) {
+        block_header header;
+        memcpy(&header, data, BLOCK_HEADER_SIZE);
+        writer->records += header.records;
+    }
+    writer->offset += size;
+
+    if (writer->offset - writer->synced >= writer->sync_bytes ||
+            elapsed_ms(&writer->last_sync) >= writer->sync_ms) {
+        return durable_commit(writer);
+    }
+    return 0;
+}
+
+int durable_close(durable_writer* writer) {
+    int result = durable_commit(writer);
+    if (result == 0 && fdatasync(writer->fd) != 0) {
+        result = -1;
+    }
+    if (close(writer->fd) != 0) {
+        result = -1;
+    }
+    free(writer);
+    return result;
+}
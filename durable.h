@@ -0,0 +1,45 @@
+// Durable output file with group commit.
+//
+// Blocks (see block.h) are written straight to the file descriptor. Instead
+// of syncing each one, the writer batches them and calls fdatasync once
+// enough bytes or time have gone by, then appends a commit marker covering
+// everything synced so far. After a crash, readers keep the data up to the
+// last valid marker and drop the torn tail.
+
+#ifndef _durable_H
+#define _durable_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define DURABLE_DEFAULT_SYNC_MS 100
+#define DURABLE_DEFAULT_SYNC_BYTES (8 << 20)
+
+// Durable writer: open with durable_open, finish with durable_close.
+typedef struct durable_writer durable_writer;
+
+// Create (or truncate) path for durable writing. Data is synced once
+// sync_bytes have been written or sync_ms milliseconds have passed since
+// the last sync, whichever comes first. Return NULL on error (errno set).
+durable_writer* durable_open(const char* path, size_t sync_bytes, long sync_ms);
+
+// Return true once sync_ms have passed since the last sync. A block is
+// only written when full, so the caller checks this as records come in,
+// and flushes its partial block and commits when it returns true; a
+// record is then durable within sync_ms, or by the time the next one is
+// written if that comes later.
+bool durable_due(const durable_writer* writer);
+
+// block_sink writing one block to the durable writer passed as ctx; may
+// trigger a group commit. Return 0 on success, -1 on error.
+int durable_write(void* ctx, const void* data, size_t size);
+
+// Sync everything written so far and append a commit marker for it.
+// Return 0 on success, -1 on error.
+int durable_commit(durable_writer* writer);
+
+// Commit, sync the last marker, close the file and free the writer.
+// Return 0 on success, -1 on error.
+int durable_close(durable_writer* writer);
+
+#endif // _durable_H
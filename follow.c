@@ -0,0 +1,244 @@
+#include "follow.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+struct follower {
+    char* path;
+    int fd;                 // file being read, or -1 between rotations
+    ino_t inode;
+    dev_t device;
+    off_t offset;           // bytes read from it
+    int inotify;
+    int file_watch;         // on the file being read, or -1
+    char* buffer;           // read but not handed out: [start, size)
+    size_t start;
+    size_t size;
+    size_t capacity;
+};
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Open the file now at the path and watch it for appends.
+static int open_file(follower* f) {
+    struct stat st;
+    int fd = open(f->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    int watch = inotify_add_watch(f->inotify, f->path, IN_MODIFY);
+    if (watch < 0) {
+        close(fd);
+        return -1;
+    }
+    f->fd = fd;
+    f->inode = st.st_ino;
+    f->device = st.st_dev;
+    f->offset = 0;
+    f->file_watch = watch;
+    return 0;
+}
+
+static void close_file(follower* f) {
+    if (f->file_watch >= 0) {
+        inotify_rm_watch(f->inotify, f->file_watch);
+        f->file_watch = -1;
+    }
+    if (f->fd >= 0) {
+        close(f->fd);
+        f->fd = -1;
+    }
+}
+
+follower* follow_open(const char* path) {
+    follower* f = calloc(1, sizeof(follower));
+    if (f == NULL) {
+        return NULL;
+    }
+    f->fd = -1;
+    f->file_watch = -1;
+    f->path = strdup(path);
+    f->capacity = FOLLOW_READ_SIZE;
+    f->buffer = malloc(f->capacity);
+    f->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (f->path == NULL || f->buffer == NULL || f->inotify < 0) {
+        goto fail;
+    }
+    // The directory tells when a new file takes the name.
+    const char* slash = strrchr(path, '/');
+    char* dir = slash != NULL ? strndup(path, slash == path ? 1 : (size_t)(slash - path)) : strdup(".");
+    if (dir == NULL) {
+        goto fail;
+    }
+    int watch = inotify_add_watch(f->inotify, dir, IN_CREATE | IN_MOVED_TO);
+    free(dir);
+    if (watch < 0 || open_file(f) != 0) {
+        goto fail;
+    }
+    return f;
+
+fail:
+    follow_close(f);
+    return NULL;
+}
+
+void follow_close(follower* f) {
+    if (f == NULL) {
+        return;
+    }
+    close_file(f);
+    if (f->inotify >= 0) {
+        close(f->inotify);
+    }
+    free(f->buffer);
+    free(f->path);
+    free(f);
+}
+
+// Hand out buffer[start, end) as a line. Return its length or -1.
+static ssize_t take(follower* f, size_t end, char** line, size_t* capacity) {
+    size_t length = end - f->start;
+    if (*line == NULL || *capacity < length + 1) {
+        char* grown = realloc(*line, length + 1);
+        if (grown == NULL) {
+            return -1;
+        }
+        *line = grown;
+        *capacity = length + 1;
+    }
+    memcpy(*line, f->buffer + f->start, length);
+    (*line)[length] = '\0';
+    f->start = end;
+    return (ssize_t)length;
+}
+
+// Read what has been appended to the file. Return the bytes read, 0 at
+// the end, or -1 on error.
+static ssize_t fill(follower* f) {
+    if (f->start > 0) {
+        memmove(f->buffer, f->buffer + f->start, f->size - f->start);
+        f->size -= f->start;
+        f->start = 0;
+    }
+    if (f->capacity - f->size < FOLLOW_READ_SIZE / 2) {
+        char* grown = realloc(f->buffer, f->capacity * 2);
+        if (grown == NULL) {
+            return -1;
+        }
+        f->buffer = grown;
+        f->capacity *= 2;
+    }
+    ssize_t n;
+    do {
+        n = read(f->fd, f->buffer + f->size, f->capacity - f->size);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) {
+        f->size += n;
+        f->offset += n;
+    }
+    return n;
+}
+
+// At the end of the file: return true if the path now names another file.
+static bool rotated(follower* f) {
+    struct stat st;
+    if (stat(f->path, &st) != 0) {
+        return true;
+    }
+    return st.st_ino != f->inode || st.st_dev != f->device;
+}
+
+// Return true if the file was cut shorter than what has been read.
+static bool truncated(follower* f) {
+    struct stat st;
+    return fstat(f->fd, &st) == 0 && st.st_size < f->offset;
+}
+
+// Wait for inotify events until the deadline (none if negative), and
+// drain them. Return 1 on events, 0 on timeout, -1 on error.
+static int wait_events(follower* f, long long deadline) {
+    int timeout = -1;
+    if (deadline >= 0) {
+        long long left = deadline - now_ms();
+        timeout = left > 0 ? (left < INT_MAX ? (int)left : INT_MAX) : 0;
+    }
+    struct pollfd pfd = { .fd = f->inotify, .events = POLLIN };
+    int ready = poll(&pfd, 1, timeout);
+    if (ready <= 0) {
+        return ready;
+    }
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (read(f->inotify, events, sizeof(events)) > 0) {
+        // Which file changed doesn't matter: the caller looks again.
+    }
+    return 1;
+}
+
+ssize_t follow_getline(follower* f, char** line, size_t* capacity, int timeout_ms) {
+    long long deadline = timeout_ms >= 0 ? now_ms() + timeout_ms : -1;
+    for (;;) {
+        char* newline = memchr(f->buffer + f->start, '\n', f->size - f->start);
+        if (newline != NULL) {
+            return take(f, newline - f->buffer + 1, line, capacity);
+        }
+        if (f->fd >= 0) {
+            ssize_t n = fill(f);
+            if (n != 0) {
+                if (n < 0) {
+                    return -1;
+                }
+                continue;
+            }
+            if (truncated(f)) {
+                // Truncated in place: the partial line is gone with it.
+                if (lseek(f->fd, 0, SEEK_SET) != 0) {
+                    return -1;
+                }
+                f->offset = 0;
+                f->start = f->size = 0;
+                continue;
+            }
+            if (rotated(f)) {
+                // Pick up anything written just before the rotation.
+                if ((n = fill(f)) != 0) {
+                    if (n < 0) {
+                        return -1;
+                    }
+                    continue;
+                }
+                // Done with the old file. Nothing more will finish its last
+                // line, so hand it out as it is.
+                close_file(f);
+                if (f->size > f->start) {
+                    return take(f, f->size, line, capacity);
+                }
+            }
+        }
+        if (f->fd < 0 && open_file(f) == 0) {
+            continue;
+        }
+        if (f->fd < 0 && errno != ENOENT) {
+            return -1;
+        }
+        int waited = wait_events(f, deadline);
+        if (waited <= 0) {
+            return waited;
+        }
+    }
+}
@@ -0,0 +1,34 @@
+// Following a growing file, like tail -F.
+//
+// A follower hands out the lines of a file as they are appended, sleeping
+// on inotify while there's nothing new. A partial last line is held back
+// until its newline arrives. When the file is rotated (renamed or deleted
+// and recreated under the same name), the rest of the old file is read,
+// its unterminated last line included, before moving on to the new one;
+// when it is truncated in place, reading starts over from the beginning.
+
+#ifndef _follow_H
+#define _follow_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define FOLLOW_READ_SIZE (64 * 1024)
+
+// Follower: open with follow_open, free with follow_close.
+typedef struct follower follower;
+
+// Start following path from its beginning. Return NULL on error (errno set).
+follower* follow_open(const char* path);
+
+// Close the file and free the follower.
+void follow_close(follower* f);
+
+// Wait up to timeout_ms milliseconds (forever if negative) for the next
+// line and store it like getline: with its newline and a terminating NUL,
+// in *line, grown along with *capacity as needed. Return its length, 0 if
+// the time ran out first, or -1 on error (errno set; EINTR if a signal
+// interrupted the wait).
+ssize_t follow_getline(follower* f, char** line, size_t* capacity, int timeout_ms);
+
+#endif // _follow_H
@@ -1,9 +1,12 @@
 #include "hashtable.h"
 
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 // Hash table entry (slot may be filled or empty).
 typedef struct {
@@ -16,9 +19,12 @@ struct hashtable {
     hashtable_entry* entries;  // hash slots
     size_t capacity;    // size of _entries array
     size_t length;      // number of items in hash table
+    char* arena;        // keys packed by hashtable_compact, or NULL
+    size_t arena_size;  // bytes in arena
 };
 
 #define INITIAL_CAPACITY 1  // must not be zero
+#define SHRINK_MIN_CAPACITY 16  // don't shrink below this many slots
 
 hashtable* hashtable_create(void) {
     // Allocate space for hash table struct.
@@ -28,6 +34,8 @@ hashtable* hashtable_create(void) {
     }
     table->length = 0;
     table->capacity = INITIAL_CAPACITY;
+    table->arena = NULL;
+    table->arena_size = 0;
 
     // Allocate (zero'd) space for entry buckets.
     table->entries = calloc(table->capacity, sizeof(hashtable_entry));
@@ -38,14 +46,24 @@ hashtable* hashtable_create(void) {
     return table;
 }
 
+// Return true if key was packed into the table's arena (and must not be
+// freed on its own).
+static bool key_in_arena(hashtable* table, const char* key) {
+    return table->arena != NULL && key >= table->arena &&
+           key < table->arena + table->arena_size;
+}
+
 void hashtable_destroy(hashtable* table) {
     // First free allocated keys.
     for (size_t i = 0; i < table->capacity; i++) {
-        free((void*)table->entries[i].key);
+        if (!key_in_arena(table, table->entries[i].key)) {
+            free((void*)table->entries[i].key);
+        }
     }
 
-    // Then free entries array and table itself.
+    // Then free entries array, key arena and table itself.
     free(table->entries);
+    free(table->arena);
     free(table);
 }
 
@@ -119,14 +137,10 @@ static const char* hashtable_set_entry(hashtable_entry* entries, size_t capacity
     return key;
 }
 
-// Expand hash table to twice its current size. Return true on success,
-// false if out of memory.
-static bool hashtable_expand(hashtable* table) {
+// Move all entries to a new array of new_capacity slots (a power of two
+// large enough for them). Return true on success, false if out of memory.
+static bool hashtable_resize(hashtable* table, size_t new_capacity) {
     // Allocate new entries array.
-    size_t new_capacity = table->capacity * 2;
-    if (new_capacity < table->capacity) {
-        return false;  // overflow (capacity would be too big)
-    }
     hashtable_entry* new_entries = calloc(new_capacity, sizeof(hashtable_entry));
     if (new_entries == NULL) {
         return false;
@@ -148,6 +162,16 @@ static bool hashtable_expand(hashtable* table) {
     return true;
 }
 
+// Expand hash table to twice its current size. Return true on success,
+// false if out of memory.
+static bool hashtable_expand(hashtable* table) {
+    size_t new_capacity = table->capacity * 2;
+    if (new_capacity < table->capacity) {
+        return false;  // overflow (capacity would be too big)
+    }
+    return hashtable_resize(table, new_capacity);
+}
+
 const char* hashtable_set(hashtable* table, const char* key, void* value) {
     assert(value != NULL);
     if (value == NULL) {
@@ -166,6 +190,333 @@ const char* hashtable_set(hashtable* table, const char* key, void* value) {
                         &table->length);
 }
 
+#define BULK_MAX_THREADS 64
+#define BULK_MIN_PER_THREAD 16384  // below this, threads cost more than they save
+
+// Shared state of one hashtable_bulk_build call. Each thread owns one chunk
+// of the input and one region of the entries array.
+typedef struct {
+    const char* const* keys;
+    void* const* values;
+    size_t n;
+    hashtable_entry* entries;
+    size_t capacity;
+    size_t threads;       // also the number of regions (a power of two)
+    unsigned int shift;   // index >> shift gives an index's region
+    u_int64_t* hashes;    // hash of each key
+    size_t* counts;       // counts[t * threads + r]: keys of chunk t in region r
+    size_t* order;        // key indices grouped by region, input order kept
+    size_t* starts;       // starts[r]: first position of region r in order
+    size_t* deferred;     // keys that probed past the end of their region
+    size_t* ndeferred;    // per region, stored in deferred from starts[r]
+    size_t* inserted;     // per region, number of new keys placed
+    _Atomic bool failed;  // a key copy ran out of memory
+} bulk_state;
+
+typedef struct {
+    bulk_state* state;
+    size_t index;         // chunk and region number
+    int phase;
+} bulk_task;
+
+static void bulk_hash_chunk(bulk_state* st, size_t t) {
+    size_t begin = st->n * t / st->threads, end = st->n * (t + 1) / st->threads;
+    size_t* counts = &st->counts[t * st->threads];
+    for (size_t i = begin; i < end; i++) {
+        u_int64_t hash = hash_key(st->keys[i]);
+        st->hashes[i] = hash;
+        counts[(size_t)(hash & (u_int64_t)(st->capacity - 1)) >> st->shift]++;
+    }
+}
+
+static void bulk_scatter_chunk(bulk_state* st, size_t t) {
+    size_t begin = st->n * t / st->threads, end = st->n * (t + 1) / st->threads;
+    size_t* next = &st->counts[t * st->threads];  // turned into positions
+    for (size_t i = begin; i < end; i++) {
+        size_t index = (size_t)(st->hashes[i] & (u_int64_t)(st->capacity - 1));
+        st->order[next[index >> st->shift]++] = i;
+    }
+}
+
+// Insert the keys of region r without leaving it; no other thread touches
+// these slots, so no locking is needed.
+static void bulk_fill_region(bulk_state* st, size_t r) {
+    size_t region_end = (r + 1) << st->shift;
+    size_t end = r + 1 < st->threads ? st->starts[r + 1] : st->n;
+    for (size_t pos = st->starts[r]; pos < end; pos++) {
+        size_t i = st->order[pos];
+        size_t index = (size_t)(st->hashes[i] & (u_int64_t)(st->capacity - 1));
+        while (index < region_end && st->entries[index].key != NULL &&
+                strcmp(st->keys[i], st->entries[index].key) != 0) {
+            index++;
+        }
+        if (index == region_end) {
+            st->deferred[st->starts[r] + st->ndeferred[r]++] = i;
+        } else if (st->entries[index].key != NULL) {
+            st->entries[index].value = st->values[i];
+        } else {
+            char* key = strdup(st->keys[i]);
+            if (key == NULL) {
+                st->failed = true;
+                return;
+            }
+            st->entries[index].key = key;
+            st->entries[index].value = st->values[i];
+            st->inserted[r]++;
+        }
+    }
+}
+
+static void* bulk_worker(void* arg) {
+    bulk_task* task = arg;
+    if (task->phase == 0) {
+        bulk_hash_chunk(task->state, task->index);
+    } else if (task->phase == 1) {
+        bulk_scatter_chunk(task->state, task->index);
+    } else {
+        bulk_fill_region(task->state, task->index);
+    }
+    return NULL;
+}
+
+// Run one phase on every chunk/region, using the calling thread for the
+// first one. Return false if a thread couldn't be started.
+static bool bulk_run_phase(bulk_state* st, int phase) {
+    pthread_t threads[BULK_MAX_THREADS];
+    bulk_task tasks[BULK_MAX_THREADS];
+    size_t started = 0;
+    bool ok = true;
+    for (size_t t = 0; t < st->threads; t++) {
+        tasks[t].state = st;
+        tasks[t].index = t;
+        tasks[t].phase = phase;
+    }
+    for (size_t t = 1; t < st->threads; t++) {
+        if (pthread_create(&threads[t], NULL, bulk_worker, &tasks[t]) != 0) {
+            ok = false;
+            break;
+        }
+        started = t;
+    }
+    if (ok) {
+        bulk_worker(&tasks[0]);
+    }
+    for (size_t t = 1; t <= started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    return ok;
+}
+
+hashtable* hashtable_bulk_build(const char* const* keys, void* const* values, size_t n) {
+    hashtable* table = malloc(sizeof(hashtable));
+    if (table == NULL) {
+        return NULL;
+    }
+
+    // Size the table once so it ends at most half full, as hashtable_set
+    // would leave it.
+    size_t capacity = INITIAL_CAPACITY;
+    while (capacity / 2 <= n) {
+        capacity *= 2;
+    }
+    table->capacity = capacity;
+    table->length = 0;
+    table->arena = NULL;
+    table->arena_size = 0;
+    table->entries = calloc(capacity, sizeof(hashtable_entry));
+    if (table->entries == NULL) {
+        free(table);
+        return NULL;
+    }
+
+    // Use a power-of-two number of threads; each region of the entries
+    // array is the range of indices sharing the same high bits.
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = 1;
+    while (threads * 2 <= (size_t)(cpus > 0 ? cpus : 1) && threads * 2 <= BULK_MAX_THREADS &&
+            n / (threads * 2) >= BULK_MIN_PER_THREAD) {
+        threads *= 2;
+    }
+    unsigned int bits = 0;
+    while (((size_t)1 << bits) < capacity) {
+        bits++;
+    }
+    unsigned int region_bits = 0;
+    while (((size_t)1 << region_bits) < threads) {
+        region_bits++;
+    }
+
+    bulk_state st;
+    memset(&st, 0, sizeof(st));
+    st.keys = keys;
+    st.values = values;
+    st.n = n;
+    st.entries = table->entries;
+    st.capacity = capacity;
+    st.threads = threads;
+    st.shift = bits - region_bits;
+    st.hashes = malloc(n * sizeof(u_int64_t) + 1);
+    st.counts = calloc(threads * threads, sizeof(size_t));
+    st.order = malloc(n * sizeof(size_t) + 1);
+    st.starts = calloc(threads, sizeof(size_t));
+    st.deferred = malloc(n * sizeof(size_t) + 1);
+    st.ndeferred = calloc(threads, sizeof(size_t));
+    st.inserted = calloc(threads, sizeof(size_t));
+    bool ok = st.hashes != NULL && st.counts != NULL && st.order != NULL &&
+              st.starts != NULL && st.deferred != NULL && st.ndeferred != NULL &&
+              st.inserted != NULL;
+
+    // Hash every key, counting how many of each chunk fall in each region.
+    ok = ok && bulk_run_phase(&st, 0);
+
+    // Turn the counts into positions so chunks scatter their keys into
+    // per-region runs of order, chunk by chunk, keeping input order.
+    if (ok) {
+        size_t pos = 0;
+        for (size_t r = 0; r < threads; r++) {
+            st.starts[r] = pos;
+            for (size_t t = 0; t < threads; t++) {
+                size_t count = st.counts[t * threads + r];
+                st.counts[t * threads + r] = pos;
+                pos += count;
+            }
+        }
+    }
+    ok = ok && bulk_run_phase(&st, 1);
+
+    // Fill the regions in parallel, then place the few keys whose probe
+    // sequence ran into the next region.
+    ok = ok && bulk_run_phase(&st, 2) && !st.failed;
+    if (ok) {
+        for (size_t r = 0; r < threads; r++) {
+            table->length += st.inserted[r];
+        }
+        for (size_t r = 0; r < threads && ok; r++) {
+            for (size_t d = 0; d < st.ndeferred[r]; d++) {
+                size_t i = st.deferred[st.starts[r] + d];
+                if (hashtable_set_entry(table->entries, capacity, keys[i],
+                        values[i], &table->length) == NULL) {
+                    ok = false;
+                    break;
+                }
+            }
+        }
+    }
+
+    free(st.hashes);
+    free(st.counts);
+    free(st.order);
+    free(st.starts);
+    free(st.deferred);
+    free(st.ndeferred);
+    free(st.inserted);
+    if (!ok) {
+        hashtable_destroy(table);
+        return NULL;
+    }
+    return table;
+}
+
+void* hashtable_remove(hashtable* table, const char* key) {
+    size_t mask = table->capacity - 1;
+    size_t index = (size_t)(hash_key(key) & (u_int64_t)mask);
+
+    // Find the key; an empty slot means it isn't there.
+    while (table->entries[index].key != NULL) {
+        if (strcmp(key, table->entries[index].key) == 0) {
+            break;
+        }
+        index = (index + 1) & mask;
+    }
+    if (table->entries[index].key == NULL) {
+        return NULL;
+    }
+
+    void* value = table->entries[index].value;
+    if (!key_in_arena(table, table->entries[index].key)) {
+        free((void*)table->entries[index].key);
+    }
+
+    // Backward-shift deletion: pull later entries of the probe run into
+    // the hole unless their home slot lies cyclically in (hole, slot].
+    // This keeps lookups correct without tombstones.
+    size_t hole = index, next = index;
+    for (;;) {
+        next = (next + 1) & mask;
+        if (table->entries[next].key == NULL) {
+            break;
+        }
+        size_t home = (size_t)(hash_key(table->entries[next].key) & (u_int64_t)mask);
+        bool stays = hole <= next ? (hole < home && home <= next)
+                                  : (hole < home || home <= next);
+        if (!stays) {
+            table->entries[hole] = table->entries[next];
+            hole = next;
+        }
+    }
+    table->entries[hole].key = NULL;
+    table->entries[hole].value = NULL;
+    table->length--;
+
+    // Give memory back once the table is below an eighth full. Halving
+    // until it's back above that leaves it at most a quarter full, so
+    // there's room to grow again before the next expand.
+    if (table->capacity > SHRINK_MIN_CAPACITY && table->length < table->capacity / 8) {
+        size_t new_capacity = table->capacity;
+        while (new_capacity > SHRINK_MIN_CAPACITY && table->length < new_capacity / 8) {
+            new_capacity /= 2;
+        }
+        hashtable_resize(table, new_capacity);  // on failure, just stay large
+    }
+    return value;
+}
+
+bool hashtable_compact(hashtable* table) {
+    // Smallest capacity hashtable_set would accept for the current length.
+    size_t new_capacity = INITIAL_CAPACITY;
+    while (new_capacity / 2 <= table->length) {
+        new_capacity *= 2;
+    }
+
+    // Pack all keys into one allocation, in slot order.
+    size_t arena_size = 0;
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (table->entries[i].key != NULL) {
+            arena_size += strlen(table->entries[i].key) + 1;
+        }
+    }
+    char* arena = malloc(arena_size + 1);
+    hashtable_entry* new_entries = calloc(new_capacity, sizeof(hashtable_entry));
+    if (arena == NULL || new_entries == NULL) {
+        free(arena);
+        free(new_entries);
+        return false;
+    }
+
+    char* p = arena;
+    for (size_t i = 0; i < table->capacity; i++) {
+        hashtable_entry entry = table->entries[i];
+        if (entry.key == NULL) {
+            continue;
+        }
+        size_t size = strlen(entry.key) + 1;
+        memcpy(p, entry.key, size);
+        if (!key_in_arena(table, entry.key)) {
+            free((void*)entry.key);
+        }
+        hashtable_set_entry(new_entries, new_capacity, p, entry.value, NULL);
+        p += size;
+    }
+
+    free(table->entries);
+    free(table->arena);
+    table->entries = new_entries;
+    table->capacity = new_capacity;
+    table->arena = arena;
+    table->arena_size = arena_size;
+    return true;
+}
+
 size_t hashtable_length(hashtable* table) {
     return table->length;
 }
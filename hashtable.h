@@ -25,6 +25,24 @@ void* hashtable_get(hashtable* table, const char* key);
 // called). Return address of copied key, or NULL if out of memory.
 const char* hashtable_set(hashtable* table, const char* key, void* value);
 
+// Remove item with given key (NUL-terminated) from hash table, freeing
+// its copied key. Return its value, or NULL if key not found. Once the
+// table falls below an eighth full, its capacity is shrunk.
+void* hashtable_remove(hashtable* table, const char* key);
+
+// Rebuild hash table at the smallest capacity that fits its items, and
+// pack all keys into a single allocation. Key addresses returned by
+// hashtable_set are no longer valid afterwards. Return true on success,
+// false if out of memory (the table is left unchanged).
+bool hashtable_compact(hashtable* table);
+
+// Create hash table holding n items at once: keys[i] (NUL-terminated,
+// copied) maps to values[i] (which must not be NULL); for duplicate keys
+// the last value wins. The table is sized for n up front and filled by
+// several threads, so this is much faster than n calls to hashtable_set.
+// Return pointer to the table, or NULL if out of memory.
+hashtable* hashtable_bulk_build(const char* const* keys, void* const* values, size_t n);
+
 // Return number of items in hash table.
 size_t hashtable_length(hashtable* table);
 
@@ -43,7 +61,8 @@ hashtablei hashtable_iterator(hashtable* table);
 
 // Move iterator to next item in hash table, update iterator's key
 // and value to current item, and return true. If there are no more
-// items, return false. Don't call hashtable_set during iteration.
+// items, return false. Don't call hashtable_set, hashtable_remove or
+// hashtable_compact during iteration.
 bool hashtable_next(hashtablei* it);
 
 #endif // _hashtable_H
\ No newline at end of file
@@ -0,0 +1,135 @@
+#include "histogram.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#define HALF_COUNT (HISTOGRAM_SUB_COUNT / 2)
+
+// One thread's copy. Only its thread writes it, so plain loads and stores
+// suffice; they're atomic so readers never see torn counts.
+typedef struct histogram_shard {
+    _Atomic uint64_t counts[HISTOGRAM_BUCKETS];
+    _Atomic uint64_t max;
+    struct histogram_shard* next;
+} histogram_shard;
+
+struct histogram {
+    const char* name;
+    size_t id;
+    _Atomic(histogram_shard*) shards;
+};
+
+static atomic_size_t next_id;
+
+// This thread's copy of each histogram, by id. Ids aren't reused, so a
+// copy never outlives its histogram here.
+static _Thread_local histogram_shard* local[HISTOGRAM_MAX];
+
+histogram* histogram_create(const char* name) {
+    size_t id = atomic_fetch_add(&next_id, 1);
+    if (id >= HISTOGRAM_MAX) {
+        return NULL;
+    }
+    histogram* h = malloc(sizeof(histogram));
+    if (h == NULL) {
+        return NULL;
+    }
+    h->name = name;
+    h->id = id;
+    atomic_init(&h->shards, NULL);
+    return h;
+}
+
+void histogram_destroy(histogram* h) {
+    histogram_shard* shard = atomic_load(&h->shards);
+    while (shard != NULL) {
+        histogram_shard* next = shard->next;
+        free(shard);
+        shard = next;
+    }
+    free(h);
+}
+
+static size_t bucket_of(uint64_t value) {
+    if (value < HISTOGRAM_SUB_COUNT) {
+        return value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    uint64_t top = value >> (exponent - HISTOGRAM_SUB_BITS + 1);  // [HALF_COUNT, SUB_COUNT)
+    return HISTOGRAM_SUB_COUNT + (size_t)(exponent - HISTOGRAM_SUB_BITS) * HALF_COUNT + (top - HALF_COUNT);
+}
+
+// Highest value counted in bucket.
+static uint64_t highest_in(size_t bucket) {
+    if (bucket < HISTOGRAM_SUB_COUNT) {
+        return bucket;
+    }
+    size_t k = bucket - HISTOGRAM_SUB_COUNT;
+    int exponent = HISTOGRAM_SUB_BITS + (int)(k / HALF_COUNT);
+    uint64_t top = HALF_COUNT + k % HALF_COUNT;
+    // Wraps to UINT64_MAX for the last bucket.
+    return ((top + 1) << (exponent - HISTOGRAM_SUB_BITS + 1)) - 1;
+}
+
+void histogram_record(histogram* h, uint64_t value) {
+    histogram_shard* shard = local[h->id];
+    if (shard == NULL) {
+        shard = calloc(1, sizeof(histogram_shard));
+        if (shard == NULL) {
+            return;  // the value goes uncounted
+        }
+        shard->next = atomic_load(&h->shards);
+        while (!atomic_compare_exchange_weak(&h->shards, &shard->next, shard)) {
+        }
+        local[h->id] = shard;
+    }
+    _Atomic uint64_t* count = &shard->counts[bucket_of(value)];
+    atomic_store_explicit(count, atomic_load_explicit(count, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    if (value > atomic_load_explicit(&shard->max, memory_order_relaxed)) {
+        atomic_store_explicit(&shard->max, value, memory_order_relaxed);
+    }
+}
+
+void histogram_summarize(histogram* h, histogram_summary* summary) {
+    uint64_t* counts = calloc(HISTOGRAM_BUCKETS, sizeof(uint64_t));
+    *summary = (histogram_summary){ 0 };
+    if (counts == NULL) {
+        return;
+    }
+    for (histogram_shard* shard = atomic_load(&h->shards); shard != NULL; shard = shard->next) {
+        for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            uint64_t n = atomic_load_explicit(&shard->counts[i], memory_order_relaxed);
+            counts[i] += n;
+            summary->count += n;
+        }
+        uint64_t max = atomic_load_explicit(&shard->max, memory_order_relaxed);
+        if (max > summary->max) {
+            summary->max = max;
+        }
+    }
+    // Each percentile is the value at its rank, counting from 1.
+    const double quantiles[] = { 0.5, 0.99, 0.999 };
+    uint64_t* values[] = { &summary->p50, &summary->p99, &summary->p999 };
+    uint64_t seen = 0;
+    size_t q = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS && q < 3; i++) {
+        seen += counts[i];
+        while (q < 3) {
+            double exact = quantiles[q] * summary->count;
+            uint64_t rank = (uint64_t)exact < exact ? (uint64_t)exact + 1 : (uint64_t)exact;
+            if (seen == 0 || seen < rank) {
+                break;
+            }
+            *values[q++] = highest_in(i) < summary->max ? highest_in(i) : summary->max;
+        }
+    }
+    free(counts);
+}
+
+void histogram_report(histogram* h, FILE* out) {
+    histogram_summary s;
+    histogram_summarize(h, &s);
+    fprintf(out, "%-8s %12llu  p50 %10.3f  p99 %10.3f  p99.9 %10.3f  max %10.3f us\n", h->name,
+            (unsigned long long)s.count, s.p50 / 1e3, s.p99 / 1e3, s.p999 / 1e3, s.max / 1e3);
+}
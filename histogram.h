@@ -0,0 +1,60 @@
+// Latency histograms.
+//
+// A histogram counts values (nanoseconds, here) in log-linear buckets, as
+// HDR histograms do: exact below HISTOGRAM_SUB_COUNT, then
+// HISTOGRAM_SUB_COUNT / 2 buckets per power of two, so any value is known
+// to within about 3% over the whole 64-bit range, in fixed memory.
+//
+// Each thread records into its own copy without locks or atomic
+// read-modify-writes; reading merges the copies, and may run while other
+// threads record.
+
+#ifndef _histogram_H
+#define _histogram_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define HISTOGRAM_SUB_BITS 6
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_COUNT + (64 - HISTOGRAM_SUB_BITS) * HISTOGRAM_SUB_COUNT / 2)
+#define HISTOGRAM_MAX 16  // histograms per process
+
+// Histogram: create with histogram_create, free with histogram_destroy
+// once no thread records into it any more.
+typedef struct histogram histogram;
+
+// Percentiles of a histogram, each the highest value of its bucket.
+typedef struct {
+    uint64_t count;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;  // exact
+} histogram_summary;
+
+// Create an empty histogram reported as name (not copied). Return NULL if
+// out of memory or HISTOGRAM_MAX histograms have been created.
+histogram* histogram_create(const char* name);
+
+// Free h and every thread's copy.
+void histogram_destroy(histogram* h);
+
+// Count value in the calling thread's copy of h.
+void histogram_record(histogram* h, uint64_t value);
+
+// Merge every thread's copy of h into summary.
+void histogram_summarize(histogram* h, histogram_summary* summary);
+
+// Write a line with the count and percentiles of h, in microseconds.
+void histogram_report(histogram* h, FILE* out);
+
+// Monotonic clock in nanoseconds, for timing what's recorded.
+static inline uint64_t histogram_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+#endif // _histogram_H
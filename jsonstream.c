@@ -0,0 +1,504 @@
+#include "jsonstream.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MALFORMED JSONSTREAM_MALFORMED  // the current record is malformed
+
+// Tokenizer states.
+enum {
+    ST_RECORD,          // between records, waiting for '{'
+    ST_KEY_OR_END,      // after '{': a key or '}'
+    ST_KEY,             // after ',': a key
+    ST_COLON,           // after a key
+    ST_VALUE,           // after ':'
+    ST_AFTER_VALUE,     // ',' or '}'
+    ST_STRING,          // inside a key or string value
+    ST_ESCAPE,          // after '\' in a string
+    ST_UNICODE,         // reading the hex digits of \uXXXX
+    ST_NUMBER,
+    ST_LITERAL,         // true, false or null
+    ST_NESTED,          // skipping a nested object or array
+    ST_NESTED_STRING,
+    ST_NESTED_ESCAPE,
+    ST_SKIP_LINE,       // ignoring the rest of the line
+};
+
+// Tokenizer structure: create with jsonstream_create, free with jsonstream_destroy.
+struct jsonstream {
+    jsonstream_handler handler;
+    void* ctx;
+    size_t cap;            // bytes kept in memory per key or value
+    int state;
+    char* key;             // current key, NUL-terminated
+    size_t key_length;
+    size_t key_capacity;   // the cap, or the longest key so far
+    char* buffer;          // current value (or its unspilled tail)
+    size_t buffer_length;
+    bool in_key;           // the string being read is a key
+    size_t string_length;  // decoded bytes of the current string
+    size_t string_nul;     // offset of its first NUL, or SIZE_MAX
+    FILE* spill;           // temporary file for long strings
+    bool spilling;         // current string has spilled
+    unsigned int code;     // \u escape being read
+    int code_digits;
+    unsigned int high;     // pending high surrogate, or 0
+    int depth;             // nesting depth while skipping
+    bool skip;             // the handler declined the current key
+    bool truncated;        // number was longer than the cap
+};
+
+jsonstream* jsonstream_create(const jsonstream_handler* handler, void* ctx, size_t cap) {
+    jsonstream* js = calloc(1, sizeof(jsonstream));
+    if (js == NULL) {
+        return NULL;
+    }
+    js->handler = *handler;
+    js->ctx = ctx;
+    js->cap = cap > JSONSTREAM_MIN_CAP ? cap : JSONSTREAM_MIN_CAP;
+    js->key_capacity = js->cap;
+    js->key = malloc(js->key_capacity + 1);
+    js->buffer = malloc(js->cap + 1);
+    if (js->key == NULL || js->buffer == NULL) {
+        jsonstream_destroy(js);
+        return NULL;
+    }
+    js->state = ST_RECORD;
+    return js;
+}
+
+void jsonstream_destroy(jsonstream* js) {
+    if (js->spill != NULL) {
+        fclose(js->spill);
+    }
+    free(js->key);
+    free(js->buffer);
+    free(js);
+}
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Abandon the current record. Skip the rest of its line, unless the
+// offending character already ended it.
+static int record_error(jsonstream* js, char c) {
+    js->state = c == '\n' ? ST_RECORD : ST_SKIP_LINE;
+    if (js->handler.on_record_error != NULL) {
+        return js->handler.on_record_error(js->ctx);
+    }
+    return 0;
+}
+
+static void string_begin(jsonstream* js, bool in_key) {
+    js->in_key = in_key;
+    js->key_length = in_key ? 0 : js->key_length;
+    js->buffer_length = 0;
+    js->string_length = 0;
+    js->string_nul = SIZE_MAX;
+    js->spilling = false;
+    js->high = 0;
+    js->state = ST_STRING;
+}
+
+// Append one decoded byte to the current string. Return 0 on success, or
+// -1 on I/O error or if out of memory.
+static int string_byte(jsonstream* js, unsigned char c) {
+    if (c == 0 && js->string_nul == SIZE_MAX) {
+        js->string_nul = js->string_length;
+    }
+    js->string_length++;
+    if (js->in_key) {
+        if (js->key_length == js->key_capacity) {
+            // The dictionary needs the whole key, so keys aren't capped.
+            char* grown = realloc(js->key, js->key_capacity * 2 + 1);
+            if (grown == NULL) {
+                return -1;
+            }
+            js->key = grown;
+            js->key_capacity *= 2;
+        }
+        js->key[js->key_length++] = (char)c;
+        return 0;
+    }
+    if (js->buffer_length == js->cap) {
+        // Move what's buffered to the spill file and keep going.
+        if (js->spill == NULL) {
+            js->spill = tmpfile();
+            if (js->spill == NULL) {
+                return -1;
+            }
+        }
+        if (!js->spilling) {
+            rewind(js->spill);
+            js->spilling = true;
+        }
+        if (fwrite(js->buffer, 1, js->buffer_length, js->spill) != js->buffer_length) {
+            return -1;
+        }
+        js->buffer_length = 0;
+    }
+    js->buffer[js->buffer_length++] = (char)c;
+    return 0;
+}
+
+// Append code point as UTF-8.
+static int string_code_point(jsonstream* js, unsigned int cp) {
+    unsigned char out[4];
+    int n;
+    if (cp < 0x80) {
+        out[0] = (unsigned char)cp;
+        n = 1;
+    } else if (cp < 0x800) {
+        out[0] = (unsigned char)(0xC0 | (cp >> 6));
+        out[1] = (unsigned char)(0x80 | (cp & 0x3F));
+        n = 2;
+    } else if (cp < 0x10000) {
+        out[0] = (unsigned char)(0xE0 | (cp >> 12));
+        out[1] = (unsigned char)(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (unsigned char)(0x80 | (cp & 0x3F));
+        n = 3;
+    } else {
+        out[0] = (unsigned char)(0xF0 | (cp >> 18));
+        out[1] = (unsigned char)(0x80 | ((cp >> 12) & 0x3F));
+        out[2] = (unsigned char)(0x80 | ((cp >> 6) & 0x3F));
+        out[3] = (unsigned char)(0x80 | (cp & 0x3F));
+        n = 4;
+    }
+    for (int i = 0; i < n; i++) {
+        int result = string_byte(js, out[i]);
+        if (result != 0) {
+            return result;
+        }
+    }
+    return 0;
+}
+
+// A lone high surrogate is written as U+FFFD, as json-c does.
+static int flush_high_surrogate(jsonstream* js) {
+    if (js->high == 0) {
+        return 0;
+    }
+    js->high = 0;
+    return string_code_point(js, 0xFFFD);
+}
+
+static int emit(jsonstream* js, const jsonstream_value* value) {
+    js->state = ST_AFTER_VALUE;
+    if (js->skip) {
+        return 0;
+    }
+    return js->handler.on_field(js->ctx, js->key, value);
+}
+
+// The closing quote of a string was read.
+static int string_end(jsonstream* js) {
+    if (js->in_key) {
+        js->key[js->key_length] = '\0';
+        js->state = ST_COLON;
+        js->skip = js->handler.on_key != NULL && !js->handler.on_key(js->ctx, js->key);
+        return 0;
+    }
+
+    jsonstream_value value;
+    memset(&value, 0, sizeof(value));
+    value.type = JSONSTREAM_STRING;
+    value.length = js->string_length;
+    value.nul = js->string_nul == SIZE_MAX ? js->string_length : js->string_nul;
+    if (js->spilling) {
+        if (fwrite(js->buffer, 1, js->buffer_length, js->spill) != js->buffer_length ||
+                fflush(js->spill) != 0) {
+            return -1;
+        }
+        rewind(js->spill);
+        value.spill = js->spill;
+    } else {
+        js->buffer[js->buffer_length] = '\0';
+        value.s = js->buffer;
+    }
+    return emit(js, &value);
+}
+
+// A number or literal ended. Return 0 on success, MALFORMED if it was
+// malformed, or the callback's result.
+static int token_end(jsonstream* js) {
+    jsonstream_value value;
+    memset(&value, 0, sizeof(value));
+    js->buffer[js->buffer_length] = '\0';
+    const char* token = js->buffer;
+
+    if (js->state == ST_LITERAL) {
+        if (strcmp(token, "true") == 0 || strcmp(token, "false") == 0) {
+            value.type = JSONSTREAM_BOOLEAN;
+            value.b = token[0] == 't';
+        } else if (strcmp(token, "null") == 0) {
+            value.type = JSONSTREAM_OTHER;
+        } else {
+            return MALFORMED;
+        }
+        return emit(js, &value);
+    }
+
+    // -?digits is an integer; a fraction or exponent makes it a double.
+    const char* p = token + (token[0] == '-');
+    if (*p < '0' || *p > '9') {
+        return MALFORMED;
+    }
+    bool integer = true;
+    for (; *p; p++) {
+        if (*p == '.' || *p == 'e' || *p == 'E') {
+            integer = false;
+        } else if (*p == '+' || *p == '-') {
+            if (p[-1] != 'e' && p[-1] != 'E') {
+                return MALFORMED;  // a sign only leads the number or its exponent
+            }
+        } else if (*p < '0' || *p > '9') {
+            return MALFORMED;
+        }
+    }
+    if (integer && js->truncated) {
+        value.type = JSONSTREAM_INT;
+        value.i = token[0] == '-' ? LLONG_MIN : LLONG_MAX;
+    } else if (integer) {
+        value.type = JSONSTREAM_INT;
+        value.i = strtoll(token, NULL, 10);  // saturates on overflow
+    } else {
+        value.type = JSONSTREAM_OTHER;
+    }
+    return emit(js, &value);
+}
+
+int jsonstream_feed(jsonstream* js, const char* data, size_t size) {
+    size_t i = 0;
+    int result = 0;
+    while (i < size) {
+        char c = data[i];
+        switch (js->state) {
+            case ST_RECORD:
+                if (c == '{') {
+                    js->state = ST_KEY_OR_END;
+                    if (js->handler.on_record_begin != NULL) {
+                        result = js->handler.on_record_begin(js->ctx);
+                    }
+                } else if (!is_space(c)) {
+                    // Not a record; drop the line, like a failed json-c parse.
+                    js->state = ST_SKIP_LINE;
+                    continue;
+                }
+                break;
+
+            case ST_KEY_OR_END:
+            case ST_KEY:
+                if (c == '"') {
+                    string_begin(js, true);
+                } else if (c == '}' && js->state == ST_KEY_OR_END) {
+                    js->state = ST_SKIP_LINE;
+                    if (js->handler.on_record_end != NULL) {
+                        result = js->handler.on_record_end(js->ctx);
+                    }
+                } else if (!is_space(c)) {
+                    result = record_error(js, c);
+                }
+                break;
+
+            case ST_COLON:
+                if (c == ':') {
+                    js->state = ST_VALUE;
+                } else if (!is_space(c)) {
+                    result = record_error(js, c);
+                }
+                break;
+
+            case ST_VALUE:
+                if (c == '"' && js->skip) {
+                    // Skipped like a nested string, at depth 0.
+                    js->depth = 0;
+                    js->state = ST_NESTED_STRING;
+                } else if (c == '"') {
+                    string_begin(js, false);
+                } else if (c == '-' || (c >= '0' && c <= '9')) {
+                    js->buffer_length = 0;
+                    js->truncated = false;
+                    js->state = ST_NUMBER;
+                    continue;
+                } else if (c >= 'a' && c <= 'z') {
+                    js->buffer_length = 0;
+                    js->state = ST_LITERAL;
+                    continue;
+                } else if (c == '{' || c == '[') {
+                    js->depth = 1;
+                    js->state = ST_NESTED;
+                } else if (!is_space(c)) {
+                    result = record_error(js, c);
+                }
+                break;
+
+            case ST_AFTER_VALUE:
+                if (c == ',') {
+                    js->state = ST_KEY;
+                } else if (c == '}') {
+                    js->state = ST_SKIP_LINE;
+                    if (js->handler.on_record_end != NULL) {
+                        result = js->handler.on_record_end(js->ctx);
+                    }
+                } else if (!is_space(c)) {
+                    result = record_error(js, c);
+                }
+                break;
+
+            case ST_STRING:
+                if (c == '"') {
+                    result = flush_high_surrogate(js);
+                    if (result == 0) {
+                        result = string_end(js);
+                    }
+                } else if (c == '\\') {
+                    js->state = ST_ESCAPE;
+                } else if (c == '\n') {
+                    result = record_error(js, c);
+                } else {
+                    result = flush_high_surrogate(js);
+                    if (result == 0) {
+                        result = string_byte(js, (unsigned char)c);
+                    }
+                }
+                break;
+
+            case ST_ESCAPE: {
+                static const char escapes[] = "\"\"\\\\//b\bf\fn\nr\rt\t";
+                const char* e = NULL;
+                for (const char* p = escapes; *p; p += 2) {
+                    if (*p == c) {
+                        e = p;
+                        break;
+                    }
+                }
+                if (c == 'u') {
+                    js->code = 0;
+                    js->code_digits = 0;
+                    js->state = ST_UNICODE;
+                } else if (e != NULL) {
+                    result = flush_high_surrogate(js);
+                    if (result == 0) {
+                        result = string_byte(js, (unsigned char)e[1]);
+                    }
+                    js->state = ST_STRING;
+                } else {
+                    result = record_error(js, c);
+                }
+                break;
+            }
+
+            case ST_UNICODE: {
+                int digit = c >= '0' && c <= '9' ? c - '0'
+                          : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                          : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+                if (digit < 0) {
+                    result = record_error(js, c);
+                    break;
+                }
+                js->code = js->code * 16 + (unsigned int)digit;
+                if (++js->code_digits < 4) {
+                    break;
+                }
+                js->state = ST_STRING;
+                if (js->code >= 0xD800 && js->code < 0xDC00) {
+                    result = flush_high_surrogate(js);
+                    js->high = js->code;
+                } else if (js->code >= 0xDC00 && js->code < 0xE000 && js->high != 0) {
+                    unsigned int cp = 0x10000 + ((js->high - 0xD800) << 10) + (js->code - 0xDC00);
+                    js->high = 0;
+                    result = string_code_point(js, cp);
+                } else {
+                    result = flush_high_surrogate(js);
+                    if (result == 0) {
+                        result = string_code_point(js, js->code >= 0xDC00 && js->code < 0xE000
+                                                       ? 0xFFFD : js->code);
+                    }
+                }
+                break;
+            }
+
+            case ST_NUMBER:
+            case ST_LITERAL:
+                if ((js->state == ST_NUMBER &&
+                        ((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' ||
+                         c == 'e' || c == 'E')) ||
+                        (js->state == ST_LITERAL && c >= 'a' && c <= 'z')) {
+                    // Only the head of an overlong number is kept; it's
+                    // either a double (dropped) or saturates anyway.
+                    if (js->buffer_length == js->cap) {
+                        if (js->state == ST_LITERAL) {
+                            result = record_error(js, c);
+                        }
+                        js->truncated = true;
+                        break;
+                    }
+                    js->buffer[js->buffer_length++] = c;
+                    break;
+                }
+                // The delimiter is looked at again in ST_AFTER_VALUE.
+                result = token_end(js);
+                if (result == MALFORMED) {
+                    result = record_error(js, c);
+                    break;
+                }
+                if (result == 0) {
+                    continue;
+                }
+                break;
+
+            case ST_NESTED:
+                if (c == '"') {
+                    js->state = ST_NESTED_STRING;
+                } else if (c == '{' || c == '[') {
+                    js->depth++;
+                } else if ((c == '}' || c == ']') && --js->depth == 0) {
+                    jsonstream_value value;
+                    memset(&value, 0, sizeof(value));
+                    value.type = JSONSTREAM_OTHER;
+                    result = emit(js, &value);
+                }
+                break;
+
+            case ST_NESTED_STRING:
+                if (c == '\\') {
+                    js->state = ST_NESTED_ESCAPE;
+                } else if (c == '"') {
+                    js->state = js->depth > 0 ? ST_NESTED : ST_AFTER_VALUE;
+                } else if (c == '\n' && js->depth == 0) {
+                    result = record_error(js, c);
+                }
+                break;
+
+            case ST_NESTED_ESCAPE:
+                js->state = ST_NESTED_STRING;
+                break;
+
+            case ST_SKIP_LINE:
+                if (c == '\n') {
+                    js->state = ST_RECORD;
+                }
+                break;
+        }
+
+        // A malformed token ends the record; anything else stops.
+        if (result == MALFORMED) {
+            result = record_error(js, c);
+        }
+        if (result != 0) {
+            return result;
+        }
+        i++;
+    }
+    return 0;
+}
+
+int jsonstream_finish(jsonstream* js) {
+    if (js->state == ST_RECORD || js->state == ST_SKIP_LINE) {
+        return 0;
+    }
+    return record_error(js, '\n');
+}
@@ -0,0 +1,76 @@
+// Incremental tokenizer for flat JSON records, with bounded memory.
+//
+// Input is pushed in buffers of any size. The tokenizer reports each
+// top-level field of a record as soon as its value is complete, so a
+// record never has to be held in memory as a whole. Numbers and strings
+// up to the memory cap are kept in memory; a longer string is spilled to a
+// temporary file as it arrives and handed out from there. Keys are kept
+// whole whatever their length, since they are looked up as a whole.
+// Nested objects and arrays, and the values of keys the handler declines,
+// are skipped without being buffered.
+
+#ifndef _jsonstream_H
+#define _jsonstream_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define JSONSTREAM_MIN_CAP 16  // smallest memory cap accepted
+
+// Kind of a field value.
+typedef enum {
+    JSONSTREAM_INT,
+    JSONSTREAM_BOOLEAN,
+    JSONSTREAM_STRING,
+    JSONSTREAM_OTHER,   // null, double, object or array; value not kept
+} jsonstream_type;
+
+// Value of one field, valid only during the on_field call.
+typedef struct {
+    jsonstream_type type;
+    long long i;         // JSONSTREAM_INT, saturated to the long long range
+    bool b;              // JSONSTREAM_BOOLEAN
+    const char* s;       // JSONSTREAM_STRING kept in memory, or NULL if spilled
+    FILE* spill;         // JSONSTREAM_STRING spilled to disk, positioned at its start
+    size_t length;       // decoded bytes of the string
+    size_t nul;          // offset of the first NUL in the string, or length if none
+} jsonstream_value;
+
+#define JSONSTREAM_MALFORMED (-2)  // on_field result rejecting the current record
+
+// Callbacks; return 0 to continue, or a positive value to stop tokenizing.
+// on_field may also return JSONSTREAM_MALFORMED, to have the record
+// treated as malformed.
+typedef struct {
+    int (*on_record_begin)(void* ctx);
+    int (*on_field)(void* ctx, const char* key, const jsonstream_value* value);
+    int (*on_record_end)(void* ctx);
+    // The current record is malformed; the tokenizer skips to the next line.
+    int (*on_record_error)(void* ctx);
+    // Return false to skip the value of key unread, without an on_field
+    // call. NULL keeps every field.
+    bool (*on_key)(void* ctx, const char* key);
+} jsonstream_handler;
+
+// Tokenizer structure: create with jsonstream_create, free with jsonstream_destroy.
+typedef struct jsonstream jsonstream;
+
+// Create tokenizer keeping at most cap bytes (raised to JSONSTREAM_MIN_CAP)
+// per value in memory.
+// Return NULL if out of memory.
+jsonstream* jsonstream_create(const jsonstream_handler* handler, void* ctx, size_t cap);
+
+// Free tokenizer and its spill file.
+void jsonstream_destroy(jsonstream* js);
+
+// Tokenize size bytes of input. Return 0 on success, -1 if spilling a
+// string to disk failed or out of memory, or the positive result of a
+// callback.
+int jsonstream_feed(jsonstream* js, const char* data, size_t size);
+
+// Signal end of input, completing or rejecting the last record. Return
+// as jsonstream_feed.
+int jsonstream_finish(jsonstream* js);
+
+#endif // _jsonstream_H
@@ -1,90 +1,942 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <json-c/json.h>
 
 
-#include "TLV/tlv_box.h"
-#include "hashtable.h"
+#include "aio.h"
+#include "block.h"
+#include "checkpoint.h"
+#include "convert.h"
+#include "decompress.h"
+#include "direct.h"
+#include "durable.h"
+#include "follow.h"
+#include "histogram.h"
+#include "jsonstream.h"
+#include "mapped.h"
+#include "perfcount.h"
+#include "projection.h"
+#include "server.h"
+#include "shard.h"
+#include "trace.h"
+#include "pipeline.h"
+
+// Number of leading records sampled to infer a fixed-layout schema.
+#define DEFAULT_SCHEMA_SAMPLES 64
+
+// Checkpoint file of -c, and how many lines go by between clock checks.
+#define CHECKPOINT_PATH "binary_tlv_format.bin.checkpoint"
+#define CHECKPOINT_CHECK_LINES 1024
+
+// Longest a record waits to be flushed in follow mode (-f) by default.
+#define FOLLOW_DEFAULT_FLUSH_MS 10
+
+// One record write in this many is timed by -H; most are a copy into a buffer.
+#define WRITE_LATENCY_SAMPLE 16
+
+// Input read per step in streaming mode (-m).
+#define STREAM_READ_SIZE (64 * 1024)
+
+// State of a streaming conversion (-m): fields are written as they are
+// tokenized, and a malformed record is rolled back.
+typedef struct {
+  FILE* output_stream;
+  converter* conv;
+  size_t record_counter;  // conv->counter when the current record began
+  long record_start;      // output offset of the current record
+  uint64_t record;        // number of the current record, from 1
+  uint64_t* written;      // by tag: number of the last record that wrote it
+  size_t written_capacity;
+  char copy[STREAM_READ_SIZE];  // for copying spilled strings
+} stream_state;
+
+
+// block_sink writing to a stdio stream.
+static int write_stream(void* ctx, const void* data, size_t size) {
+  return fwrite(data, 1, size, (FILE*)ctx) == size ? 0 : -1;
+}
+
+// Where encoded records go: a stdio stream, an overlapped writer (-a), a
+// mapped file (-w) or an O_DIRECT file (-O), possibly through checksummed
+// blocks, or shards (-S), which frame their own blocks.
+typedef struct {
+  FILE* stream;
+  block_writer* blocks;
+  durable_writer* durable;  // under blocks, for -d
+  aio_writer* aio;
+  mapped_writer* mapped;
+  direct_writer* direct;
+  shard_set* shards;
+  histogram* write_latency;  // or NULL
+  size_t writes;
+} output;
+
+// Write one encoded record, framed into a checksummed block if blocks is set.
+static int write_output(output* out, const void* data, size_t size) {
+  if (out->shards != NULL)
+    return shard_write(out->shards, data, size);
+  if (out->blocks != NULL) {
+    if (block_writer_add(out->blocks, data, size) != 0)
+      return -1;
+    // Commit a partial block on time too, not just full ones
+    if (out->durable != NULL && durable_due(out->durable) &&
+        (block_writer_flush(out->blocks) != 0 || durable_commit(out->durable) != 0))
+      return -1;
+    return 0;
+  }
+  if (out->aio != NULL)
+    return aio_writer_write(out->aio, data, size);
+  if (out->mapped != NULL)
+    return mapped_write(out->mapped, data, size);
+  if (out->direct != NULL)
+    return direct_write(out->direct, data, size);
+  return write_stream(out->stream, data, size);
+}
+
+static volatile sig_atomic_t report_requested;
+
+static void report_latencies(void);
+
+static int write_record(void* ctx, const void* data, size_t size) {
+  output* out = ctx;
+  if (report_requested) {
+    report_requested = 0;
+    report_latencies();
+  }
+  if (out->write_latency == NULL || out->writes++ % WRITE_LATENCY_SAMPLE != 0)
+    return write_output(out, data, size);
+  uint64_t start = histogram_now();
+  int result = write_output(out, data, size);
+  histogram_record(out->write_latency, histogram_now() - start);
+  return result;
+}
+
+// Latency histograms of -H: encoding each record, and samples of dictionary
+// lookups and record writes.
+static histogram* latencies[3];
+
+static void report_latencies(void) {
+  for (size_t i = 0; i < sizeof(latencies) / sizeof(latencies[0]); i++)
+    histogram_report(latencies[i], stderr);
+}
+
+// Trace of -T, written at exit.
+static const char* trace_path;
+
+static void write_trace(void) {
+  if (trace_write(trace_path) != 0)
+    perror(trace_path);
+}
+
+// SIGUSR1 asks for a report, which the next record written prints. A
+// reporter thread would cost more than the check: glibc's stdio and malloc
+// take locks once there's a second thread.
+static void request_report(int signal) {
+  (void)signal;
+  report_requested = 1;
+}
+
+// Put everything written so far on disk, then checkpoint it with the
+// input converted so far. Return 0 on success, -1 on error.
+static int save_checkpoint(output* out, uint64_t input_offset, const converter* conv,
+                           const char* input_path) {
+  if (out->blocks != NULL && block_writer_flush(out->blocks) != 0)
+    return -1;
+  if (fflush(out->stream) != 0 || fdatasync(fileno(out->stream)) != 0)
+    return -1;
+  long length = ftell(out->stream);
+  if (length < 0)
+    return -1;
+  checkpoint cp = { input_offset, (uint64_t)length };
+  return checkpoint_save(CHECKPOINT_PATH, input_path, &cp, conv);
+}
+
+// Read the next line, from the overlapped reader if there is one.
+static ssize_t read_line(aio_reader* reader, FILE* in, char** line, size_t* len) {
+  uint64_t start = trace_begin();
+  ssize_t n = reader != NULL ? aio_reader_getline(reader, line, len) : getline(line, len, in);
+  trace_end("read", start);
+  return n;
+}
+
+// Move input to offset, by reading up to it where the stream can't seek.
+static int skip_input(FILE* input, uint64_t offset) {
+  if (fseeko(input, (off_t)offset, SEEK_SET) == 0)
+    return 0;
+  clearerr(input);
+  char buffer[64 * 1024];
+  while (offset > 0) {
+    size_t n = fread(buffer, 1, offset < sizeof(buffer) ? offset : sizeof(buffer), input);
+    if (n == 0)
+      return -1;
+    offset -= n;
+  }
+  return 0;
+}
+
+// Push everything written so far out to the file.
+static int flush_output(output* out) {
+  if (out->blocks != NULL && block_writer_flush(out->blocks) != 0)
+    return -1;
+  return fflush(out->stream);
+}
+
+static volatile sig_atomic_t stop_requested;
+
+static void request_stop(int signal) {
+  (void)signal;
+  stop_requested = 1;
+}
+
+// Stop following or serving on SIGINT or SIGTERM. Without SA_RESTART, the
+// signal interrupts the wait for input.
+static void catch_stop_signals(void) {
+  struct sigaction action = { .sa_handler = request_stop };
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+}
+
+// Convert lines as they are appended to the followed file, until SIGINT or
+// SIGTERM. Records are flushed once flush_records are pending, or the
+// oldest has waited flush_ms milliseconds; with flush_records at most 1,
+// each one is flushed as soon as it's written.
+static int convert_following(follower* input, output* out, converter* conv,
+                             size_t flush_records, long flush_ms) {
+  catch_stop_signals();
+  char* line = NULL;
+  size_t len = 0;
+  unsigned char* record = NULL;
+  size_t record_capacity = 0;
+  size_t pending = 0;
+  struct timespec oldest, now;
+  int result = 0;
+  while (result == 0 && !stop_requested) {
+    // Wait no longer than the oldest pending record may
+    int timeout = -1;
+    if (pending > 0) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      long waited = (now.tv_sec - oldest.tv_sec) * 1000 + (now.tv_nsec - oldest.tv_nsec) / 1000000;
+      timeout = waited < flush_ms ? (int)(flush_ms - waited) : 0;
+    }
+    ssize_t n = follow_getline(input, &line, &len, timeout);
+    if (n < 0) {
+      if (errno != EINTR)
+        result = -1;
+      continue;
+    }
+    if (n > 0) {
+      int size = converter_encode_line(conv, line, &record, &record_capacity);
+      if (size == CONVERT_SKIPPED)
+        continue;
+      if (size < 0 || write_record(out, record, size) != 0) {
+        result = -1;
+        continue;
+      }
+      if (pending++ == 0)
+        clock_gettime(CLOCK_MONOTONIC, &oldest);
+      if (pending < flush_records)
+        continue;
+    }
+    // A full batch, or time is up
+    if (pending > 0) {
+      result = flush_output(out);
+      pending = 0;
+    }
+  }
+  free(record);
+  free(line);
+  return result;
+}
+
+// Check every block of a file written with -b. If the file has commit
+// markers (-d), a torn tail after the last one, from an unfinished write,
+// is ignored. Return 0 if the file is intact.
+static int verify_blocks(const char* path) {
+  FILE* in = fopen(path, "rb");
+  if (in == NULL) {
+    perror(path);
+    return -1;
+  }
+  block_verification v;
+  int result = block_verify(in, &v);
+  fclose(in);
+  if (result != 0) {
+    fprintf(stderr, "%s: corrupt block at offset %llu\n", path,
+            (unsigned long long)v.bad_offset);
+    return result;
+  }
+  if (v.torn)
+    printf("%s: ignoring uncommitted tail after offset %llu\n", path,
+           (unsigned long long)v.end);
+  printf("%s: %zu blocks, %zu records ok\n", path, v.blocks, v.records);
+  return 0;
+}
+
+static int stream_record_begin(void* ctx) {
+  stream_state* st = ctx;
+  st->record_start = ftell(st->output_stream);
+  st->record_counter = st->conv->counter;
+  st->record++;
+  return st->record_start < 0 ? -1 : 0;
+}
+
+static int stream_write(stream_state* st, const void* data, size_t size) {
+  return write_stream(st->output_stream, data, size) == 0 ? 0 : -1;
+}
+
+static int stream_field(void* ctx, const char* key, const jsonstream_value* value) {
+  stream_state* st = ctx;
+  int* tag = converter_tag(st->conv, key);
+  if (tag == NULL)
+    return -1;
+  int header[2] = { *tag, 0 };
+
+  // A key given twice would write its tag twice, which tlv_box_parse
+  // rejects; json-c would keep the last value, but the first is already
+  // written. Drop the record as malformed instead.
+  if ((size_t)*tag >= st->written_capacity) {
+    size_t capacity = st->written_capacity > 0 ? st->written_capacity : 64;
+    while (capacity <= (size_t)*tag)
+      capacity *= 2;
+    uint64_t* grown = realloc(st->written, capacity * sizeof(uint64_t));
+    if (grown == NULL)
+      return -1;
+    memset(grown + st->written_capacity, 0, (capacity - st->written_capacity) * sizeof(uint64_t));
+    st->written = grown;
+    st->written_capacity = capacity;
+  }
+  if (st->written[*tag] == st->record)
+    return JSONSTREAM_MALFORMED;
+  st->written[*tag] = st->record;
+
+  switch (value->type) {
+    case JSONSTREAM_INT: {
+      // Clamp like json_object_get_int.
+      int i = value->i > INT_MAX ? INT_MAX : value->i < INT_MIN ? INT_MIN : (int)value->i;
+      header[1] = sizeof(int);
+      if (stream_write(st, header, sizeof(header)) != 0 || stream_write(st, &i, sizeof(int)) != 0)
+        return -1;
+      break;
+    }
+    case JSONSTREAM_BOOLEAN: {
+      short b = value->b;
+      header[1] = sizeof(short);
+      if (stream_write(st, header, sizeof(header)) != 0 || stream_write(st, &b, sizeof(short)) != 0)
+        return -1;
+      break;
+    }
+    case JSONSTREAM_STRING: {
+      // Like tlv_box_put_string, keep the string up to its first NUL.
+      if (value->nul >= INT_MAX)
+        return -1;
+      header[1] = (int)value->nul + 1;
+      if (stream_write(st, header, sizeof(header)) != 0)
+        return -1;
+      if (value->spill == NULL) {
+        if (stream_write(st, value->s, value->nul + 1) != 0)
+          return -1;
+        break;
+      }
+      for (size_t left = value->nul; left > 0;) {
+        size_t n = fread(st->copy, 1, left < sizeof(st->copy) ? left : sizeof(st->copy), value->spill);
+        if (n == 0 || stream_write(st, st->copy, n) != 0)
+          return -1;
+        left -= n;
+      }
+      if (stream_write(st, "", 1) != 0)
+        return -1;
+      break;
+    }
+    default:
+      printf("unknown data type!");
+      break;
+  }
+  return 0;
+}
+
+static bool stream_key(void* ctx, const char* key) {
+  stream_state* st = ctx;
+  return st->conv->keys == NULL || projection_keeps(st->conv->keys, key);
+}
+
+// Drop what a malformed record wrote, including the tags its keys took,
+// as if json-c had rejected the whole line.
+static int stream_record_error(void* ctx) {
+  stream_state* st = ctx;
+  if (fseek(st->output_stream, st->record_start, SEEK_SET) != 0)
+    return -1;
+  if (st->conv->counter == st->record_counter)
+    return 0;
+
+  size_t n = 0, added = st->conv->counter - st->record_counter;
+  const char** keys = malloc(added * sizeof(char*));
+  if (keys == NULL)
+    return -1;
+  hashtablei it = hashtable_iterator(st->conv->key_hashtable);
+  while (hashtable_next(&it)) {
+    if (*(int*)it.value >= (int)st->record_counter)
+      keys[n++] = it.key;
+  }
+  for (size_t i = 0; i < n; i++)
+    free(hashtable_remove(st->conv->key_hashtable, keys[i]));
+  free(keys);
+  st->conv->counter = st->record_counter;
+  return 0;
+}
+
+// Convert file_stream with bounded memory: at most cap bytes of any value
+// are held, longer strings are spilled to disk; keys are held whole. Fields are written
+// in the order they appear rather than tlv_box's reverse order; readers
+// that parse records into boxes see the same records. A record giving a
+// key twice is dropped as malformed, where json-c keeps the last value.
+static int convert_streaming(FILE* file_stream, FILE* output_stream,
+                             converter* conv, size_t cap) {
+  static const jsonstream_handler handler = {
+    stream_record_begin, stream_field, NULL, stream_record_error, stream_key,
+  };
+  stream_state* st = calloc(1, sizeof(stream_state));
+  char* input = malloc(STREAM_READ_SIZE);
+  jsonstream* js = jsonstream_create(&handler, st, cap);
+  int result = -1;
+  if (st == NULL || input == NULL || js == NULL)
+    goto done;
+  st->output_stream = output_stream;
+  st->conv = conv;
+
+  size_t n;
+  result = 0;
+  while (result == 0 && (n = fread(input, 1, STREAM_READ_SIZE, file_stream)) > 0)
+    result = jsonstream_feed(js, input, n);
+  if (result == 0 && ferror(file_stream))
+    result = -1;
+  if (result == 0)
+    result = jsonstream_finish(js);
+
+  // A rolled-back record at the end leaves bytes past the write position.
+  if (result == 0 && (fflush(output_stream) != 0 ||
+      ftruncate(fileno(output_stream), ftell(output_stream)) != 0))
+    result = -1;
+
+done:
+  if (js != NULL)
+    jsonstream_destroy(js);
+  free(input);
+  if (st != NULL)
+    free(st->written);
+  free(st);
+  return result;
+}
 
 
 int main(int argc, char **argv){
   // Initialize required variables
   FILE *file_stream, *output_stream;
-
-  struct json_object *parsed_json;
-  enum json_type type;
+  converter conv;
 
   char * line = NULL;
-  size_t len = 0, counter=1;
-  
-  // A hashtable to store the key-value pair of the json objects
-  hashtable* key_hashtable = hashtable_create();
+  size_t len = 0;
+  size_t samples = DEFAULT_SCHEMA_SAMPLES, block_size = 0;
+  size_t sync_bytes = DURABLE_DEFAULT_SYNC_BYTES, stream_cap = 0;
+  long sync_ms = -1;
+  bool pipelined = false, overlapped = false, mapped = false;
+  bool direct = false;
+  long threads = -1;
+  const char* input_path = "test.json";
+  const char* include_keys = NULL;
+  const char* exclude_keys = NULL;
+  size_t shard_count = 0;
+  long checkpoint_seconds = 0;
+  const char* shard_key = NULL;
+  const char* listen_path = NULL;
+  bool following = false, timing = false, counting = false;
+  size_t flush_records = 1;
+  long flush_ms = FOLLOW_DEFAULT_FLUSH_MS;
+  char* end;
+  int opt;
+
+  // -s N: sample N records for the fixed-layout fast path (0 disables it)
+  // -b N: write records in checksummed blocks of about N bytes
+  // -d MS[:BYTES]: durable blocks, synced every MS milliseconds or BYTES bytes
+  // -m CAP: stream records with at most CAP bytes of any value in memory
+  // -p: read, encode and write on separate threads
+  // -j N: like -p, encoding on N work-stealing threads (0: one per CPU)
+  // -a: read ahead and write behind on I/O threads or io_uring
+  // -w: write output through a memory-mapped window of a preallocated file
+  // -O: write output with O_DIRECT, bypassing the page cache
+  // -k K1,K2: convert only these keys; a.b flattens a nested field
+  // -x K1,K2: convert every key but these
+  // -S N[:KEY]: write N shards and a manifest, by runs of records or KEY's value
+  // -c S: checkpoint every S seconds (0: default), resuming from the last checkpoint
+  // -f N[:MS]: follow the input as it grows, flushing every N records or MS milliseconds
+  // -l PATH: serve conversions on a Unix domain socket instead
+  // -H: report latency percentiles at exit, and on SIGUSR1 while writing records
+  // -P: count cycles, instructions, cache and branch misses of each stage
+  // -T F: write a timeline of every thread's stages to F, in Chrome trace-event format
+  // -V F: verify the checksummed blocks of F and exit
+  while ((opt = getopt(argc, argv, "s:b:d:m:pj:awOk:x:S:c:f:l:HPT:V:")) != -1) {
+    switch (opt) {
+      case 's':
+        samples = strtoul(optarg, NULL, 10);
+        break;
+      case 'b':
+        block_size = strtoul(optarg, NULL, 10);
+        break;
+      case 'd':
+        sync_ms = strtol(optarg, &end, 10);
+        if (*end == ':')
+          sync_bytes = strtoul(end + 1, NULL, 10);
+        break;
+      case 'm':
+        stream_cap = strtoul(optarg, NULL, 10);
+        break;
+      case 'p':
+        pipelined = true;
+        break;
+      case 'j':
+        threads = strtol(optarg, NULL, 10);
+        pipelined = threads >= 0;
+        break;
+      case 'a':
+        overlapped = true;
+        break;
+      case 'w':
+        mapped = true;
+        break;
+      case 'O':
+        direct = true;
+        break;
+      case 'k':
+        include_keys = optarg;
+        break;
+      case 'x':
+        exclude_keys = optarg;
+        break;
+      case 'c':
+        checkpoint_seconds = strtol(optarg, NULL, 10);
+        if (checkpoint_seconds <= 0)
+          checkpoint_seconds = CHECKPOINT_DEFAULT_SECONDS;
+        break;
+      case 'f':
+        following = true;
+        flush_records = strtoul(optarg, &end, 10);
+        if (*end == ':')
+          flush_ms = strtol(end + 1, NULL, 10);
+        break;
+      case 'l':
+        listen_path = optarg;
+        break;
+      case 'H':
+        timing = true;
+        break;
+      case 'P':
+        counting = true;
+        break;
+      case 'T':
+        trace_path = optarg;
+        break;
+      case 'S':
+        shard_count = strtoul(optarg, &end, 10);
+        if (*end == ':')
+          shard_key = end + 1;
+        break;
+      case 'V':
+        exit(verify_blocks(optarg) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+      default:
+        fprintf(stderr, "usage: %s [-s samples] [-b block_size] [-d sync_ms[:sync_bytes]] [-m cap] [-p] [-j threads] [-a] [-w] [-O] [-k keys | -x keys] [-S shards[:key]] [-c seconds] [-f records[:ms]] [-l socket] [-H] [-P] [-T trace] [-V file] [input]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+  // The input may be gzip or zstd compressed
+  if (optind < argc)
+    input_path = argv[optind];
+
+  // The converter's hashtable maps each json key to its tag
+  if (!converter_init(&conv))
+      exit(EXIT_FAILURE);
+
+  // Threads record spans from here on, and the trace is written at exit
+  if (trace_path != NULL) {
+    trace_start();
+    trace_thread("main");
+    atexit(write_trace);
+  }
+
+  // Latencies are reported at exit, whether the conversion succeeds or not
+  if (timing) {
+    struct sigaction action = { .sa_handler = request_report, .sa_flags = SA_RESTART };
+    sigemptyset(&action.sa_mask);
+    latencies[0] = histogram_create("record");
+    latencies[1] = histogram_create("lookup");
+    latencies[2] = histogram_create("write");
+    if (latencies[0] == NULL || latencies[1] == NULL || latencies[2] == NULL ||
+        sigaction(SIGUSR1, &action, NULL) != 0)
+      exit(EXIT_FAILURE);
+    conv.record_latency = latencies[0];
+    conv.lookup_latency = latencies[1];
+    atexit(report_latencies);
+  }
+
+  // Dropped keys are skipped before parsing and never get a tag
+  projection* keys = NULL;
+  if (include_keys != NULL && exclude_keys != NULL) {
+    fprintf(stderr, "-k can't be combined with -x\n");
+    exit(EXIT_FAILURE);
+  }
+  if (include_keys != NULL || exclude_keys != NULL) {
+    keys = projection_create(include_keys != NULL);
+    if (keys == NULL || !projection_add(keys, include_keys != NULL ? include_keys : exclude_keys)) {
+      fprintf(stderr, "bad key list\n");
+      exit(EXIT_FAILURE);
+    }
+    conv.keys = keys;
+  }
+
+  // The server converts what clients send with the dictionary they share
+  if (listen_path != NULL) {
+    if (stream_cap > 0 || block_size > 0 || sync_ms >= 0 || pipelined || overlapped || mapped ||
+        direct || shard_count > 0 || checkpoint_seconds > 0 || following || counting) {
+      fprintf(stderr, "-l can't be combined with -m, -b, -d, -p, -j, -a, -w, -O, -S, -c, -f or -P\n");
+      exit(EXIT_FAILURE);
+    }
+    server* srv = server_open(listen_path, &conv);
+    if (srv == NULL) {
+      perror(listen_path);
+      exit(EXIT_FAILURE);
+    }
+    catch_stop_signals();
+    int result = server_run(srv, &stop_requested);
+    server_close(srv);
+    if (result != 0) {
+      printf("server failed !\n");
+      return -1;
+    }
+    converter_free(&conv);
+    if (keys != NULL)
+      projection_destroy(keys);
+    exit(EXIT_SUCCESS);
+  }
+
+  // Counters are per thread: they follow the stages of the sequential loop
+  if (counting && (stream_cap > 0 || pipelined || following)) {
+    fprintf(stderr, "-P can't be combined with -m, -p, -j or -f\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Checkpoints track the sequential loop, writing to a plain output file
+  checkpoint resume = { 0, 0 };
+  bool resuming = false;
+  if (checkpoint_seconds > 0) {
+    if (stream_cap > 0 || sync_ms >= 0 || pipelined || overlapped || mapped || direct ||
+        shard_count > 0) {
+      fprintf(stderr, "-c can't be combined with -m, -d, -p, -j, -a, -w, -O or -S\n");
+      exit(EXIT_FAILURE);
+    }
+    int loaded = checkpoint_load(CHECKPOINT_PATH, input_path, &resume, &conv);
+    if (loaded < 0) {
+      fprintf(stderr, "%s: damaged, or made for another input\n", CHECKPOINT_PATH);
+      exit(EXIT_FAILURE);
+    }
+    resuming = loaded == 1;
+  }
+
+  // Following flushes the plain output stream as records come in; the
+  // followed file is read as plain text
+  follower* follow = NULL;
+  if (following) {
+    if (stream_cap > 0 || sync_ms >= 0 || pipelined || overlapped || mapped || direct ||
+        shard_count > 0 || checkpoint_seconds > 0) {
+      fprintf(stderr, "-f can't be combined with -m, -d, -p, -j, -a, -w, -O, -S or -c\n");
+      exit(EXIT_FAILURE);
+    }
+    follow = follow_open(input_path);
+    if (follow == NULL) {
+      perror(input_path);
+      exit(EXIT_FAILURE);
+    }
+  }
 
   // Open the json file stream, and a binary file to store the tlv encoding binary stream
-  file_stream = fopen("test.json", "r");
-  output_stream = fopen("binary_tlv_format.bin", "wb");
-    
-  if (file_stream == NULL)
+  file_stream = follow != NULL ? NULL : decompress_open(input_path);
+  if (file_stream == NULL && follow == NULL) {
+      perror(input_path);
+      exit(EXIT_FAILURE);
+  }
+
+  // Streaming mode writes fields as they complete, so records can't be
+  // framed into blocks, whose headers need each record's length up front
+  if (stream_cap > 0) {
+    if (block_size > 0 || sync_ms >= 0 || pipelined || overlapped || mapped || direct ||
+        shard_count > 0) {
+      fprintf(stderr, "-m can't be combined with -b, -d, -p, -j, -a, -w, -O or -S\n");
+      exit(EXIT_FAILURE);
+    }
+    // The streaming tokenizer doesn't look into nested values
+    if (keys != NULL && projection_nested(keys)) {
+      fprintf(stderr, "-m can't project nested keys\n");
+      exit(EXIT_FAILURE);
+    }
+    output_stream = fopen("binary_tlv_format.bin", "wb");
+    if (output_stream == NULL ||
+        convert_streaming(file_stream, output_stream, &conv, stream_cap) != 0) {
+      printf("streaming conversion failed !\n");
+      return -1;
+    }
+    converter_free(&conv);
+    if (keys != NULL)
+      projection_destroy(keys);
+    fclose(file_stream);
+    fclose(output_stream);
+    exit(EXIT_SUCCESS);
+  }
+
+  // Durable output syncs its own writes, which -a would reorder; -w and
+  // -O replace the output file altogether
+  if (overlapped && sync_ms >= 0) {
+    fprintf(stderr, "-a can't be combined with -d\n");
+    exit(EXIT_FAILURE);
+  }
+  if (mapped && (sync_ms >= 0 || overlapped)) {
+    fprintf(stderr, "-w can't be combined with -d or -a\n");
+    exit(EXIT_FAILURE);
+  }
+  if (direct && (sync_ms >= 0 || overlapped || mapped)) {
+    fprintf(stderr, "-O can't be combined with -d, -a or -w\n");
+    exit(EXIT_FAILURE);
+  }
+  if (shard_count > 0 && (sync_ms >= 0 || overlapped || mapped || direct)) {
+    fprintf(stderr, "-S can't be combined with -d, -a, -w or -O\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Durable output writes blocks straight to the file with group commit
+  durable_writer* durable = NULL;
+  block_writer* blocks = NULL;
+  aio_writer* aio = NULL;
+  mapped_writer* map = NULL;
+  direct_writer* direct_out = NULL;
+  shard_set* shards = NULL;
+  output_stream = NULL;
+  if (shard_count > 0) {
+    // The shard key is tagged up front so records can be routed by tag
+    int key_tag = 0;
+    if (shard_key != NULL) {
+      int* tag = converter_tag(&conv, shard_key);
+      if (tag == NULL)
+        exit(EXIT_FAILURE);
+      key_tag = *tag;
+    }
+    shards = shard_open("binary_tlv_format.bin", shard_count, block_size, key_tag);
+    if (shards == NULL) {
+      perror("binary_tlv_format.bin");
       exit(EXIT_FAILURE);
+    }
+  } else if (sync_ms >= 0) {
+    durable = durable_open("binary_tlv_format.bin", sync_bytes, sync_ms);
+    if (durable == NULL) {
+      perror("binary_tlv_format.bin");
+      exit(EXIT_FAILURE);
+    }
+    if (block_size == 0)
+      block_size = BLOCK_DEFAULT_SIZE;
+    blocks = block_writer_create(durable_write, durable, block_size);
+  } else if (mapped) {
+    map = mapped_open("binary_tlv_format.bin", MAPPED_DEFAULT_EXTENT);
+    if (map == NULL) {
+      perror("binary_tlv_format.bin");
+      exit(EXIT_FAILURE);
+    }
+    if (block_size > 0)
+      blocks = block_writer_create(mapped_write, map, block_size);
+  } else if (direct) {
+    direct_out = direct_open("binary_tlv_format.bin", DIRECT_DEFAULT_BUFFER);
+    if (direct_out == NULL) {
+      perror("binary_tlv_format.bin");
+      exit(EXIT_FAILURE);
+    }
+    if (block_size > 0)
+      blocks = block_writer_create(direct_write, direct_out, block_size);
+  } else {
+    // A resumed conversion drops what was written after its checkpoint
+    output_stream = fopen("binary_tlv_format.bin", resuming ? "r+b" : "wb");
+    if (output_stream == NULL ||
+        (resuming && (ftruncate(fileno(output_stream), resume.output_length) != 0 ||
+                      fseeko(output_stream, 0, SEEK_END) != 0))) {
+      perror("binary_tlv_format.bin");
+      exit(EXIT_FAILURE);
+    }
+    // Overlapped output bypasses the stdio stream, which stays empty
+    if (overlapped) {
+      aio = aio_writer_open(fileno(output_stream), 0, AIO_DEFAULT_BLOCK, AIO_DEFAULT_DEPTH);
+      if (aio == NULL)
+        exit(EXIT_FAILURE);
+    }
+    if (block_size > 0)
+      blocks = aio != NULL ? block_writer_create(aio_writer_write, aio, block_size)
+                           : block_writer_create(write_stream, output_stream, block_size);
+  }
+  output out = {
+    .stream = output_stream, .blocks = blocks, .durable = durable, .aio = aio, .mapped = map,
+    .direct = direct_out, .shards = shards, .write_latency = latencies[2], .writes = 0,
+  };
 
-  // Streaming each record from the json file
-  while (getline(&line, &len, file_stream) != -1) {
-    tlv_box_t *val_box = tlv_box_create();   
+  // Records matching the inferred schema skip the tlv_box round trip
+  if (samples > 0 && file_stream != NULL)
+    converter_infer_schema(&conv, file_stream, samples);
 
-    parsed_json = json_tokener_parse(line);
-    
-		json_object_object_foreach(parsed_json, key, val) {
+  if (follow != NULL) {
+    int result = convert_following(follow, &out, &conv, flush_records, flush_ms);
+    follow_close(follow);
+    if (result != 0) {
+      printf("follow failed !\n");
+      return -1;
+    }
+  } else if (pipelined) {
+    int result = threads >= 0
+        ? pipeline_convert_parallel(file_stream, &conv, threads, write_record, &out)
+        : pipeline_convert(file_stream, &conv, write_record, &out);
+    if (result != 0) {
+      printf("pipelined conversion failed !\n");
+      return -1;
+    }
+  } else {
+    unsigned char* record = NULL;
+    size_t record_capacity = 0;
+    aio_reader* reader = NULL;
+    uint64_t input_offset = resume.input_offset;
+    size_t lines = 0;
+    struct timespec last_checkpoint;
+    clock_gettime(CLOCK_MONOTONIC, &last_checkpoint);
 
-      void* value = hashtable_get(key_hashtable, key);
-      if (value == NULL) {
-        int* new_num = malloc(sizeof(int));
-        *new_num = counter;
+    if (resuming && skip_input(file_stream, input_offset) != 0) {
+      printf("resume failed !\n");
+      return -1;
+    }
 
-        hashtable_set(key_hashtable, key, new_num);
-        value = new_num;
-        counter++;
+    // Overlapped input picks up where schema inference left the stream,
+    // read again from the file: a pipe's first chunk is already in stdio's
+    // buffer, so pipes keep to getline. Compressed input is already read
+    // ahead by its decompression thread
+    if (overlapped && fileno(file_stream) >= 0 && lseek(fileno(file_stream), 0, SEEK_CUR) >= 0) {
+      reader = aio_reader_open(fileno(file_stream), ftell(file_stream),
+                               AIO_DEFAULT_BLOCK, AIO_DEFAULT_DEPTH);
+      if (reader == NULL)
+        exit(EXIT_FAILURE);
+    }
+
+    // Each lap charges what was counted since the previous one to a stage
+    perf_group* perf = counting ? perf_open() : NULL;
+    perf_stage stages[] = { { .name = "read" }, { .name = "encode" }, { .name = "write" } };
+    uint64_t input_bytes = 0, input_lines = 0;
+
+    // Streaming each record from the json file
+    ssize_t n;
+    while ((n = read_line(reader, file_stream, &line, &len)) != -1) {
+      if (perf != NULL) {
+        perf_lap(perf, &stages[0]);
+        input_bytes += n;
+        input_lines++;
+      }
+      // Checkpoint the lines before this one, once the interval is up
+      if (checkpoint_seconds > 0 && ++lines % CHECKPOINT_CHECK_LINES == 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec - last_checkpoint.tv_sec >= checkpoint_seconds) {
+          if (save_checkpoint(&out, input_offset, &conv, input_path) != 0) {
+            printf("checkpoint failed !\n");
+            return -1;
+          }
+          last_checkpoint = now;
+        }
+      }
+      input_offset += n;
+      int size = converter_encode_line(&conv, line, &record, &record_capacity);
+      if (perf != NULL)
+        perf_lap(perf, &stages[1]);
+      if (size == CONVERT_SKIPPED)
+        continue;
+      if (size < 0) {
+          printf("encode failed !\n");
+          return -1;
       }
-      
-			type = json_object_get_type(val);
-      int* tag = (int*) value;
-      
-			switch (type) {
-  			case json_type_int: 
-          tlv_box_put_int(val_box, *tag, (int)json_object_get_int(val));
-  				break;
-  			case json_type_boolean: 
-          tlv_box_put_short(val_box, *tag, (short)json_object_get_boolean(val));
-  				break;
-  			case json_type_string: 
-          tlv_box_put_string(val_box, *tag, (char*)json_object_get_string(val)); 
-  				break;
-        default:
-          printf("unknown data type!");
-          break;
+      uint64_t start = trace_begin();
+      int written = write_record(&out, record, size);
+      trace_end("write", start);
+      if (written != 0) {
+          printf("write failed !\n");
+          return -1;
       }
+      if (perf != NULL)
+        perf_lap(perf, &stages[2]);
     }
-    if (tlv_box_serialize(val_box) != 0) {
-        printf("boxes serialize failed !\n"); 
+    if (perf != NULL) {
+      perf_lap(perf, &stages[0]);
+      perf_report(perf, stages, sizeof(stages) / sizeof(stages[0]), input_lines, input_bytes, stderr);
+      perf_close(perf);
+    }
+    free(record);
+    if (reader != NULL)
+      aio_reader_close(reader);
+    // A corrupt compressed input ends in a read error, not end of file
+    if (ferror(file_stream)) {
+        printf("read failed !\n");
         return -1;
     }
-
-    tlv_box_t *val_parsedBox = tlv_box_parse(tlv_box_get_buffer(val_box), tlv_box_get_size(val_box));
-    unsigned char* val_binary = tlv_box_get_buffer(val_parsedBox);
-    
-    fwrite(val_binary, 1, tlv_box_get_size(val_parsedBox), output_stream);
-
-    tlv_box_destroy(val_box);
-    tlv_box_destroy(val_parsedBox);
   }
   if (line)
       free(line);
 
-  
-  hashtable_destroy(key_hashtable);
-  fclose(file_stream);
-  fclose(output_stream);
+  if (blocks != NULL) {
+      if (block_writer_flush(blocks) != 0) {
+          printf("write failed !\n");
+          return -1;
+      }
+      block_writer_destroy(blocks);
+  }
+  if (shards != NULL && shard_close(shards, &conv, shard_key) != 0) {
+      printf("write failed !\n");
+      return -1;
+  }
+  if (direct_out != NULL && direct_close(direct_out) != 0) {
+      printf("write failed !\n");
+      return -1;
+  }
+  if (map != NULL && mapped_close(map) != 0) {
+      printf("write failed !\n");
+      return -1;
+  }
+  if (aio != NULL && aio_writer_close(aio) != 0) {
+      printf("write failed !\n");
+      return -1;
+  }
+  if (durable != NULL && durable_close(durable) != 0) {
+      printf("write failed !\n");
+      return -1;
+  }
+  converter_free(&conv);
+  if (keys != NULL)
+    projection_destroy(keys);
+  if (file_stream != NULL)
+    fclose(file_stream);
+  if (output_stream != NULL && fclose(output_stream) != 0) {
+      printf("write failed !\n");
+      return -1;
+  }
+
+  // The conversion is complete: there's nothing left to resume
+  if (checkpoint_seconds > 0 && unlink(CHECKPOINT_PATH) != 0 && errno != ENOENT) {
+      perror(CHECKPOINT_PATH);
+      return -1;
+  }
 
   exit(EXIT_SUCCESS);
-}
\ No newline at end of file
+}
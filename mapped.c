@@ -0,0 +1,139 @@
+#define _GNU_SOURCE // fallocate
+
+#include "mapped.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Mapped writer structure: open with mapped_open, finish with mapped_close.
+struct mapped_writer {
+    int fd;
+    size_t extent;          // allocation and mapping unit, whole pages
+    size_t page;
+    uint64_t length;        // bytes committed
+    uint64_t allocated;     // file size reserved on disk
+    unsigned char* window;  // mapping of [window_offset, window_offset + window_size)
+    uint64_t window_offset;
+    size_t window_size;
+    bool failed;
+};
+
+static size_t round_up(size_t n, size_t unit) {
+    return (n + unit - 1) / unit * unit;
+}
+
+// Make the file at least size bytes long, in whole extents. Reserve the
+// blocks where the filesystem can, so a full disk shows up here rather
+// than as SIGBUS on a store into the window.
+static int allocate(mapped_writer* writer, uint64_t size) {
+    if (size <= writer->allocated) {
+        return 0;
+    }
+    uint64_t target = round_up(size, writer->extent);
+    int result = fallocate(writer->fd, 0, writer->allocated, target - writer->allocated);
+    if (result != 0 && (errno == EOPNOTSUPP || errno == ENOSYS)) {
+        result = ftruncate(writer->fd, target);
+    }
+    if (result != 0) {
+        return -1;
+    }
+    writer->allocated = target;
+    return 0;
+}
+
+// Map a window covering [length, length + size).
+static int slide(mapped_writer* writer, size_t size) {
+    uint64_t offset = writer->length / writer->page * writer->page;
+    size_t window_size = round_up(writer->length - offset + size, writer->extent);
+    if (allocate(writer, offset + window_size) != 0) {
+        return -1;
+    }
+    if (writer->window != NULL) {
+        munmap(writer->window, writer->window_size);
+        writer->window = NULL;
+    }
+    void* window = mmap(NULL, window_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        writer->fd, (off_t)offset);
+    if (window == MAP_FAILED) {
+        return -1;
+    }
+    madvise(window, window_size, MADV_SEQUENTIAL);
+    writer->window = window;
+    writer->window_offset = offset;
+    writer->window_size = window_size;
+    return 0;
+}
+
+mapped_writer* mapped_open(const char* path, size_t extent) {
+    mapped_writer* writer = malloc(sizeof(mapped_writer));
+    if (writer == NULL) {
+        return NULL;
+    }
+    // Shared writable mappings need the file open for reading too.
+    writer->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (writer->fd < 0) {
+        free(writer);
+        return NULL;
+    }
+    writer->page = sysconf(_SC_PAGESIZE);
+    writer->extent = round_up(extent > 0 ? extent : MAPPED_DEFAULT_EXTENT, writer->page);
+    writer->length = 0;
+    writer->allocated = 0;
+    writer->window = NULL;
+    writer->window_offset = 0;
+    writer->window_size = 0;
+    writer->failed = false;
+    return writer;
+}
+
+unsigned char* mapped_reserve(mapped_writer* writer, size_t size) {
+    if (writer->failed) {
+        return NULL;
+    }
+    if (writer->window == NULL ||
+        writer->length + size > writer->window_offset + writer->window_size) {
+        if (slide(writer, size) != 0) {
+            writer->failed = true;
+            return NULL;
+        }
+    }
+    return writer->window + (writer->length - writer->window_offset);
+}
+
+void mapped_commit(mapped_writer* writer, size_t size) {
+    writer->length += size;
+}
+
+int mapped_write(void* ctx, const void* data, size_t size) {
+    mapped_writer* writer = ctx;
+    unsigned char* p = mapped_reserve(writer, size);
+    if (p == NULL) {
+        return -1;
+    }
+    if (size > 0) {
+        memcpy(p, data, size);
+    }
+    mapped_commit(writer, size);
+    return 0;
+}
+
+int mapped_close(mapped_writer* writer) {
+    int result = writer->failed ? -1 : 0;
+    if (writer->window != NULL && munmap(writer->window, writer->window_size) != 0) {
+        result = -1;
+    }
+    if (ftruncate(writer->fd, writer->length) != 0) {
+        result = -1;
+    }
+    if (close(writer->fd) != 0) {
+        result = -1;
+    }
+    free(writer);
+    return result;
+}
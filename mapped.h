@@ -0,0 +1,40 @@
+// Memory-mapped output file.
+//
+// The file is preallocated in large extents and written through a window
+// mapped over its end, so records are stored with a plain memory copy (or
+// encoded in place) rather than going through stdio and write(2). The
+// window slides forward as the file grows; on close the file is cut back
+// to the bytes actually written.
+
+#ifndef _mapped_H
+#define _mapped_H
+
+#include <stddef.h>
+
+#define MAPPED_DEFAULT_EXTENT (64 << 20)
+
+// Mapped writer: open with mapped_open, finish with mapped_close.
+typedef struct mapped_writer mapped_writer;
+
+// Create (or truncate) path for mapped writing, allocating and mapping it
+// extent bytes at a time (rounded up to whole pages). Return NULL on error
+// (errno set).
+mapped_writer* mapped_open(const char* path, size_t extent);
+
+// Return room for at least size bytes at the end of the file, valid until
+// the next call on writer, or NULL on error. Nothing is written until
+// mapped_commit.
+unsigned char* mapped_reserve(mapped_writer* writer, size_t size);
+
+// Append the first size bytes of the last reservation to the file.
+void mapped_commit(mapped_writer* writer, size_t size);
+
+// block_sink and pipeline_sink appending size bytes to the mapped writer
+// passed as ctx. Return 0 on success, -1 on error.
+int mapped_write(void* ctx, const void* data, size_t size);
+
+// Unmap, truncate the file to what was written, close it and free the
+// writer. Return 0 on success, -1 on error.
+int mapped_close(mapped_writer* writer);
+
+#endif // _mapped_H
@@ -0,0 +1,179 @@
+#include "perfcount.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/perf_event.h>)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#define HAVE_PERF_EVENTS 1
+#endif
+
+static const char* const event_names[PERF_EVENTS] = {
+    "cycles", "instructions", "cache misses", "branch misses", "task clock ns",
+};
+
+// One read of the group: raw counts and how long it was enabled and
+// actually on the PMU, both cumulative.
+typedef struct {
+    uint64_t enabled;
+    uint64_t running;
+    uint64_t values[PERF_EVENTS];
+} perf_sample;
+
+struct perf_group {
+    int leader;                 // group fd, or -1 if nothing is counted
+    int fds[PERF_EVENTS];       // -1 for events not counted
+    int slot[PERF_EVENTS];      // position in a group read, or -1
+    int error[PERF_EVENTS];     // errno of the events not counted
+    size_t members;
+    perf_sample last;
+};
+
+#ifdef HAVE_PERF_EVENTS
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} events[PERF_EVENTS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+};
+
+// Read the group's raw counts. Return false if they can't be read.
+static bool read_sample(perf_group* g, perf_sample* sample) {
+    uint64_t data[3 + PERF_EVENTS];  // nr, time enabled, time running, values
+    ssize_t n = read(g->leader, data, sizeof(data));
+    if (n < (ssize_t)(3 * sizeof(uint64_t)) || data[0] != g->members) {
+        return false;
+    }
+    sample->enabled = data[1];
+    sample->running = data[2];
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        sample->values[e] = g->slot[e] >= 0 ? data[3 + g->slot[e]] : 0;
+    }
+    return true;
+}
+#endif
+
+perf_group* perf_open(void) {
+    perf_group* g = calloc(1, sizeof(perf_group));
+    if (g == NULL) {
+        return NULL;
+    }
+    g->leader = -1;
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        g->fds[e] = -1;
+        g->slot[e] = -1;
+        g->error[e] = ENOSYS;
+    }
+#ifdef HAVE_PERF_EVENTS
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[e].type;
+        attr.config = events[e].config;
+        attr.disabled = g->leader < 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+        int fd = syscall(SYS_perf_event_open, &attr, 0, -1, g->leader, PERF_FLAG_FD_CLOEXEC);
+        if (fd < 0) {
+            g->error[e] = errno;
+            continue;
+        }
+        if (g->leader < 0) {
+            g->leader = fd;
+        }
+        g->fds[e] = fd;
+        g->slot[e] = (int)g->members++;
+    }
+    if (g->leader >= 0 &&
+        (ioctl(g->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) != 0 ||
+         !read_sample(g, &g->last))) {
+        // Opened but unusable: count nothing rather than garbage.
+        int error = errno;
+        for (int e = 0; e < PERF_EVENTS; e++) {
+            if (g->fds[e] >= 0) {
+                close(g->fds[e]);
+                g->fds[e] = -1;
+                g->slot[e] = -1;
+                g->error[e] = error;
+            }
+        }
+        g->leader = -1;
+        g->members = 0;
+    }
+#endif
+    return g;
+}
+
+void perf_close(perf_group* g) {
+    // Members go before the leader.
+    for (int e = PERF_EVENTS - 1; e >= 0; e--) {
+        if (g->fds[e] >= 0) {
+            close(g->fds[e]);
+        }
+    }
+    free(g);
+}
+
+bool perf_available(const perf_group* g, int event) {
+    return g->fds[event] >= 0;
+}
+
+const char* perf_event_name(int event) {
+    return event_names[event];
+}
+
+void perf_lap(perf_group* g, perf_stage* stage) {
+#ifdef HAVE_PERF_EVENTS
+    perf_sample now;
+    if (g->leader < 0 || !read_sample(g, &now)) {
+        return;
+    }
+    // Scale the lap by the share of it the kernel kept the group on the
+    // PMU, so multiplexing in one lap doesn't skew another.
+    uint64_t enabled = now.enabled - g->last.enabled;
+    uint64_t running = now.running - g->last.running;
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        uint64_t delta = now.values[e] - g->last.values[e];
+        if (running > 0 && running < enabled) {
+            delta = (uint64_t)((double)delta * enabled / running);
+        }
+        stage->counts[e] += delta;
+    }
+    g->last = now;
+#endif
+}
+
+void perf_report(const perf_group* g, const perf_stage* stages, size_t count,
+                 uint64_t records, uint64_t bytes, FILE* out) {
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        if (!perf_available(g, e)) {
+            fprintf(out, "perf: %s not counted: %s\n", event_names[e], strerror(g->error[e]));
+        }
+    }
+    if (g->leader < 0) {
+        return;
+    }
+    fprintf(out, "%-8s %-14s %14s %14s %12s\n", "stage", "event", "total", "per record", "per byte");
+    for (size_t s = 0; s < count; s++) {
+        for (int e = 0; e < PERF_EVENTS; e++) {
+            if (!perf_available(g, e)) {
+                continue;
+            }
+            uint64_t n = stages[s].counts[e];
+            fprintf(out, "%-8s %-14s %14llu %14.2f %12.3f\n", stages[s].name, event_names[e],
+                    (unsigned long long)n, records > 0 ? (double)n / records : 0.0,
+                    bytes > 0 ? (double)n / bytes : 0.0);
+        }
+    }
+}
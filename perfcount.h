@@ -0,0 +1,60 @@
+// Hardware performance counters through perf_event_open.
+//
+// A counter group counts cycles, instructions, cache misses and branch
+// misses, plus the task clock, for the thread that opened it, in user
+// space only. Counts are attributed to stages by taking laps: each lap
+// adds what was counted since the previous one to a stage. A lap is one
+// read(2), which the task clock sees but the user-space hardware counts
+// mostly don't.
+//
+// Events the kernel or the machine doesn't offer (no PMU in a VM,
+// perf_event_paranoid, seccomp) are left out and reported as unavailable;
+// with none at all, laps and reports still work and just have nothing to
+// show. Nothing here ever fails the conversion.
+
+#ifndef _perfcount_H
+#define _perfcount_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_TASK_CLOCK,    // nanoseconds
+    PERF_EVENTS
+};
+
+// Counter group: open with perf_open, free with perf_close.
+typedef struct perf_group perf_group;
+
+// Counts of one stage.
+typedef struct {
+    const char* name;
+    uint64_t counts[PERF_EVENTS];
+} perf_stage;
+
+// Start counting for the calling thread. Return NULL only if out of memory.
+perf_group* perf_open(void);
+
+// Stop counting and free g.
+void perf_close(perf_group* g);
+
+// Return true if event is being counted.
+bool perf_available(const perf_group* g, int event);
+
+// Return the name of event, as reported.
+const char* perf_event_name(int event);
+
+// Add what was counted since the previous lap (or perf_open) to stage.
+void perf_lap(perf_group* g, perf_stage* stage);
+
+// Write the counts of stages, per record and per byte, with a note of the
+// events that couldn't be counted and why.
+void perf_report(const perf_group* g, const perf_stage* stages, size_t count,
+                 uint64_t records, uint64_t bytes, FILE* out);
+
+#endif // _perfcount_H
@@ -0,0 +1,553 @@
+#define _GNU_SOURCE  // memrchr
+#include "pipeline.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+#include "trace.h"
+#include "worksteal.h"
+
+#define RING_BURST 4            // batches moved per ring operation
+#define SPLIT_MIN (16 * 1024)   // lines left in a segment worth splitting
+
+typedef struct pipeline pipeline;
+typedef struct batch batch;
+
+// Encoded records, back to back, with the size of each.
+typedef struct {
+    unsigned char* data;
+    size_t size;
+    size_t capacity;
+    size_t* records;
+    size_t count;
+    size_t records_capacity;
+} record_buffer;
+
+// Run of lines of a batch, encoded by one task. In parallel mode, tags are
+// local to the segment until the writer resolves them.
+typedef struct segment {
+    ws_task task;            // must be first
+    struct segment* next;    // following lines of the batch
+    batch* owner;
+    char* start;
+    char* end;
+    record_buffer encoded;
+    convert_keys keys;
+} segment;
+
+// A batch of input lines and, once encoded, their records.
+struct batch {
+    char* text;              // whole lines; always one spare byte past them
+    size_t size;             // bytes of whole lines in text
+    size_t capacity;
+    segment root;            // all lines, until split in parallel mode
+    _Atomic size_t pending;  // segments still being encoded
+    pipeline* p;
+};
+
+struct pipeline {
+    FILE* in;
+    converter* conv;
+    pipeline_sink sink;
+    void* ctx;
+    ws_pool* workers;        // parallel mode, or NULL to encode on the calling thread
+    batch* batches;
+    mpmc_ring* pool;         // empty batches, for the reader
+    spsc_ring* to_encode;    // filled batches, reader to encoder
+    spsc_ring* to_write;     // batches in input order, to the writer
+    ring_event encoded;      // notified when a batch's last segment is done
+    _Atomic bool failed;
+};
+
+// Stop every stage: closed rings make waiting stages return.
+static void pipeline_fail(pipeline* p) {
+    atomic_store(&p->failed, true);
+    mpmc_ring_close(p->pool);
+    spsc_ring_close(p->to_encode);
+    spsc_ring_close(p->to_write);
+}
+
+static bool batch_reserve(batch* b, size_t capacity) {
+    if (capacity <= b->capacity) {
+        return true;
+    }
+    char* text = realloc(b->text, capacity);
+    if (text == NULL) {
+        return false;
+    }
+    b->text = text;
+    b->capacity = capacity;
+    return true;
+}
+
+// Take an empty batch from the pool, waiting for the writer to return one.
+static batch* take_batch(pipeline* p) {
+    void* item;
+    uint64_t start = trace_begin();
+    size_t n = mpmc_ring_pop_wait(p->pool, &item, 1);
+    trace_end("wait", start);
+    return n > 0 ? item : NULL;
+}
+
+// Reader stage: fill batches with whole lines. The partial line at the end
+// of a batch moves to the start of the next one; a line longer than a
+// batch grows it.
+static void* read_stage(void* arg) {
+    pipeline* p = arg;
+    trace_thread("reader");
+    batch* b = take_batch(p);
+    size_t filled = 0;
+
+    while (b != NULL) {
+        // Keep one byte spare to NUL-terminate a last line without newline.
+        uint64_t start = trace_begin();
+        size_t n = fread(b->text + filled, 1, b->capacity - 1 - filled, p->in);
+        trace_end("read", start);
+        filled += n;
+        bool eof = filled < b->capacity - 1;
+        if (eof && ferror(p->in)) {
+            pipeline_fail(p);
+            break;
+        }
+
+        char* newline = eof ? NULL : memrchr(b->text, '\n', filled);
+        if (!eof && newline == NULL) {
+            if (!batch_reserve(b, b->capacity * 2)) {
+                pipeline_fail(p);
+                break;
+            }
+            continue;
+        }
+        b->size = eof ? filled : (size_t)(newline + 1 - b->text);
+
+        if (eof) {
+            void* item = b;
+            if (b->size == 0) {
+                mpmc_ring_push(p->pool, &item, 1);
+            } else {
+                spsc_ring_push_wait(p->to_encode, &item, 1);
+            }
+            break;
+        }
+
+        batch* next = take_batch(p);
+        filled -= b->size;
+        if (next == NULL || !batch_reserve(next, filled + 1)) {
+            pipeline_fail(p);
+            break;
+        }
+        memcpy(next->text, b->text + b->size, filled);
+        void* item = b;
+        start = trace_begin();
+        bool pushed = spsc_ring_push_wait(p->to_encode, &item, 1);
+        trace_end("wait", start);
+        if (!pushed) {
+            break;
+        }
+        b = next;
+    }
+    spsc_ring_close(p->to_encode);
+    return NULL;
+}
+
+// Make room for size more bytes and one more record.
+static bool record_buffer_reserve(record_buffer* rb, size_t size) {
+    if (rb->size + size > rb->capacity) {
+        size_t capacity = rb->capacity > 0 ? rb->capacity : size;
+        while (capacity < rb->size + size) {
+            capacity *= 2;
+        }
+        unsigned char* data = realloc(rb->data, capacity);
+        if (data == NULL) {
+            return false;
+        }
+        rb->data = data;
+        rb->capacity = capacity;
+    }
+    if (rb->count == rb->records_capacity) {
+        size_t capacity = rb->records_capacity > 0 ? rb->records_capacity * 2 : 256;
+        size_t* records = realloc(rb->records, capacity * sizeof(size_t));
+        if (records == NULL) {
+            return false;
+        }
+        rb->records = records;
+        rb->records_capacity = capacity;
+    }
+    return true;
+}
+
+static void record_buffer_free(record_buffer* rb) {
+    free(rb->data);
+    free(rb->records);
+}
+
+// Encoder stage, for one batch: lines are NUL-terminated in place.
+static int encode_batch(pipeline* p, batch* b, unsigned char** scratch, size_t* capacity) {
+    uint64_t start = trace_begin();
+    record_buffer* rb = &b->root.encoded;
+    char* line = b->text;
+    char* end = b->text + b->size;
+    rb->size = 0;
+    rb->count = 0;
+    while (line < end) {
+        char* newline = memchr(line, '\n', end - line);
+        if (newline == NULL) {
+            newline = end;
+        }
+        *newline = '\0';
+        int size = converter_encode_line(p->conv, line, scratch, capacity);
+        line = newline + 1;
+        if (size == CONVERT_SKIPPED) {
+            continue;
+        }
+        if (size < 0 || !record_buffer_reserve(rb, size)) {
+            return -1;
+        }
+        if (size > 0) {
+            memcpy(rb->data + rb->size, *scratch, size);
+        }
+        rb->size += size;
+        rb->records[rb->count++] = size;
+    }
+    trace_end("batch", start);
+    return 0;
+}
+
+static void encode_segment(ws_task* task, ws_worker* worker);
+
+// Count the time since start in the converter's record latency, if kept.
+static void record_latency(pipeline* p, uint64_t start) {
+    if (p->conv->record_latency != NULL) {
+        histogram_record(p->conv->record_latency, histogram_now() - start);
+    }
+}
+
+// Hand the back half of seg's lines, from line on, to a new segment that
+// another worker can steal. The halves split at a line boundary near the
+// middle, or before the last line if that's longer than half.
+static void split_segment(segment* seg, char* line, ws_worker* worker) {
+    char* middle = line + (seg->end - line) / 2;
+    char* newline = memchr(middle, '\n', seg->end - middle);
+    if (newline == NULL || newline + 1 >= seg->end) {
+        newline = memrchr(line, '\n', middle - line);
+        if (newline == NULL) {
+            return;
+        }
+    }
+    segment* tail = calloc(1, sizeof(segment));
+    if (tail == NULL) {
+        return;
+    }
+    tail->task.run = encode_segment;
+    tail->owner = seg->owner;
+    tail->start = newline + 1;
+    tail->end = seg->end;
+    tail->next = seg->next;
+    convert_keys_init(&tail->keys);
+    seg->next = tail;
+    seg->end = newline + 1;
+
+    atomic_fetch_add(&seg->owner->pending, 1);
+    if (!ws_spawn(worker, &tail->task)) {
+        encode_segment(&tail->task, worker);
+    }
+}
+
+// Worker task in parallel mode: encode a segment with local tags,
+// splitting off work while other workers could use it.
+static void encode_segment(ws_task* task, ws_worker* worker) {
+    segment* seg = (segment*)task;
+    batch* b = seg->owner;
+    pipeline* p = b->p;
+    record_buffer* rb = &seg->encoded;
+    char* line = seg->start;
+    char* projected = NULL;
+    size_t projected_capacity = 0;
+    uint64_t segment_start = trace_begin();
+    while (line < seg->end && !atomic_load_explicit(&p->failed, memory_order_relaxed)) {
+        if ((size_t)(seg->end - line) > SPLIT_MIN && ws_wanted(worker)) {
+            split_segment(seg, line, worker);
+        }
+        char* newline = memchr(line, '\n', seg->end - line);
+        if (newline == NULL) {
+            newline = seg->end;
+        }
+        *newline = '\0';
+        const char* text = line;
+        line = newline + 1;
+        uint64_t start = p->conv->record_latency != NULL ? histogram_now() : 0;
+        uint64_t span = trace_begin();
+        struct json_object* parsed_json;
+        if (!projection_parse(p->conv->keys, text, &projected, &projected_capacity, &parsed_json)) {
+            pipeline_fail(p);
+            break;
+        }
+        trace_end("tokenize", span);
+        if (parsed_json == NULL) {
+            record_latency(p, start);
+            continue;
+        }
+        int size = -1;
+        span = trace_begin();
+        if (record_buffer_reserve(rb, 0)) {
+            size = convert_encode_local(&seg->keys, parsed_json, &rb->data, &rb->capacity, rb->size);
+        }
+        json_object_put(parsed_json);
+        trace_end("encode", span);
+        record_latency(p, start);
+        if (size == CONVERT_SKIPPED) {
+            continue;
+        }
+        if (size < 0) {
+            pipeline_fail(p);
+            break;
+        }
+        rb->size += size;
+        rb->records[rb->count++] = size;
+    }
+    free(projected);
+    trace_end("segment", segment_start);
+    if (atomic_fetch_sub(&b->pending, 1) == 1) {
+        ring_event_notify(&p->encoded);
+    }
+}
+
+// Pass the records of rb to the sink. Return 0 on success, -1 on error.
+static int write_records(pipeline* p, record_buffer* rb, const int* tags) {
+    uint64_t start = trace_begin();
+    unsigned char* record = rb->data;
+    for (size_t r = 0; r < rb->count; r++) {
+        if (tags != NULL) {
+            convert_retag(record, rb->records[r], tags);
+        }
+        if (p->sink(p->ctx, record, rb->records[r]) != 0) {
+            return -1;
+        }
+        record += rb->records[r];
+    }
+    trace_end("write", start);
+    return 0;
+}
+
+// Wait until every segment of b is encoded.
+static void wait_encoded(pipeline* p, batch* b) {
+    uint64_t start = trace_begin();
+    while (atomic_load(&b->pending) > 0) {
+        uint32_t seen = ring_event_prepare(&p->encoded);
+        if (atomic_load(&b->pending) == 0) {
+            ring_event_cancel(&p->encoded);
+            break;
+        }
+        ring_event_wait(&p->encoded, seen);
+    }
+    trace_end("wait", start);
+}
+
+// Write the segments of b in order, resolving their local tags with the
+// dictionary, then free the segments split off the root.
+static int commit_segments(pipeline* p, batch* b, int** tags, size_t* tags_capacity) {
+    int result = 0;
+    segment* seg = &b->root;
+    while (seg != NULL) {
+        if (result == 0 && !atomic_load(&p->failed)) {
+            if (seg->keys.count > *tags_capacity) {
+                int* grown = realloc(*tags, seg->keys.count * sizeof(int));
+                if (grown == NULL) {
+                    result = -1;
+                } else {
+                    *tags = grown;
+                    *tags_capacity = seg->keys.count;
+                }
+            }
+            uint64_t start = trace_begin();
+            if (result == 0 && !converter_resolve(p->conv, &seg->keys, *tags)) {
+                result = -1;
+            }
+            trace_end("dictionary", start);
+            if (result == 0 && write_records(p, &seg->encoded, *tags) != 0) {
+                result = -1;
+            }
+        }
+        segment* next = seg->next;
+        convert_keys_free(&seg->keys);
+        if (seg != &b->root) {
+            record_buffer_free(&seg->encoded);
+            free(seg);
+        }
+        seg = next;
+    }
+    b->root.next = NULL;
+    return result;
+}
+
+// Writer stage: pass records to the sink in input order and return
+// batches to the pool.
+static void* write_stage(void* arg) {
+    pipeline* p = arg;
+    void* items[RING_BURST];
+    int* tags = NULL;
+    size_t tags_capacity = 0;
+    size_t n;
+    trace_thread("writer");
+    uint64_t start = trace_begin();
+    while ((n = spsc_ring_pop_wait(p->to_write, items, RING_BURST)) > 0) {
+        trace_end("wait", start);
+        for (size_t i = 0; i < n; i++) {
+            batch* b = items[i];
+            int result;
+            if (p->workers != NULL) {
+                wait_encoded(p, b);
+                result = commit_segments(p, b, &tags, &tags_capacity);
+            } else {
+                result = atomic_load(&p->failed) ? 0 : write_records(p, &b->root.encoded, NULL);
+            }
+            if (result != 0) {
+                pipeline_fail(p);
+            }
+            // The pool holds every batch, so this never waits.
+            mpmc_ring_push(p->pool, &items[i], 1);
+        }
+        start = trace_begin();
+    }
+    free(tags);
+    return NULL;
+}
+
+// Encoder stage in parallel mode: queue each batch for the writer, in
+// order, and as a task for the workers.
+static void dispatch_batches(pipeline* p) {
+    void* items[RING_BURST];
+    size_t n;
+    uint64_t start = trace_begin();
+    while ((n = spsc_ring_pop_wait(p->to_encode, items, RING_BURST)) > 0) {
+        trace_end("wait", start);
+        for (size_t i = 0; i < n; i++) {
+            batch* b = items[i];
+            b->root.start = b->text;
+            b->root.end = b->text + b->size;
+            b->root.encoded.size = 0;
+            b->root.encoded.count = 0;
+            atomic_store(&b->pending, 1);
+        }
+        if (atomic_load(&p->failed) || !spsc_ring_push_wait(p->to_write, items, n)) {
+            break;
+        }
+        for (size_t i = 0; i < n; i++) {
+            ws_pool_submit(p->workers, &((batch*)items[i])->root.task);
+        }
+        start = trace_begin();
+    }
+}
+
+// Encoder stage on the calling thread.
+static void encode_batches(pipeline* p) {
+    unsigned char* scratch = NULL;
+    size_t capacity = 0;
+    void* items[RING_BURST];
+    size_t n;
+    uint64_t start = trace_begin();
+    while ((n = spsc_ring_pop_wait(p->to_encode, items, RING_BURST)) > 0) {
+        trace_end("wait", start);
+        for (size_t i = 0; i < n && !atomic_load(&p->failed); i++) {
+            if (encode_batch(p, items[i], &scratch, &capacity) != 0) {
+                pipeline_fail(p);
+            }
+        }
+        if (atomic_load(&p->failed) || !spsc_ring_push_wait(p->to_write, items, n)) {
+            break;
+        }
+        start = trace_begin();
+    }
+    free(scratch);
+}
+
+static int run_pipeline(FILE* in, converter* conv, ws_pool* workers,
+                        pipeline_sink sink, void* ctx) {
+    pipeline p = { .in = in, .conv = conv, .sink = sink, .ctx = ctx, .workers = workers };
+    pthread_t reader, writer;
+    bool reading = false, writing = false;
+    int result = -1;
+
+    atomic_init(&p.failed, false);
+    ring_event_init(&p.encoded);
+    p.batches = calloc(PIPELINE_BATCHES, sizeof(batch));
+    p.pool = mpmc_ring_create(PIPELINE_BATCHES);
+    p.to_encode = spsc_ring_create(PIPELINE_BATCHES);
+    p.to_write = spsc_ring_create(PIPELINE_BATCHES);
+    if (p.batches == NULL || p.pool == NULL || p.to_encode == NULL || p.to_write == NULL) {
+        goto done;
+    }
+    for (size_t i = 0; i < PIPELINE_BATCHES; i++) {
+        batch* b = &p.batches[i];
+        void* item = b;
+        b->p = &p;
+        b->root.task.run = encode_segment;
+        b->root.owner = b;
+        convert_keys_init(&b->root.keys);
+        if (!batch_reserve(b, PIPELINE_BATCH_SIZE)) {
+            goto done;
+        }
+        mpmc_ring_push(p.pool, &item, 1);
+    }
+
+    reading = pthread_create(&reader, NULL, read_stage, &p) == 0;
+    writing = reading && pthread_create(&writer, NULL, write_stage, &p) == 0;
+    if (!writing) {
+        pipeline_fail(&p);
+        goto done;
+    }
+    if (workers != NULL) {
+        dispatch_batches(&p);
+    } else {
+        encode_batches(&p);
+    }
+    spsc_ring_close(p.to_write);
+    result = 0;
+
+done:
+    if (reading) {
+        pthread_join(reader, NULL);
+    }
+    if (writing) {
+        pthread_join(writer, NULL);
+    }
+    if (atomic_load(&p.failed)) {
+        result = -1;
+    }
+    if (p.batches != NULL) {
+        for (size_t i = 0; i < PIPELINE_BATCHES; i++) {
+            free(p.batches[i].text);
+            record_buffer_free(&p.batches[i].root.encoded);
+        }
+        free(p.batches);
+    }
+    if (p.pool != NULL) {
+        mpmc_ring_destroy(p.pool);
+    }
+    if (p.to_encode != NULL) {
+        spsc_ring_destroy(p.to_encode);
+    }
+    if (p.to_write != NULL) {
+        spsc_ring_destroy(p.to_write);
+    }
+    return result;
+}
+
+int pipeline_convert(FILE* in, converter* conv, pipeline_sink sink, void* ctx) {
+    return run_pipeline(in, conv, NULL, sink, ctx);
+}
+
+int pipeline_convert_parallel(FILE* in, converter* conv, size_t threads,
+                              pipeline_sink sink, void* ctx) {
+    ws_pool* workers = ws_pool_create(threads);
+    if (workers == NULL) {
+        return -1;
+    }
+    int result = run_pipeline(in, conv, workers, sink, ctx);
+    ws_pool_destroy(workers);
+    return result;
+}
@@ -0,0 +1,41 @@
+// Pipelined conversion.
+//
+// A reader thread cuts the input into batches of whole lines, the calling
+// thread parses and encodes them, and a writer thread hands the encoded
+// records to a sink. Batches travel between the stages over lock-free
+// rings and come back through a shared pool once written, so the stages
+// overlap without allocating per record.
+//
+// In parallel mode, batches are encoded by a work-stealing pool instead.
+// A worker splits the lines of its batch in halves while other workers are
+// idle, so a few huge records don't hold up the rest. Keys get local tags
+// in each piece; the writer maps them to dictionary tags as it writes.
+//
+// Either way, records are written in input order, and the output is the
+// same as converting line by line.
+
+#ifndef _pipeline_H
+#define _pipeline_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "convert.h"
+
+#define PIPELINE_BATCH_SIZE (256 * 1024)  // input bytes per batch, grown for longer lines
+#define PIPELINE_BATCHES 8                // batches in flight between the stages
+
+// Destination of encoded records, called from the writer thread in input
+// order. Return 0 on success, -1 on error.
+typedef int (*pipeline_sink)(void* ctx, const void* record, size_t size);
+
+// Convert every line of in with conv, passing the records to sink. Return
+// 0 on success, or -1 if reading, encoding or the sink failed.
+int pipeline_convert(FILE* in, converter* conv, pipeline_sink sink, void* ctx);
+
+// Convert as pipeline_convert, encoding on threads workers (one per online
+// CPU if 0).
+int pipeline_convert_parallel(FILE* in, converter* conv, size_t threads,
+                              pipeline_sink sink, void* ctx);
+
+#endif // _pipeline_H
@@ -0,0 +1,380 @@
+#include "projection.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashtable.h"
+
+#define KEY_MAX 255  // longest path component
+
+// One step of the paths: the members of an object to look into.
+typedef struct path_node {
+    hashtable* children;  // key -> path_node*, or NULL if none
+    bool whole;           // a path ends here: the whole value is kept (or dropped)
+} path_node;
+
+struct projection {
+    bool include;
+    bool nested;
+    path_node root;
+};
+
+// Key of an enclosing object, for flattening nested fields into "a.b".
+typedef struct prefix {
+    const char* key;
+    size_t length;
+    const struct prefix* parent;
+} prefix;
+
+// Projected line being written.
+typedef struct {
+    char* data;
+    size_t size;
+    size_t capacity;
+    size_t members;
+    bool failed;  // out of memory
+} output;
+
+projection* projection_create(bool include) {
+    projection* p = calloc(1, sizeof(projection));
+    if (p == NULL) {
+        return NULL;
+    }
+    p->include = include;
+    return p;
+}
+
+static void node_free(path_node* node) {
+    if (node->children == NULL) {
+        return;
+    }
+    hashtablei it = hashtable_iterator(node->children);
+    while (hashtable_next(&it)) {
+        node_free(it.value);
+        free(it.value);
+    }
+    hashtable_destroy(node->children);
+}
+
+void projection_destroy(projection* p) {
+    node_free(&p->root);
+    free(p);
+}
+
+// Return the child of node for key, creating it if needed, or NULL if out
+// of memory.
+static path_node* node_child(path_node* node, const char* key) {
+    if (node->children == NULL && (node->children = hashtable_create()) == NULL) {
+        return NULL;
+    }
+    path_node* child = hashtable_get(node->children, key);
+    if (child != NULL) {
+        return child;
+    }
+    child = calloc(1, sizeof(path_node));
+    if (child == NULL || hashtable_set(node->children, key, child) == NULL) {
+        free(child);
+        return NULL;
+    }
+    return child;
+}
+
+bool projection_add(projection* p, const char* list) {
+    char component[KEY_MAX + 1];
+    const char* s = list;
+    for (;;) {
+        size_t length = strcspn(s, ",");
+        if (length == 0) {
+            return false;
+        }
+        path_node* node = &p->root;
+        const char* path_end = s + length;
+        size_t depth = 0;
+        while (s < path_end) {
+            // An exclusion is a single top-level key, dots and all.
+            size_t n = p->include ? strcspn(s, ".,") : length;
+            if (n == 0 || n > KEY_MAX) {
+                return false;
+            }
+            memcpy(component, s, n);
+            component[n] = '\0';
+            if ((node = node_child(node, component)) == NULL) {
+                return false;
+            }
+            depth++;
+            s += n;
+            if (s < path_end && ++s == path_end) {
+                return false;  // trailing dot
+            }
+        }
+        node->whole = true;
+        p->nested |= depth > 1;
+        if (*s == '\0') {
+            return true;
+        }
+        s++;
+    }
+}
+
+bool projection_nested(const projection* p) {
+    return p->nested;
+}
+
+bool projection_keeps(const projection* p, const char* key) {
+    path_node* child = p->root.children != NULL ? hashtable_get(p->root.children, key) : NULL;
+    bool listed = child != NULL && child->whole;
+    return p->include ? listed : !listed;
+}
+
+// Return the child of node for the key key[0..length) as written in the
+// line, or NULL.
+static const path_node* lookup(const path_node* node, const char* key, size_t length) {
+    char copy[KEY_MAX + 1];
+    if (node->children == NULL || length > KEY_MAX) {
+        return NULL;
+    }
+    memcpy(copy, key, length);
+    copy[length] = '\0';
+    return hashtable_get(node->children, copy);
+}
+
+static void append(output* out, const char* data, size_t size) {
+    if (out->size + size > out->capacity) {
+        size_t capacity = out->capacity > 0 ? out->capacity : 256;
+        while (capacity < out->size + size) {
+            capacity *= 2;
+        }
+        char* grown = realloc(out->data, capacity);
+        if (grown == NULL) {
+            out->failed = true;
+            return;
+        }
+        out->data = grown;
+        out->capacity = capacity;
+    }
+    memcpy(out->data + out->size, data, size);
+    out->size += size;
+}
+
+static void append_prefix(output* out, const prefix* parent) {
+    if (parent == NULL) {
+        return;
+    }
+    append_prefix(out, parent->parent);
+    append(out, parent->key, parent->length);
+    append(out, ".", 1);
+}
+
+// Copy one member, its key qualified by the enclosing keys.
+static void append_member(output* out, const prefix* parent, const char* key, size_t key_length,
+                          const char* value, size_t value_length) {
+    if (out->members++ > 0) {
+        append(out, ",", 1);
+    }
+    append(out, "\"", 1);
+    append_prefix(out, parent);
+    append(out, key, key_length);
+    append(out, "\":", 2);
+    append(out, value, value_length);
+}
+
+static const char* skip_space(const char* s) {
+    while (*s == ' ' || *s == '\t' || *s == '\r' || *s == '\n') {
+        s++;
+    }
+    return s;
+}
+
+// s is at an opening quote. Return the end of the string, or NULL.
+static const char* skip_string(const char* s) {
+    const char* p = s + 1;
+    for (;;) {
+        const char* quote = strchr(p, '"');
+        if (quote == NULL) {
+            return NULL;
+        }
+        // The quote is escaped if an odd number of backslashes precede it.
+        const char* b = quote;
+        while (b > s + 1 && b[-1] == '\\') {
+            b--;
+        }
+        if ((quote - b) % 2 == 0) {
+            return quote + 1;
+        }
+        p = quote + 1;
+    }
+}
+
+// Return the end of the value at s, or NULL. Nested values are matched
+// by brackets only, and scalars by their delimiters.
+static const char* skip_value(const char* s) {
+    if (*s == '"') {
+        return skip_string(s);
+    }
+    if (*s == '{' || *s == '[') {
+        int depth = 0;
+        const char* p = s;
+        while ((p = strpbrk(p, "\"{}[]")) != NULL) {
+            if (*p == '"') {
+                p = skip_string(p);
+                if (p == NULL) {
+                    return NULL;
+                }
+                continue;
+            }
+            if (*p == '{' || *p == '[') {
+                depth++;
+            } else if (--depth == 0) {
+                return p + 1;
+            }
+            p++;
+        }
+        return NULL;
+    }
+    const char* p = s;
+    while (*p != '\0' && strchr(",}] \t\r\n", *p) == NULL) {
+        p++;
+    }
+    return p > s ? p : NULL;
+}
+
+// Project the members of the object starting after its '{' at s, looking
+// them up in node. Return the end of the object, or NULL if the scanner
+// can't follow it.
+static const char* project_object(const projection* p, const path_node* node,
+                                  const prefix* parent, const char* s, output* out) {
+    bool first = true;
+    for (;;) {
+        s = skip_space(s);
+        if (*s == '}' && first) {
+            return s + 1;
+        }
+        if (*s != '"') {
+            return NULL;
+        }
+        const char* key = s + 1;
+        const char* key_end = skip_string(s);
+        if (key_end == NULL) {
+            return NULL;
+        }
+        size_t key_length = key_end - 1 - key;
+        if (memchr(key, '\\', key_length) != NULL) {
+            return NULL;  // json-c decodes it: leave the key to projection_filter
+        }
+        s = skip_space(key_end);
+        if (*s != ':') {
+            return NULL;
+        }
+        const char* value = skip_space(s + 1);
+        const path_node* child = lookup(node, key, key_length);
+        bool listed = child != NULL && child->whole;
+
+        if (p->include && child != NULL && !listed && *value == '{') {
+            prefix here = { key, key_length, parent };
+            s = project_object(p, child, &here, value + 1, out);
+        } else {
+            s = skip_value(value);
+            if (s != NULL && listed == p->include) {
+                append_member(out, parent, key, key_length, value, s - value);
+            }
+        }
+        if (s == NULL) {
+            return NULL;
+        }
+        s = skip_space(s);
+        if (*s == '}') {
+            return s + 1;
+        }
+        if (*s != ',') {
+            return NULL;
+        }
+        s++;
+        first = false;
+    }
+}
+
+// Add the members of object to projected, looking them up in node.
+// Return false if out of memory.
+static bool filter_object(const projection* p, const path_node* node, const prefix* parent,
+                          struct json_object* object, struct json_object* projected) {
+    struct json_object_iter it;
+    json_object_object_foreachC(object, it) {
+        const path_node* child =
+            node->children != NULL ? hashtable_get(node->children, it.key) : NULL;
+        bool listed = child != NULL && child->whole;
+
+        if (p->include && child != NULL && !listed &&
+            json_object_get_type(it.val) == json_type_object) {
+            prefix here = { it.key, strlen(it.key), parent };
+            if (!filter_object(p, child, &here, it.val, projected)) {
+                return false;
+            }
+        } else if (listed == p->include) {
+            output name = { NULL, 0, 0, 0, false };
+            append_prefix(&name, parent);
+            append(&name, it.key, strlen(it.key) + 1);  // with the NUL
+            if (name.failed) {
+                free(name.data);
+                return false;
+            }
+            struct json_object* value = json_object_get(it.val);
+            int added = json_object_object_add(projected, name.data, value);
+            free(name.data);
+            if (added != 0) {
+                json_object_put(value);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+struct json_object* projection_filter(const projection* p, struct json_object* record) {
+    if (json_object_get_type(record) != json_type_object) {
+        return json_object_get(record);
+    }
+    struct json_object* projected = json_object_new_object();
+    if (projected != NULL && !filter_object(p, &p->root, NULL, record, projected)) {
+        json_object_put(projected);
+        return NULL;
+    }
+    return projected;
+}
+
+bool projection_parse(const projection* p, const char* line, char** buffer,
+                      size_t* capacity, struct json_object** record) {
+    const char* text = line;
+    if (p != NULL && (text = projection_apply(p, line, buffer, capacity)) == NULL) {
+        return false;
+    }
+    *record = json_tokener_parse(text);
+    if (*record == NULL || p == NULL || text != line) {
+        return true;
+    }
+    // The scanner couldn't follow the line: project what json-c made of it.
+    struct json_object* projected = projection_filter(p, *record);
+    json_object_put(*record);
+    *record = projected;
+    return projected != NULL;
+}
+
+const char* projection_apply(const projection* p, const char* line,
+                             char** buffer, size_t* capacity) {
+    const char* s = skip_space(line);
+    if (*s != '{') {
+        return line;
+    }
+    output out = { *buffer, 0, *capacity, 0, false };
+    append(&out, "{", 1);
+    const char* end = project_object(p, &p->root, NULL, s + 1, &out);
+    append(&out, "}", 2);  // with the NUL
+    *buffer = out.data;
+    *capacity = out.capacity;
+    if (out.failed) {
+        return NULL;
+    }
+    if (end == NULL || *skip_space(end) != '\0') {
+        return line;
+    }
+    return *buffer;
+}
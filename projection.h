@@ -0,0 +1,65 @@
+// Key projection of JSON records.
+//
+// A projection either includes only the listed key paths or excludes the
+// listed keys. Paths name nested fields with dots: "user.id" keeps the id
+// member of the user object, flattened into a top-level field named
+// "user.id" so the converter can encode it.
+//
+// Lines are projected as text before json-c sees them: a light scanner
+// finds each member's extent without parsing it, and only the kept
+// members are copied out. Dropped values are never tokenized, hashed or
+// tagged, so a narrow projection of wide records costs little more than
+// the scan. A line the scanner can't follow (comments, single quotes, a
+// trailing comma: things json-c lets through), or with a key written with
+// escapes, is left to json-c, and its record projected with
+// projection_filter instead, which compares decoded keys.
+
+#ifndef _projection_H
+#define _projection_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <json-c/json.h>
+
+// Projection: create with projection_create, free with projection_destroy.
+typedef struct projection projection;
+
+// Create an empty projection that keeps only the paths added (include) or
+// everything but the keys added. Return NULL if out of memory.
+projection* projection_create(bool include);
+
+// Free projection.
+void projection_destroy(projection* p);
+
+// Add the comma-separated paths of list. Exclusions name top-level keys
+// only. Return false if a path is empty or out of memory.
+bool projection_add(projection* p, const char* list);
+
+// Return true if some included path is nested.
+bool projection_nested(const projection* p);
+
+// Return true if the top-level field key is kept whole.
+bool projection_keeps(const projection* p, const char* key);
+
+// Project one NUL-terminated line into *buffer, grown along with
+// *capacity as needed, and return it. A line the scanner can't follow is
+// returned unchanged (line itself, never *buffer): what json-c parses of
+// it must go through projection_filter. A value that is dropped is only
+// scanned, so a record malformed there may be kept. Return NULL if out
+// of memory.
+const char* projection_apply(const projection* p, const char* line,
+                             char** buffer, size_t* capacity);
+
+// Parse line with json-c into *record, projected by p, or whole if p is
+// NULL; *buffer and *capacity are as for projection_apply. *record is NULL
+// if json-c can't parse the line. Return false if out of memory.
+bool projection_parse(const projection* p, const char* line, char** buffer,
+                      size_t* capacity, struct json_object** record);
+
+// Return a new reference to record projected: an object of the kept
+// members, flattened as projection_apply does, or record itself if it
+// isn't an object. Return NULL if out of memory.
+struct json_object* projection_filter(const projection* p, struct json_object* record);
+
+#endif // _projection_H
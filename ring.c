@@ -0,0 +1,425 @@
+#include "ring.h"
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Bounds of the adaptive spin before a waiter sleeps. The limit doubles
+// when spinning pays off and halves when the waiter ends up sleeping
+// anyway, so a stage that is always starved stops burning its core.
+#define SPIN_MIN 16
+#define SPIN_MAX 4096
+
+// One slot of an mpmc_ring. seq == position: free for the push claiming
+// position; seq == position + 1: filled for the pop claiming position.
+struct mpmc_cell {
+    _Atomic size_t seq;
+    void* item;
+};
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static size_t round_up_pow2(size_t n) {
+    size_t cap = 2;
+    while (cap < n) {
+        cap <<= 1;
+    }
+    return cap;
+}
+
+// Spinning only helps while the partner runs on another core.
+static bool multicore;
+
+__attribute__((constructor))
+static void ring_detect_cores(void) {
+    multicore = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+}
+
+void ring_event_init(ring_event* e) {
+    atomic_init(&e->seq, 0);
+    atomic_init(&e->waiters, 0);
+    atomic_init(&e->spin, multicore ? SPIN_MIN : 0);
+}
+
+// Wake sleepers after publishing progress. The fence orders the publish
+// before the waiters check, pairing with the one in ring_event_prepare.
+void ring_event_notify(ring_event* e) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&e->waiters, memory_order_relaxed) == 0) {
+        return;
+    }
+    atomic_fetch_add(&e->seq, 1);
+    syscall(SYS_futex, (uint32_t*)&e->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// Announce a waiter and return the event count to sleep on. The caller
+// must retry its operation before calling ring_event_wait, and call
+// ring_event_cancel instead if the retry succeeds.
+uint32_t ring_event_prepare(ring_event* e) {
+    atomic_fetch_add(&e->waiters, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    return atomic_load(&e->seq);
+}
+
+void ring_event_cancel(ring_event* e) {
+    atomic_fetch_sub(&e->waiters, 1);
+}
+
+void ring_event_wait(ring_event* e, uint32_t seen) {
+    syscall(SYS_futex, (uint32_t*)&e->seq, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+    atomic_fetch_sub(&e->waiters, 1);
+}
+
+// Spin step of a waiting loop. Return false once the spin budget is
+// spent, shrinking the budget since spinning didn't pay off.
+static inline bool event_spin(ring_event* e, unsigned* spins) {
+    unsigned limit = atomic_load_explicit(&e->spin, memory_order_relaxed);
+    if (*spins >= limit) {
+        if (limit > SPIN_MIN && multicore) {
+            atomic_store_explicit(&e->spin, limit / 2, memory_order_relaxed);
+        }
+        return false;
+    }
+    (*spins)++;
+    cpu_relax();
+    return true;
+}
+
+// The operation succeeded after spins spins: if that took most of the
+// budget, grow it so the next wait is less likely to end in a sleep.
+static inline void event_spun(ring_event* e, unsigned spins) {
+    unsigned limit = atomic_load_explicit(&e->spin, memory_order_relaxed);
+    if (spins > limit / 2 && limit < SPIN_MAX && multicore) {
+        atomic_store_explicit(&e->spin, limit * 2, memory_order_relaxed);
+    }
+}
+
+spsc_ring* spsc_ring_create(size_t capacity) {
+    spsc_ring* ring = aligned_alloc(RING_CACHE_LINE, sizeof(spsc_ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    capacity = round_up_pow2(capacity);
+    ring->slots = malloc(capacity * sizeof(void*));
+    if (ring->slots == NULL) {
+        free(ring);
+        return NULL;
+    }
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->head, 0);
+    ring->head_cache = 0;
+    ring->tail_cache = 0;
+    ring_event_init(&ring->not_empty);
+    ring_event_init(&ring->not_full);
+    atomic_init(&ring->closed, false);
+    ring->mask = capacity - 1;
+    return ring;
+}
+
+void spsc_ring_destroy(spsc_ring* ring) {
+    free(ring->slots);
+    free(ring);
+}
+
+size_t spsc_ring_push(spsc_ring* ring, void* const* items, size_t n) {
+    if (atomic_load_explicit(&ring->closed, memory_order_relaxed)) {
+        return 0;
+    }
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t capacity = ring->mask + 1;
+    if (capacity - (tail - ring->head_cache) < n) {
+        ring->head_cache = atomic_load_explicit(&ring->head, memory_order_acquire);
+    }
+    size_t room = capacity - (tail - ring->head_cache);
+    if (n > room) {
+        n = room;
+    }
+    if (n == 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < n; i++) {
+        ring->slots[(tail + i) & ring->mask] = items[i];
+    }
+    atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+    ring_event_notify(&ring->not_empty);
+    return n;
+}
+
+size_t spsc_ring_pop(spsc_ring* ring, void** items, size_t n) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (ring->tail_cache - head < n) {
+        ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    }
+    size_t ready = ring->tail_cache - head;
+    if (n > ready) {
+        n = ready;
+    }
+    if (n == 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < n; i++) {
+        items[i] = ring->slots[(head + i) & ring->mask];
+    }
+    atomic_store_explicit(&ring->head, head + n, memory_order_release);
+    ring_event_notify(&ring->not_full);
+    return n;
+}
+
+bool spsc_ring_push_wait(spsc_ring* ring, void* const* items, size_t n) {
+    size_t done = 0;
+    unsigned spins = 0;
+    while (done < n) {
+        if (atomic_load(&ring->closed)) {
+            return false;
+        }
+        size_t k = spsc_ring_push(ring, items + done, n - done);
+        if (k > 0) {
+            event_spun(&ring->not_full, spins);
+            done += k;
+            spins = 0;
+            continue;
+        }
+        if (event_spin(&ring->not_full, &spins)) {
+            continue;
+        }
+        uint32_t seen = ring_event_prepare(&ring->not_full);
+        k = spsc_ring_push(ring, items + done, n - done);
+        if (k > 0 || atomic_load(&ring->closed)) {
+            ring_event_cancel(&ring->not_full);
+            done += k;
+        } else {
+            ring_event_wait(&ring->not_full, seen);
+        }
+        spins = 0;
+    }
+    return true;
+}
+
+size_t spsc_ring_pop_wait(spsc_ring* ring, void** items, size_t n) {
+    unsigned spins = 0;
+    for (;;) {
+        size_t k = spsc_ring_pop(ring, items, n);
+        if (k > 0) {
+            event_spun(&ring->not_empty, spins);
+            return k;
+        }
+        // Items pushed before close are visible once closed is.
+        if (atomic_load(&ring->closed)) {
+            return spsc_ring_pop(ring, items, n);
+        }
+        if (event_spin(&ring->not_empty, &spins)) {
+            continue;
+        }
+        uint32_t seen = ring_event_prepare(&ring->not_empty);
+        k = spsc_ring_pop(ring, items, n);
+        if (k > 0 || atomic_load(&ring->closed)) {
+            ring_event_cancel(&ring->not_empty);
+            if (k > 0) {
+                return k;
+            }
+        } else {
+            ring_event_wait(&ring->not_empty, seen);
+        }
+        spins = 0;
+    }
+}
+
+// Wake everyone on both events, whether or not they have gone to sleep yet.
+static void ring_wake_all(ring_event* e) {
+    atomic_thread_fence(memory_order_seq_cst);
+    atomic_fetch_add(&e->seq, 1);
+    syscall(SYS_futex, (uint32_t*)&e->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+void spsc_ring_close(spsc_ring* ring) {
+    atomic_store(&ring->closed, true);
+    ring_wake_all(&ring->not_empty);
+    ring_wake_all(&ring->not_full);
+}
+
+mpmc_ring* mpmc_ring_create(size_t capacity) {
+    mpmc_ring* ring = aligned_alloc(RING_CACHE_LINE, sizeof(mpmc_ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    capacity = round_up_pow2(capacity);
+    ring->cells = malloc(capacity * sizeof(struct mpmc_cell));
+    if (ring->cells == NULL) {
+        free(ring);
+        return NULL;
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        atomic_init(&ring->cells[i].seq, i);
+    }
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->head, 0);
+    ring_event_init(&ring->not_empty);
+    ring_event_init(&ring->not_full);
+    atomic_init(&ring->closed, false);
+    ring->mask = capacity - 1;
+    return ring;
+}
+
+void mpmc_ring_destroy(mpmc_ring* ring) {
+    free(ring->cells);
+    free(ring);
+}
+
+// Claim up to n consecutive positions for a push with one CAS, and fill
+// them. A cell ready for position pos stays so until pos is claimed, so
+// checking the cells before claiming is safe. Return the number pushed.
+static size_t mpmc_push_run(mpmc_ring* ring, void* const* items, size_t n) {
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    for (;;) {
+        size_t k = 0;
+        while (k < n) {
+            struct mpmc_cell* cell = &ring->cells[(pos + k) & ring->mask];
+            if (atomic_load_explicit(&cell->seq, memory_order_acquire) != pos + k) {
+                break;
+            }
+            k++;
+        }
+        if (k == 0) {
+            struct mpmc_cell* cell = &ring->cells[pos & ring->mask];
+            intptr_t diff = (intptr_t)atomic_load_explicit(&cell->seq, memory_order_acquire) - (intptr_t)pos;
+            if (diff < 0) {
+                return 0;  // full
+            }
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + k,
+                memory_order_relaxed, memory_order_relaxed)) {
+            for (size_t i = 0; i < k; i++) {
+                struct mpmc_cell* cell = &ring->cells[(pos + i) & ring->mask];
+                cell->item = items[i];
+                atomic_store_explicit(&cell->seq, pos + i + 1, memory_order_release);
+            }
+            return k;
+        }
+    }
+}
+
+// Claim up to n consecutive filled positions for a pop, as mpmc_push_run.
+static size_t mpmc_pop_run(mpmc_ring* ring, void** items, size_t n) {
+    size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    for (;;) {
+        size_t k = 0;
+        while (k < n) {
+            struct mpmc_cell* cell = &ring->cells[(pos + k) & ring->mask];
+            if (atomic_load_explicit(&cell->seq, memory_order_acquire) != pos + k + 1) {
+                break;
+            }
+            k++;
+        }
+        if (k == 0) {
+            struct mpmc_cell* cell = &ring->cells[pos & ring->mask];
+            intptr_t diff = (intptr_t)atomic_load_explicit(&cell->seq, memory_order_acquire) - (intptr_t)(pos + 1);
+            if (diff < 0) {
+                return 0;  // empty
+            }
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + k,
+                memory_order_relaxed, memory_order_relaxed)) {
+            for (size_t i = 0; i < k; i++) {
+                struct mpmc_cell* cell = &ring->cells[(pos + i) & ring->mask];
+                items[i] = cell->item;
+                atomic_store_explicit(&cell->seq, pos + i + ring->mask + 1, memory_order_release);
+            }
+            return k;
+        }
+    }
+}
+
+size_t mpmc_ring_push(mpmc_ring* ring, void* const* items, size_t n) {
+    if (atomic_load_explicit(&ring->closed, memory_order_relaxed)) {
+        return 0;
+    }
+    size_t k = mpmc_push_run(ring, items, n);
+    if (k > 0) {
+        ring_event_notify(&ring->not_empty);
+    }
+    return k;
+}
+
+size_t mpmc_ring_pop(mpmc_ring* ring, void** items, size_t n) {
+    size_t k = mpmc_pop_run(ring, items, n);
+    if (k > 0) {
+        ring_event_notify(&ring->not_full);
+    }
+    return k;
+}
+
+bool mpmc_ring_push_wait(mpmc_ring* ring, void* const* items, size_t n) {
+    size_t done = 0;
+    unsigned spins = 0;
+    while (done < n) {
+        if (atomic_load(&ring->closed)) {
+            return false;
+        }
+        size_t k = mpmc_ring_push(ring, items + done, n - done);
+        if (k > 0) {
+            event_spun(&ring->not_full, spins);
+            done += k;
+            spins = 0;
+            continue;
+        }
+        if (event_spin(&ring->not_full, &spins)) {
+            continue;
+        }
+        uint32_t seen = ring_event_prepare(&ring->not_full);
+        k = mpmc_ring_push(ring, items + done, n - done);
+        if (k > 0 || atomic_load(&ring->closed)) {
+            ring_event_cancel(&ring->not_full);
+            done += k;
+        } else {
+            ring_event_wait(&ring->not_full, seen);
+        }
+        spins = 0;
+    }
+    return true;
+}
+
+size_t mpmc_ring_pop_wait(mpmc_ring* ring, void** items, size_t n) {
+    unsigned spins = 0;
+    for (;;) {
+        size_t k = mpmc_ring_pop(ring, items, n);
+        if (k > 0) {
+            event_spun(&ring->not_empty, spins);
+            return k;
+        }
+        if (atomic_load(&ring->closed)) {
+            return mpmc_ring_pop(ring, items, n);
+        }
+        if (event_spin(&ring->not_empty, &spins)) {
+            continue;
+        }
+        uint32_t seen = ring_event_prepare(&ring->not_empty);
+        k = mpmc_ring_pop(ring, items, n);
+        if (k > 0 || atomic_load(&ring->closed)) {
+            ring_event_cancel(&ring->not_empty);
+            if (k > 0) {
+                return k;
+            }
+        } else {
+            ring_event_wait(&ring->not_empty, seen);
+        }
+        spins = 0;
+    }
+}
+
+void mpmc_ring_close(mpmc_ring* ring) {
+    atomic_store(&ring->closed, true);
+    ring_wake_all(&ring->not_empty);
+    ring_wake_all(&ring->not_full);
+}
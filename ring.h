@@ -0,0 +1,99 @@
+// Bounded lock-free rings of pointers for handing work between threads.
+//
+// spsc_ring connects exactly one producer to one consumer; each side owns
+// its index and only reads the other's, so a hand-off is a store and a
+// load. mpmc_ring allows any number of producers and consumers, with a
+// sequence number per slot (Vyukov's bounded queue). Both keep producer and
+// consumer indices on separate cache lines, and move items in batches.
+//
+// The *_wait variants block: they spin briefly, then sleep on a futex until
+// the other side makes progress. A side that never waits pays no syscalls.
+// After close, pushes fail and pops drain what is left, then return 0.
+
+#ifndef _ring_H
+#define _ring_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RING_CACHE_LINE 64
+
+// Futex-backed event count: waiters sleep until the next notify. The rings
+// use two each; other waiting loops can use them directly.
+typedef struct {
+    _Atomic uint32_t seq;
+    _Atomic uint32_t waiters;
+    _Atomic unsigned spin;  // current spin budget before sleeping
+} ring_event;
+
+// Single-producer single-consumer ring: create with spsc_ring_create, free
+// with spsc_ring_destroy.
+typedef struct {
+    _Alignas(RING_CACHE_LINE) _Atomic size_t tail;  // next slot to fill, written by producer
+    size_t head_cache;                              // producer's last view of head
+    _Alignas(RING_CACHE_LINE) _Atomic size_t head;  // next slot to take, written by consumer
+    size_t tail_cache;                              // consumer's last view of tail
+    _Alignas(RING_CACHE_LINE) ring_event not_empty;
+    ring_event not_full;
+    _Atomic bool closed;
+    size_t mask;
+    void** slots;
+} spsc_ring;
+
+// Multi-producer multi-consumer ring: create with mpmc_ring_create, free
+// with mpmc_ring_destroy.
+typedef struct {
+    _Alignas(RING_CACHE_LINE) _Atomic size_t tail;  // next position to claim for a push
+    _Alignas(RING_CACHE_LINE) _Atomic size_t head;  // next position to claim for a pop
+    _Alignas(RING_CACHE_LINE) ring_event not_empty;
+    ring_event not_full;
+    _Atomic bool closed;
+    size_t mask;
+    struct mpmc_cell* cells;
+} mpmc_ring;
+
+// Create ring holding at least capacity items (rounded up to a power of two).
+// Return NULL if out of memory.
+spsc_ring* spsc_ring_create(size_t capacity);
+void spsc_ring_destroy(spsc_ring* ring);
+
+// Push up to n items; return the number pushed, 0 if full or closed.
+size_t spsc_ring_push(spsc_ring* ring, void* const* items, size_t n);
+
+// Pop up to n items into items; return the number popped, 0 if empty.
+size_t spsc_ring_pop(spsc_ring* ring, void** items, size_t n);
+
+// Push all n items, waiting for room. Return false if the ring was closed.
+bool spsc_ring_push_wait(spsc_ring* ring, void* const* items, size_t n);
+
+// Pop between 1 and n items, waiting until some arrive. Return the number
+// popped, or 0 once the ring is closed and empty.
+size_t spsc_ring_pop_wait(spsc_ring* ring, void** items, size_t n);
+
+// Stop accepting items and wake every waiter.
+void spsc_ring_close(spsc_ring* ring);
+
+// Initialize event.
+void ring_event_init(ring_event* e);
+
+// Wake sleepers after publishing progress; cheap when nobody sleeps.
+void ring_event_notify(ring_event* e);
+
+// Waiting protocol: seen = ring_event_prepare(e), then check the condition
+// again; if it now holds call ring_event_cancel(e), otherwise
+// ring_event_wait(e, seen), which returns after the next notify.
+uint32_t ring_event_prepare(ring_event* e);
+void ring_event_cancel(ring_event* e);
+void ring_event_wait(ring_event* e, uint32_t seen);
+
+mpmc_ring* mpmc_ring_create(size_t capacity);
+void mpmc_ring_destroy(mpmc_ring* ring);
+size_t mpmc_ring_push(mpmc_ring* ring, void* const* items, size_t n);
+size_t mpmc_ring_pop(mpmc_ring* ring, void** items, size_t n);
+bool mpmc_ring_push_wait(mpmc_ring* ring, void* const* items, size_t n);
+size_t mpmc_ring_pop_wait(mpmc_ring* ring, void** items, size_t n);
+void mpmc_ring_close(mpmc_ring* ring);
+
+#endif // _ring_H
@@ -0,0 +1,331 @@
+#include "schema.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Encoded value of one field of the record being encoded.
+typedef struct {
+    size_t field;        // index into schema.fields
+    const void* value;   // points to scalar or string bytes
+    int length;
+    union {
+        int i;
+        short b;
+    } scalar;
+} schema_slot;
+
+// Schema structure: create with schema_create, free with schema_destroy.
+struct schema {
+    schema_field* fields;  // fields in record order
+    size_t* seen;          // number of sampled records containing each field
+    size_t length;         // number of fields
+    size_t capacity;       // size of fields and seen arrays
+    size_t records;        // number of sampled records
+    bool valid;            // false once a record can't be described
+    schema_slot* slots;    // scratch space for schema_encode, one per field
+};
+
+#define INITIAL_CAPACITY 8  // must not be zero
+
+schema* schema_create(void) {
+    schema* s = calloc(1, sizeof(schema));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->capacity = INITIAL_CAPACITY;
+    s->fields = calloc(s->capacity, sizeof(schema_field));
+    s->seen = calloc(s->capacity, sizeof(size_t));
+    if (s->fields == NULL || s->seen == NULL) {
+        free(s->fields);
+        free(s->seen);
+        free(s);
+        return NULL;
+    }
+    s->valid = true;
+    return s;
+}
+
+void schema_destroy(schema* s) {
+    for (size_t i = 0; i < s->length; i++) {
+        free((void*)s->fields[i].key);
+    }
+    free(s->fields);
+    free(s->seen);
+    free(s->slots);
+    free(s);
+}
+
+// Map a json-c type to a schema type. Return false if it has no fixed layout.
+static bool schema_type_of(struct json_object* val, schema_type* type) {
+    switch (json_object_get_type(val)) {
+        case json_type_int:
+            *type = SCHEMA_INT;
+            return true;
+        case json_type_boolean:
+            *type = SCHEMA_BOOLEAN;
+            return true;
+        case json_type_string:
+            *type = SCHEMA_STRING;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Append a new field, growing the arrays if needed. Return its index, or
+// -1 if out of memory.
+static long schema_add_field(schema* s, const char* key, schema_type type) {
+    if (s->length == s->capacity) {
+        size_t new_capacity = s->capacity * 2;
+        schema_field* fields = realloc(s->fields, new_capacity * sizeof(schema_field));
+        if (fields == NULL) {
+            return -1;
+        }
+        s->fields = fields;
+        size_t* seen = realloc(s->seen, new_capacity * sizeof(size_t));
+        if (seen == NULL) {
+            return -1;
+        }
+        s->seen = seen;
+        s->capacity = new_capacity;
+    }
+    char* copy = strdup(key);
+    if (copy == NULL) {
+        return -1;
+    }
+    schema_field* field = &s->fields[s->length];
+    field->key = copy;
+    field->tag = 0;
+    field->type = type;
+    field->required = false;
+    s->seen[s->length] = 0;
+    return (long)s->length++;
+}
+
+bool schema_observe(schema* s, struct json_object* record) {
+    if (!s->valid) {
+        return false;
+    }
+    if (json_object_get_type(record) != json_type_object) {
+        s->valid = false;
+        return false;
+    }
+
+    // A record with nested values just isn't sampled; like any other
+    // mismatch it will take the generic path when converted.
+    struct json_object_iter it;
+    json_object_object_foreachC(record, it) {
+        schema_type type;
+        if (!schema_type_of(it.val, &type)) {
+            return false;
+        }
+    }
+
+    // Keys usually arrive in schema order, so start each search just past
+    // the previous match.
+    size_t hint = 0;
+    json_object_object_foreach(record, key, val) {
+        schema_type type = SCHEMA_INT;
+        schema_type_of(val, &type);
+
+        long index = -1;
+        for (size_t n = 0; n < s->length; n++) {
+            size_t i = (hint + n) % s->length;
+            if (strcmp(key, s->fields[i].key) == 0) {
+                index = (long)i;
+                break;
+            }
+        }
+        if (index < 0) {
+            index = schema_add_field(s, key, type);
+            if (index < 0) {
+                s->valid = false;
+                return false;
+            }
+        } else if (s->fields[index].type != type) {
+            // Same key with different types: records need the generic path.
+            s->valid = false;
+            return false;
+        }
+        s->seen[index]++;
+        hint = (size_t)index + 1;
+    }
+    s->records++;
+    return true;
+}
+
+bool schema_finalize(schema* s, hashtable* tags) {
+    if (!s->valid || s->records == 0) {
+        s->valid = false;
+        return false;
+    }
+    for (size_t i = 0; i < s->length; i++) {
+        int* tag = hashtable_get(tags, s->fields[i].key);
+        if (tag == NULL) {
+            s->valid = false;
+            return false;
+        }
+        s->fields[i].tag = *tag;
+        s->fields[i].required = s->seen[i] == s->records;
+    }
+    s->slots = calloc(s->length, sizeof(schema_slot));
+    if (s->slots == NULL) {
+        s->valid = false;
+        return false;
+    }
+    return true;
+}
+
+size_t schema_length(schema* s) {
+    return s->length;
+}
+
+const schema_field* schema_fields(schema* s) {
+    return s->fields;
+}
+
+int schema_encode(schema* s, struct json_object* record,
+                  unsigned char** buffer, size_t* capacity) {
+    if (!s->valid || s->slots == NULL) {
+        return 0;
+    }
+
+    // Match record keys against the fields in order, skipping only
+    // optional ones, and remember where each value lives.
+    size_t count = 0, cursor = 0, total = 0;
+    json_object_object_foreach(record, key, val) {
+        schema_type type;
+        if (!schema_type_of(val, &type)) {
+            return 0;
+        }
+        while (cursor < s->length && strcmp(key, s->fields[cursor].key) != 0) {
+            if (s->fields[cursor].required) {
+                return 0;
+            }
+            cursor++;
+        }
+        if (cursor == s->length || s->fields[cursor].type != type) {
+            return 0;
+        }
+
+        schema_slot* slot = &s->slots[count];
+        slot->field = cursor;
+        switch (type) {
+            case SCHEMA_INT:
+                slot->scalar.i = (int)json_object_get_int(val);
+                slot->value = &slot->scalar.i;
+                slot->length = sizeof(int);
+                break;
+            case SCHEMA_BOOLEAN:
+                slot->scalar.b = (short)json_object_get_boolean(val);
+                slot->value = &slot->scalar.b;
+                slot->length = sizeof(short);
+                break;
+            case SCHEMA_STRING:
+                slot->value = json_object_get_string(val);
+                slot->length = (int)strlen((const char*)slot->value) + 1;
+                break;
+        }
+        total += sizeof(int) * 2 + (size_t)slot->length;
+        count++;
+        cursor++;
+    }
+    for (; cursor < s->length; cursor++) {
+        if (s->fields[cursor].required) {
+            return 0;
+        }
+    }
+
+    if (total > *capacity) {
+        unsigned char* grown = realloc(*buffer, total);
+        if (grown == NULL) {
+            return -1;
+        }
+        *buffer = grown;
+        *capacity = total;
+    }
+
+    // tlv_box keeps its fields newest first, so emit them in reverse to
+    // produce the same bytes as tlv_box_serialize.
+    unsigned char* out = *buffer;
+    for (size_t n = count; n-- > 0;) {
+        schema_slot* slot = &s->slots[n];
+        memcpy(out, &s->fields[slot->field].tag, sizeof(int));
+        out += sizeof(int);
+        memcpy(out, &slot->length, sizeof(int));
+        out += sizeof(int);
+        memcpy(out, slot->value, (size_t)slot->length);
+        out += slot->length;
+    }
+    return (int)total;
+}
+
+int schema_decode(schema* s, const unsigned char* buffer, int size,
+                  schema_value* values) {
+    for (size_t i = 0; i < s->length; i++) {
+        values[i].present = false;
+    }
+
+    // Fields are stored in reverse schema order; walk the schema backwards.
+    size_t cursor = s->length;
+    int offset = 0;
+    while (offset < size) {
+        if (size - offset < (int)sizeof(int) * 2) {
+            return -1;
+        }
+        int type, length;
+        memcpy(&type, buffer + offset, sizeof(int));
+        memcpy(&length, buffer + offset + sizeof(int), sizeof(int));
+        offset += sizeof(int) * 2;
+        if (length < 0 || length > size - offset) {
+            return -1;
+        }
+
+        while (cursor > 0 && s->fields[cursor - 1].tag != type) {
+            if (s->fields[cursor - 1].required) {
+                return -1;
+            }
+            cursor--;
+        }
+        if (cursor == 0) {
+            return -1;
+        }
+        cursor--;
+
+        const unsigned char* value = buffer + offset;
+        schema_value* out = &values[cursor];
+        switch (s->fields[cursor].type) {
+            case SCHEMA_INT:
+                if (length != sizeof(int)) {
+                    return -1;
+                }
+                memcpy(&out->i, value, sizeof(int));
+                break;
+            case SCHEMA_BOOLEAN: {
+                short b;
+                if (length != sizeof(short)) {
+                    return -1;
+                }
+                memcpy(&b, value, sizeof(short));
+                out->b = b != 0;
+                break;
+            }
+            case SCHEMA_STRING:
+                if (length == 0 || value[length - 1] != '\0') {
+                    return -1;
+                }
+                out->s = (const char*)value;
+                break;
+        }
+        out->length = length;
+        out->present = true;
+        offset += length;
+    }
+    while (cursor > 0) {
+        if (s->fields[--cursor].required) {
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,79 @@
+// Fixed-layout record codec inferred from a sample of JSONL records.
+//
+// When every record carries the same keys with the same types, the field
+// order and headers of the TLV encoding are known ahead of time. A schema
+// learns them from the first records of the input and then encodes matching
+// records straight into a byte buffer, without building a tlv_box. The bytes
+// produced are identical to those of tlv_box_serialize, so readers can't tell
+// which path wrote a record.
+
+#ifndef _schema_H
+#define _schema_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <json-c/json.h>
+
+#include "hashtable.h"
+
+// Field types the fixed-layout codec can encode.
+typedef enum {
+    SCHEMA_INT,      // json_type_int, encoded as int
+    SCHEMA_BOOLEAN,  // json_type_boolean, encoded as short
+    SCHEMA_STRING,   // json_type_string, encoded NUL-terminated
+} schema_type;
+
+// One field of an inferred schema, in the order keys appear in a record.
+typedef struct {
+    const char* key;   // owned by the schema
+    int tag;           // TLV type written for this key
+    schema_type type;
+    bool required;     // seen in every sampled record
+} schema_field;
+
+// Field value filled in by schema_decode. Strings point into the buffer.
+typedef struct {
+    bool present;
+    int i;
+    bool b;
+    const char* s;
+    int length;        // bytes of s, including the NUL
+} schema_value;
+
+// Schema structure: create with schema_create, free with schema_destroy.
+typedef struct schema schema;
+
+// Create empty schema and return pointer to it, or NULL if out of memory.
+schema* schema_create(void);
+
+// Free memory allocated for schema, including copied keys.
+void schema_destroy(schema* s);
+
+// Add one sampled record to the schema. Return false if the record can't
+// be described by a fixed layout: records with nested values are skipped,
+// while a key seen with conflicting types makes the schema unusable.
+bool schema_observe(schema* s, struct json_object* record);
+
+// Finish inference and look up each key's tag in tags (values are int*,
+// as maintained by the converter). Return true if the schema is usable.
+bool schema_finalize(schema* s, hashtable* tags);
+
+// Return number of fields, and the fields themselves.
+size_t schema_length(schema* s);
+const schema_field* schema_fields(schema* s);
+
+// Encode record with the fixed layout into *buffer, growing it (and
+// *capacity) as needed. Return number of bytes written, 0 if the record
+// doesn't match the schema (caller falls back to the generic path), or
+// -1 if out of memory.
+int schema_encode(schema* s, struct json_object* record,
+                  unsigned char** buffer, size_t* capacity);
+
+// Decode one record encoded by schema_encode (or tlv_box_serialize) into
+// values, which must have schema_length entries. Return 0 on success, -1
+// if the buffer doesn't follow the schema's layout.
+int schema_decode(schema* s, const unsigned char* buffer, int size,
+                  schema_value* values);
+
+#endif // _schema_H
@@ -0,0 +1,359 @@
+#define _GNU_SOURCE // accept4
+#include "server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define SERVER_EVENTS 64
+
+// One client.
+typedef struct connection {
+    int fd;
+    char* in;               // received, not yet converted: [0, in_size)
+    size_t in_size;
+    size_t in_capacity;
+    size_t scanned;         // bytes of in known to hold no newline
+    unsigned char* out;     // replies not yet sent: [out_start, out_size)
+    size_t out_start;
+    size_t out_size;
+    size_t out_capacity;
+    size_t known;           // tags 1..known have been sent as key frames
+    bool eof;               // the client shut down its side
+    struct connection* prev;
+    struct connection* next;
+} connection;
+
+struct server {
+    char* path;
+    int listener;
+    int epoll;
+    int reserve;            // spare descriptor, spent to turn away a client
+    converter* conv;
+    char** names;           // keys by tag - 1, copied from the dictionary
+    size_t name_count;
+    unsigned char* record;
+    size_t record_capacity;
+    connection* connections;
+};
+
+server* server_open(const char* path, converter* conv) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    strcpy(address.sun_path, path);
+
+    server* s = calloc(1, sizeof(server));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->conv = conv;
+    s->epoll = -1;
+    s->reserve = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    s->listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s->listener < 0) {
+        if (s->reserve >= 0) {
+            close(s->reserve);
+        }
+        free(s);
+        return NULL;
+    }
+    // A socket file left by a server that didn't shut down is in the way.
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    if (bind(s->listener, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        server_close(s);
+        return NULL;
+    }
+    s->path = strdup(path);
+    struct epoll_event event = { .events = EPOLLIN | EPOLLET, .data.ptr = NULL };
+    if (s->path == NULL || listen(s->listener, SOMAXCONN) != 0 ||
+        (s->epoll = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        epoll_ctl(s->epoll, EPOLL_CTL_ADD, s->listener, &event) != 0) {
+        unlink(path);
+        server_close(s);
+        return NULL;
+    }
+    return s;
+}
+
+static void drop(server* s, connection* c) {
+    close(c->fd);
+    if (c->prev != NULL) {
+        c->prev->next = c->next;
+    } else {
+        s->connections = c->next;
+    }
+    if (c->next != NULL) {
+        c->next->prev = c->prev;
+    }
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+void server_close(server* s) {
+    while (s->connections != NULL) {
+        drop(s, s->connections);
+    }
+    if (s->epoll >= 0) {
+        close(s->epoll);
+    }
+    close(s->listener);
+    if (s->reserve >= 0) {
+        close(s->reserve);
+    }
+    if (s->path != NULL) {
+        unlink(s->path);
+    }
+    for (size_t i = 0; i < s->name_count; i++) {
+        free(s->names[i]);
+    }
+    free(s->names);
+    free(s->record);
+    free(s->path);
+    free(s);
+}
+
+// Accept every pending connection. The listener is edge-triggered, so one
+// left pending isn't reported again until another arrives: out of
+// descriptors, the reserve one is spent to accept it and hang up.
+static void accept_all(server* s) {
+    for (;;) {
+        int fd = accept4(s->listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if ((errno != EMFILE && errno != ENFILE) || s->reserve < 0) {
+                return;  // EAGAIN
+            }
+            close(s->reserve);
+            fd = accept4(s->listener, NULL, NULL, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                close(fd);
+            }
+            s->reserve = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                return;
+            }
+            continue;
+        }
+        connection* c = calloc(1, sizeof(connection));
+        struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = c };
+        if (c == NULL || epoll_ctl(s->epoll, EPOLL_CTL_ADD, fd, &event) != 0) {
+            free(c);
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->next = s->connections;
+        if (c->next != NULL) {
+            c->next->prev = c;
+        }
+        s->connections = c;
+    }
+}
+
+// Queue one reply frame.
+static bool reply(connection* c, int type, const void* value, size_t size) {
+    size_t needed = 2 * sizeof(int) + size;
+    if (c->out_capacity - c->out_size < needed) {
+        if (c->out_start > 0) {
+            memmove(c->out, c->out + c->out_start, c->out_size - c->out_start);
+            c->out_size -= c->out_start;
+            c->out_start = 0;
+        }
+        size_t capacity = c->out_capacity > 0 ? c->out_capacity : SERVER_READ_SIZE;
+        while (capacity - c->out_size < needed) {
+            capacity *= 2;
+        }
+        if (capacity != c->out_capacity) {
+            unsigned char* grown = realloc(c->out, capacity);
+            if (grown == NULL) {
+                return false;
+            }
+            c->out = grown;
+            c->out_capacity = capacity;
+        }
+    }
+    int header[2] = { type, (int)size };
+    memcpy(c->out + c->out_size, header, sizeof(header));
+    if (size > 0) {
+        memcpy(c->out + c->out_size + sizeof(header), value, size);
+    }
+    c->out_size += needed;
+    return true;
+}
+
+// Copy the keys of tags assigned since the last call.
+static bool learn_names(server* s) {
+    size_t tags = s->conv->counter - 1;
+    if (tags == s->name_count) {
+        return true;
+    }
+    char** grown = realloc(s->names, tags * sizeof(char*));
+    if (grown == NULL) {
+        return false;
+    }
+    s->names = grown;
+    memset(s->names + s->name_count, 0, (tags - s->name_count) * sizeof(char*));
+    hashtablei it = hashtable_iterator(s->conv->key_hashtable);
+    while (hashtable_next(&it)) {
+        int tag = *(int*)it.value;
+        if ((size_t)tag > s->name_count && (size_t)tag <= tags &&
+            (s->names[tag - 1] = strdup(it.key)) == NULL) {
+            return false;
+        }
+    }
+    s->name_count = tags;
+    return true;
+}
+
+// Convert one NUL-terminated line and queue its replies.
+static bool convert(server* s, connection* c, const char* line) {
+    int size = converter_encode_line(s->conv, line, &s->record, &s->record_capacity);
+    if (size == CONVERT_SKIPPED) {
+        return reply(c, SERVER_FRAME_SKIPPED, NULL, 0);
+    }
+    if (size < 0 || !learn_names(s)) {
+        return false;
+    }
+    for (; c->known < s->name_count; c->known++) {
+        const char* name = s->names[c->known] != NULL ? s->names[c->known] : "";
+        size_t length = strlen(name) + 1;
+        char entry[sizeof(int) + 256];
+        char* value = length <= sizeof(entry) - sizeof(int) ? entry : malloc(sizeof(int) + length);
+        if (value == NULL) {
+            return false;
+        }
+        int tag = (int)c->known + 1;
+        memcpy(value, &tag, sizeof(int));
+        memcpy(value + sizeof(int), name, length);
+        bool queued = reply(c, SERVER_FRAME_KEY, value, sizeof(int) + length);
+        if (value != entry) {
+            free(value);
+        }
+        if (!queued) {
+            return false;
+        }
+    }
+    return reply(c, SERVER_FRAME_RECORD, s->record, size);
+}
+
+// Convert the complete lines received, and the rest too at end of input.
+static bool convert_lines(server* s, connection* c) {
+    size_t start = 0;
+    char* newline;
+    while ((newline = memchr(c->in + c->scanned, '\n', c->in_size - c->scanned)) != NULL) {
+        // Terminate the line after its newline, as getline would.
+        size_t end = newline - c->in + 1;
+        char saved = c->in[end];
+        c->in[end] = '\0';
+        bool converted = convert(s, c, c->in + start);
+        c->in[end] = saved;
+        if (!converted) {
+            return false;
+        }
+        start = c->scanned = end;
+    }
+    if (c->eof && start < c->in_size) {
+        c->in[c->in_size] = '\0';
+        if (!convert(s, c, c->in + start)) {
+            return false;
+        }
+        start = c->in_size;
+    }
+    memmove(c->in, c->in + start, c->in_size - start);
+    c->in_size -= start;
+    c->scanned = c->in_size;
+    return true;
+}
+
+// Send queued replies until done or the socket is full. Return false if
+// the client is gone.
+static bool send_replies(connection* c) {
+    while (c->out_start < c->out_size) {
+        ssize_t n = send(c->fd, c->out + c->out_start, c->out_size - c->out_start, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        c->out_start += n;
+    }
+    c->out_start = c->out_size = 0;
+    return true;
+}
+
+// Read, convert and reply until the socket runs dry, or replies back up.
+// Being edge-triggered, the loop only stops where epoll will report the
+// next change. Return false when the connection is done with.
+static bool serve(server* s, connection* c) {
+    for (;;) {
+        if (!send_replies(c)) {
+            return false;
+        }
+        bool backlog = c->out_size - c->out_start >= SERVER_MAX_PENDING;
+        if (c->eof || backlog) {
+            // Keep going when the socket empties; close when all is sent.
+            return !(c->eof && c->out_start == c->out_size);
+        }
+        if (c->in_capacity - c->in_size < SERVER_READ_SIZE / 2) {
+            size_t capacity = c->in_capacity > 0 ? c->in_capacity * 2 : SERVER_READ_SIZE;
+            char* grown = realloc(c->in, capacity);
+            if (grown == NULL) {
+                return false;
+            }
+            c->in = grown;
+            c->in_capacity = capacity;
+        }
+        // Leave room to terminate the last line.
+        ssize_t n = read(c->fd, c->in + c->in_size, c->in_capacity - c->in_size - 1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        c->in_size += n;
+        c->eof = n == 0;
+        if (!convert_lines(s, c)) {
+            return false;
+        }
+    }
+}
+
+int server_run(server* s, volatile sig_atomic_t* stop) {
+    struct epoll_event events[SERVER_EVENTS];
+    while (!*stop) {
+        int n = epoll_wait(s->epoll, events, SERVER_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            connection* c = events[i].data.ptr;
+            if (c == NULL) {
+                accept_all(s);
+            } else if ((events[i].events & EPOLLERR) || !serve(s, c)) {
+                drop(s, c);
+            }
+        }
+    }
+    return 0;
+}
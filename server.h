@@ -0,0 +1,44 @@
+// Conversion server on a Unix domain socket.
+//
+// Clients connect, send newline-delimited JSON, and read back one frame per
+// line, in order, laid out like a TLV field: [int type][int length][value].
+// A record frame carries the line's TLV record, and a skipped frame (empty)
+// stands for a line that isn't a JSON object. All connections share one
+// dictionary; ahead of each record, a connection gets a key frame for every
+// tag assigned since it was last sent one: the tag as an int, then the
+// key, NUL-terminated. Clients may send any number of lines ahead of the
+// replies. A line left unterminated when the client shuts down its side is
+// converted as the last one, and the server then closes the connection once
+// every reply is written.
+//
+// One thread serves every connection from an edge-triggered epoll loop.
+
+#ifndef _server_H
+#define _server_H
+
+#include <signal.h>
+
+#include "convert.h"
+
+#define SERVER_FRAME_RECORD 0
+#define SERVER_FRAME_KEY 1
+#define SERVER_FRAME_SKIPPED 2
+
+#define SERVER_READ_SIZE (64 * 1024)
+#define SERVER_MAX_PENDING (4 * 1024 * 1024)  // replies queued before reading stops
+
+// Server: open with server_open, free with server_close.
+typedef struct server server;
+
+// Listen on a Unix domain socket at path, replacing a stale socket file,
+// converting with conv. Return NULL on error (errno set).
+server* server_open(const char* path, converter* conv);
+
+// Serve connections until *stop is set by a signal handler. Return 0 when
+// stopped, -1 on error.
+int server_run(server* s, volatile sig_atomic_t* stop);
+
+// Close every connection and the socket, remove the socket file and free s.
+void server_close(server* s);
+
+#endif // _server_H
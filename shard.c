@@ -0,0 +1,279 @@
+#include "shard.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "block.h"
+#include "crc32c.h"
+
+#define MANIFEST_VERSION 1
+
+// Records [first, end) of the input, in input order.
+typedef struct {
+    uint64_t first;
+    uint64_t end;
+} shard_range;
+
+// One output file.
+typedef struct {
+    char* path;
+    FILE* file;
+    block_writer* blocks;   // or NULL without -b
+    uint64_t records;
+    uint64_t bytes;
+    uint32_t crc;           // of the file contents
+    shard_range* ranges;
+    size_t range_count;
+    size_t range_capacity;
+} shard;
+
+struct shard_set {
+    char* base;
+    shard* shards;
+    size_t count;
+    int key_tag;
+    uint64_t records;       // records written to all shards
+    bool failed;
+};
+
+// block_sink appending to a shard file and its checksum.
+static int shard_file_write(void* ctx, const void* data, size_t size) {
+    shard* s = ctx;
+    if (fwrite(data, 1, size, s->file) != size) {
+        return -1;
+    }
+    s->crc = crc32c_update(s->crc, data, size);
+    s->bytes += size;
+    return 0;
+}
+
+// Return "<base><suffix>", or NULL if out of memory.
+static char* path_with(const char* base, const char* suffix) {
+    char* path = malloc(strlen(base) + strlen(suffix) + 1);
+    if (path != NULL) {
+        strcpy(path, base);
+        strcat(path, suffix);
+    }
+    return path;
+}
+
+static void shard_set_free(shard_set* set) {
+    for (size_t i = 0; i < set->count; i++) {
+        shard* s = &set->shards[i];
+        if (s->blocks != NULL) {
+            block_writer_destroy(s->blocks);
+        }
+        if (s->file != NULL) {
+            fclose(s->file);
+        }
+        free(s->path);
+        free(s->ranges);
+    }
+    free(set->shards);
+    free(set->base);
+    free(set);
+}
+
+shard_set* shard_open(const char* base, size_t shards, size_t block_size, int key_tag) {
+    shard_set* set = calloc(1, sizeof(shard_set));
+    if (set == NULL) {
+        return NULL;
+    }
+    set->key_tag = key_tag;
+    set->base = path_with(base, "");
+    set->shards = calloc(shards, sizeof(shard));
+    if (set->base == NULL || set->shards == NULL) {
+        shard_set_free(set);
+        return NULL;
+    }
+    for (; set->count < shards; set->count++) {
+        shard* s = &set->shards[set->count];
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), ".%zu", set->count);
+        s->path = path_with(base, suffix);
+        if (s->path == NULL || (s->file = fopen(s->path, "wb")) == NULL ||
+            (block_size > 0 && (s->blocks = block_writer_create(shard_file_write, s, block_size)) == NULL)) {
+            set->count++;
+            shard_set_free(set);
+            return NULL;
+        }
+    }
+    return set;
+}
+
+// Return the shard for a record: by the CRC-32C of its key field's value,
+// or by its run.
+static size_t pick_shard(shard_set* set, const unsigned char* record, size_t size) {
+    if (set->key_tag == 0) {
+        return set->records / SHARD_RUN % set->count;
+    }
+    size_t offset = 0;
+    while (offset + 2 * sizeof(int) <= size) {
+        int header[2];
+        memcpy(header, record + offset, sizeof(header));
+        offset += sizeof(header);
+        if (header[1] < 0 || (size_t)header[1] > size - offset) {
+            break;
+        }
+        if (header[0] == set->key_tag) {
+            return crc32c(record + offset, header[1]) % set->count;
+        }
+        offset += header[1];
+    }
+    return 0;
+}
+
+// Add record number n to the ranges of s.
+static bool add_to_range(shard* s, uint64_t n) {
+    if (s->range_count > 0 && s->ranges[s->range_count - 1].end == n) {
+        s->ranges[s->range_count - 1].end++;
+        return true;
+    }
+    if (s->range_count == s->range_capacity) {
+        size_t capacity = s->range_capacity > 0 ? s->range_capacity * 2 : 16;
+        shard_range* grown = realloc(s->ranges, capacity * sizeof(shard_range));
+        if (grown == NULL) {
+            return false;
+        }
+        s->ranges = grown;
+        s->range_capacity = capacity;
+    }
+    s->ranges[s->range_count++] = (shard_range){ n, n + 1 };
+    return true;
+}
+
+int shard_write(void* ctx, const void* record, size_t size) {
+    shard_set* set = ctx;
+    shard* s = &set->shards[pick_shard(set, record, size)];
+    int result = s->blocks != NULL ? block_writer_add(s->blocks, record, size)
+                                   : shard_file_write(s, record, size);
+    if (result != 0 || !add_to_range(s, set->records)) {
+        set->failed = true;
+        return -1;
+    }
+    s->records++;
+    set->records++;
+    return 0;
+}
+
+// Write s as a JSON string.
+static void write_json_string(FILE* out, const char* s) {
+    fputc('"', out);
+    for (; *s != '\0'; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// Write the dictionary in tag order. Its version is the number of tags:
+// tags are only ever added, so dictionaries of the same version agree.
+// The checksum covers the keys in tag order, NUL-terminated.
+static bool write_dictionary(FILE* out, const converter* conv) {
+    size_t tags = conv->counter - 1;
+    const char** keys = calloc(tags + 1, sizeof(char*));
+    if (keys == NULL) {
+        return false;
+    }
+    hashtablei it = hashtable_iterator(conv->key_hashtable);
+    while (hashtable_next(&it)) {
+        int tag = *(int*)it.value;
+        if (tag >= 1 && (size_t)tag <= tags) {
+            keys[tag - 1] = it.key;
+        }
+    }
+    uint32_t crc = 0;
+    for (size_t i = 0; i < tags; i++) {
+        if (keys[i] != NULL) {
+            crc = crc32c_update(crc, keys[i], strlen(keys[i]) + 1);
+        }
+    }
+    fprintf(out, "  \"dictionary\": {\n    \"version\": %zu,\n    \"crc32c\": \"%08x\",\n    \"keys\": [",
+            tags, crc);
+    for (size_t i = 0; i < tags; i++) {
+        fprintf(out, "%s\n      [%zu, ", i > 0 ? "," : "", i + 1);
+        write_json_string(out, keys[i] != NULL ? keys[i] : "");
+        fputc(']', out);
+    }
+    fprintf(out, "%s]\n  },\n", tags > 0 ? "\n    " : "");
+    free(keys);
+    return true;
+}
+
+static bool write_manifest(FILE* out, shard_set* set, const converter* conv, const char* shard_key) {
+    fprintf(out, "{\n  \"version\": %d,\n  \"records\": %llu,\n  \"shard_key\": ",
+            MANIFEST_VERSION, (unsigned long long)set->records);
+    if (shard_key != NULL) {
+        write_json_string(out, shard_key);
+    } else {
+        fputs("null", out);
+    }
+    fprintf(out, ",\n  \"blocks\": %s,\n", set->shards[0].blocks != NULL ? "true" : "false");
+    if (!write_dictionary(out, conv)) {
+        return false;
+    }
+    fputs("  \"shards\": [", out);
+    for (size_t i = 0; i < set->count; i++) {
+        shard* s = &set->shards[i];
+        // Shards are listed by file name, relative to the manifest.
+        const char* name = strrchr(s->path, '/');
+        name = name != NULL ? name + 1 : s->path;
+        fprintf(out, "%s\n    {\"file\": ", i > 0 ? "," : "");
+        write_json_string(out, name);
+        fprintf(out, ", \"records\": %llu, \"bytes\": %llu, \"crc32c\": \"%08x\", \"ranges\": [",
+                (unsigned long long)s->records, (unsigned long long)s->bytes, s->crc);
+        for (size_t r = 0; r < s->range_count; r++) {
+            fprintf(out, "%s[%llu, %llu]", r > 0 ? ", " : "",
+                    (unsigned long long)s->ranges[r].first, (unsigned long long)s->ranges[r].end);
+        }
+        fputs("]}", out);
+    }
+    fputs("\n  ]\n}\n", out);
+    return true;
+}
+
+int shard_close(shard_set* set, const converter* conv, const char* shard_key) {
+    int result = set->failed ? -1 : 0;
+    for (size_t i = 0; i < set->count; i++) {
+        shard* s = &set->shards[i];
+        if (s->blocks != NULL && block_writer_flush(s->blocks) != 0) {
+            result = -1;
+        }
+        if (fclose(s->file) != 0) {
+            result = -1;
+        }
+        s->file = NULL;
+    }
+
+    // Write the manifest aside and rename it into place, so readers see
+    // either the previous one or the complete new one.
+    char* path = path_with(set->base, ".manifest");
+    char* temp = path_with(set->base, ".manifest.tmp");
+    FILE* out = path != NULL && temp != NULL && result == 0 ? fopen(temp, "w") : NULL;
+    if (out == NULL) {
+        result = -1;
+    } else {
+        bool written = write_manifest(out, set, conv, shard_key);
+        if (fflush(out) != 0 || fsync(fileno(out)) != 0) {
+            written = false;
+        }
+        if (fclose(out) != 0 || !written || rename(temp, path) != 0) {
+            remove(temp);
+            result = -1;
+        }
+    }
+    free(path);
+    free(temp);
+    shard_set_free(set);
+    return result;
+}
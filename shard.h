@@ -0,0 +1,40 @@
+// Sharded output with a manifest.
+//
+// Records are spread over several files, either in runs of consecutive
+// records rotating through the shards, or by a hash of one key's value so
+// equal values land in the same shard. A JSON manifest written next to the
+// shards lists each one's file, record count, record ranges (in input
+// order), size and CRC-32C, along with the key dictionary. Readers can
+// then take shards in parallel without coordinating.
+//
+// Shards are named <base>.<n> and the manifest <base>.manifest.
+
+#ifndef _shard_H
+#define _shard_H
+
+#include <stddef.h>
+
+#include "convert.h"
+
+#define SHARD_RUN 65536  // consecutive records per shard, without a key
+
+// Shard set: open with shard_open, finish with shard_close.
+typedef struct shard_set shard_set;
+
+// Create shards files named after base. Records go into checksummed
+// blocks of about block_size bytes if it is nonzero. If key_tag is
+// nonzero, records are sharded by the value of their field with that tag
+// (records without one go to shard 0); otherwise in runs of SHARD_RUN.
+// Return NULL on error (errno set).
+shard_set* shard_open(const char* base, size_t shards, size_t block_size, int key_tag);
+
+// block_sink and pipeline_sink writing one record to the shard set passed
+// as ctx. Return 0 on success, -1 on error.
+int shard_write(void* ctx, const void* record, size_t size);
+
+// Flush and close every shard, then write the manifest, with the
+// dictionary of conv and shard_key (NULL without one), and free the set.
+// The manifest is replaced atomically. Return 0 on success, -1 on error.
+int shard_close(shard_set* set, const converter* conv, const char* shard_key);
+
+#endif // _shard_H
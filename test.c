@@ -0,0 +1,1432 @@
+// Tests of the converter's modules, in the manner of TLV/test.c:
+//
+//     cc -O2 test.c aio.c bhashtable.c block.c checkpoint.c convert.c crc32c.c
+//         decompress.c direct.c durable.c hashtable.c histogram.c jsonstream.c
+//         mapped.c projection.c ring.c schema.c shard.c trace.c worksteal.c
+//         TLV/tlv_box.c TLV/key_list.c -o test -ljson-c -lpthread
+//
+// Add -DHAVE_ZLIB and -lz to test gzip input as well. Each section prints
+// its result, and the first failure exits non-zero.
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "aio.h"
+#include "bhashtable.h"
+#include "block.h"
+#include "checkpoint.h"
+#include "convert.h"
+#include "crc32c.h"
+#include "decompress.h"
+#include "direct.h"
+#include "histogram.h"
+#include "durable.h"
+#include "hashtable.h"
+#include "jsonstream.h"
+#include "mapped.h"
+#include "projection.h"
+#include "ring.h"
+#include "schema.h"
+#include "shard.h"
+#include "worksteal.h"
+#include "TLV/tlv_box.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#define LOG(format, ...) printf(format, ##__VA_ARGS__)
+
+#define TEST_FILE "test_blocks.bin"
+
+// Return the contents of path, setting *size; NULL on error.
+static unsigned char* read_file(const char* path, size_t* size) {
+    FILE* in = fopen(path, "rb");
+    if (in == NULL) {
+        return NULL;
+    }
+    fseek(in, 0, SEEK_END);
+    *size = (size_t)ftell(in);
+    rewind(in);
+    unsigned char* data = malloc(*size);
+    if (data != NULL && fread(data, 1, *size, in) != *size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(in);
+    return data;
+}
+
+// Number of slots in table: where an exhausted iterator stops.
+static size_t capacity_of(hashtable* table) {
+    hashtablei it = hashtable_iterator(table);
+    while (hashtable_next(&it)) {
+    }
+    return it._index;
+}
+
+// Home slot of key in a table of capacity slots, as hashtable.c hashes it.
+static size_t home_slot(const char* key, size_t capacity) {
+    uint64_t hash = 14695981039346656037UL;
+    for (const char* p = key; *p; p++) {
+        hash ^= (unsigned char)*p;
+        hash *= 1099511628211UL;
+    }
+    return (size_t)(hash & (capacity - 1));
+}
+
+// Return true if table maps each of keys[0..n) to &values[i] when present[i]
+// is set, and doesn't have it otherwise.
+static bool holds(hashtable* table, char keys[][16], int* values, const bool* present, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (hashtable_get(table, keys[i]) != (present[i] ? &values[i] : NULL)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Case-insensitive hash and comparison, for bhashtable's callbacks.
+static uint64_t hash_folded(const void* key, size_t size) {
+    uint64_t hash = 5381;
+    for (size_t i = 0; i < size; i++) {
+        hash = hash * 33 + (unsigned char)tolower(((const unsigned char*)key)[i]);
+    }
+    return hash;
+}
+
+static bool equal_folded(const void* a, size_t a_size, const void* b, size_t b_size) {
+    if (a_size != b_size) {
+        return false;
+    }
+    for (size_t i = 0; i < a_size; i++) {
+        if (tolower(((const unsigned char*)a)[i]) != tolower(((const unsigned char*)b)[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// What a jsonstream reported: fields of complete records, and errors.
+typedef struct {
+    char fields[256];
+    size_t length;
+    size_t record_start;  // length when the current record began
+    int records;
+    int errors;
+} stream_log;
+
+static int log_field(void* ctx, const char* key, const jsonstream_value* value) {
+    stream_log* log = ctx;
+    char field[64];
+    if (value->type == JSONSTREAM_INT) {
+        snprintf(field, sizeof(field), "%.8s/%zu=%lld ", key, strlen(key), value->i);
+    } else {
+        snprintf(field, sizeof(field), "%.8s/%zu ", key, strlen(key));
+    }
+    size_t n = strlen(field);
+    if (log->length + n < sizeof(log->fields)) {
+        memcpy(log->fields + log->length, field, n + 1);
+        log->length += n;
+    }
+    return 0;
+}
+
+// Log a field, rejecting the record if it already gave key, as -m does.
+static int log_unique_field(void* ctx, const char* key, const jsonstream_value* value) {
+    stream_log* log = ctx;
+    size_t n = strlen(key);
+    for (const char* p = log->fields + log->record_start; (p = strstr(p, key)) != NULL; p++) {
+        if ((p == log->fields + log->record_start || p[-1] == ' ') && p[n] == '/') {
+            log->length = log->record_start;
+            log->fields[log->length] = '\0';
+            return JSONSTREAM_MALFORMED;
+        }
+    }
+    return log_field(ctx, key, value);
+}
+
+static int log_record_end(void* ctx) {
+    stream_log* log = ctx;
+    log->records++;
+    log->record_start = log->length;
+    return 0;
+}
+
+static int log_record_error(void* ctx) {
+    stream_log* log = ctx;
+    log->errors++;
+    log->record_start = log->length;
+    return 0;
+}
+
+// Verify size bytes of data as a block file.
+static int verify(unsigned char* data, size_t size, block_verification* v) {
+    FILE* in = fmemopen(data, size, "rb");
+    if (in == NULL) {
+        return -2;
+    }
+    int result = block_verify(in, v);
+    fclose(in);
+    return result;
+}
+
+#define RING_ITEMS 200000   // items per producer
+#define RING_THREADS 4       // producers, and consumers, of the MPMC test
+
+// Item i of producer p, never NULL.
+static void* ring_item(size_t p, size_t i) {
+    return (void*)(uintptr_t)((p << 32 | i) + 1);
+}
+
+typedef struct {
+    void* ring;              // spsc_ring or mpmc_ring
+    size_t producer;
+    size_t popped;
+    size_t next[RING_THREADS];  // consumers: next item expected of each producer
+    bool ordered;
+} ring_side;
+
+static _Atomic unsigned char ring_seen[RING_THREADS][RING_ITEMS];  // pops of each item
+
+// Push RING_ITEMS items in batches of 1 to 7.
+static void* spsc_produce(void* arg) {
+    ring_side* side = arg;
+    void* batch[7];
+    for (size_t i = 0, n; i < RING_ITEMS; i += n) {
+        n = i % 7 + 1 < RING_ITEMS - i ? i % 7 + 1 : RING_ITEMS - i;
+        for (size_t k = 0; k < n; k++) {
+            batch[k] = ring_item(side->producer, i + k);
+        }
+        spsc_ring_push_wait(side->ring, batch, n);
+    }
+    spsc_ring_close(side->ring);
+    return NULL;
+}
+
+static void* mpmc_produce(void* arg) {
+    ring_side* side = arg;
+    void* batch[7];
+    for (size_t i = 0, n; i < RING_ITEMS; i += n) {
+        n = i % 7 + 1 < RING_ITEMS - i ? i % 7 + 1 : RING_ITEMS - i;
+        for (size_t k = 0; k < n; k++) {
+            batch[k] = ring_item(side->producer, i + k);
+        }
+        mpmc_ring_push_wait(side->ring, batch, n);
+    }
+    return NULL;
+}
+
+// Pop until the ring closes, checking each producer's items come in order.
+static void* ring_consume(void* arg, size_t (*pop_wait)(void*, void**, size_t)) {
+    ring_side* side = arg;
+    void* batch[5];
+    size_t n;
+    side->ordered = true;
+    while ((n = pop_wait(side->ring, batch, 5)) > 0) {
+        for (size_t k = 0; k < n; k++) {
+            uintptr_t item = (uintptr_t)batch[k] - 1;
+            size_t p = item >> 32, i = item & 0xffffffff;
+            if (p >= RING_THREADS || i >= RING_ITEMS || i < side->next[p]) {
+                side->ordered = false;
+                continue;
+            }
+            atomic_fetch_add(&ring_seen[p][i], 1);
+            side->next[p] = i + 1;
+        }
+        side->popped += n;
+    }
+    return NULL;
+}
+
+static size_t spsc_pop_wait(void* ring, void** items, size_t n) {
+    return spsc_ring_pop_wait(ring, items, n);
+}
+
+static size_t mpmc_pop_wait(void* ring, void** items, size_t n) {
+    return mpmc_ring_pop_wait(ring, items, n);
+}
+
+static void* spsc_consume(void* arg) {
+    return ring_consume(arg, spsc_pop_wait);
+}
+
+static void* mpmc_consume(void* arg) {
+    return ring_consume(arg, mpmc_pop_wait);
+}
+
+#define WS_LEAVES 100000  // tasks run by each work-stealing test
+#define WS_FANOUTS 10     // tasks spawning WS_LEAVES / WS_FANOUTS each
+
+// Task covering the leaves [lo, hi).
+typedef struct {
+    ws_task task;
+    size_t lo, hi;
+} range_task;
+
+static range_task ws_tasks[WS_LEAVES];  // the task starting at each leaf
+static _Atomic unsigned char ws_runs[WS_LEAVES];
+
+static void run_range(ws_task* task, ws_worker* worker);
+
+static void spawn_range(ws_worker* worker, size_t lo, size_t hi) {
+    ws_tasks[lo] = (range_task){ { run_range }, lo, hi };
+    if (!ws_spawn(worker, &ws_tasks[lo].task)) {
+        run_range(&ws_tasks[lo].task, worker);
+    }
+}
+
+// Spawn the upper half until one leaf is left, and run it.
+static void run_range(ws_task* task, ws_worker* worker) {
+    range_task* r = (range_task*)task;
+    size_t lo = r->lo, hi = r->hi;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        spawn_range(worker, mid, hi);
+        hi = mid;
+    }
+    atomic_fetch_add(&ws_runs[lo], 1);
+}
+
+// Spawn every leaf of the range at once, growing the worker's deque while
+// the others steal from it.
+static void run_fanout(ws_task* task, ws_worker* worker) {
+    range_task* r = (range_task*)task;
+    for (size_t i = r->lo; i < r->hi; i++) {
+        spawn_range(worker, i, i + 1);
+    }
+}
+
+#define WRITE_SIZE (3 << 20)  // bytes written through each output writer
+
+// Fill data with lines of lowercase letters, of pseudo-random lengths.
+static void fill_lines(unsigned char* data, size_t size) {
+    uint32_t x = 12345;
+    for (size_t i = 0; i < size; i++) {
+        x = x * 1103515245 + 12345;
+        data[i] = (x >> 16) % 64 == 0 ? '\n' : 'a' + (x >> 16) % 26;
+    }
+}
+
+// Write data through sink in pieces of 1 to 5000 bytes. Return 0 on success.
+static int write_pieces(int (*sink)(void*, const void*, size_t), void* ctx,
+                        const unsigned char* data, size_t size) {
+    for (size_t offset = 0, n; offset < size; offset += n) {
+        n = offset * 7919 % 5000 + 1;
+        n = n < size - offset ? n : size - offset;
+        if (sink(ctx, data + offset, n) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Return true if the file at path holds exactly data.
+static bool file_holds(const char* path, const unsigned char* data, size_t size) {
+    size_t read_size;
+    unsigned char* contents = read_file(path, &read_size);
+    bool same = contents != NULL && read_size == size && memcmp(contents, data, size) == 0;
+    free(contents);
+    return same;
+}
+
+// Read every line of reader and return true if together they make data.
+static bool lines_hold(aio_reader* reader, const unsigned char* data, size_t size) {
+    char* line = NULL;
+    size_t capacity = 0, offset = 0;
+    ssize_t n;
+    bool same = true;
+    while ((n = aio_reader_getline(reader, &line, &capacity)) > 0) {
+        same &= offset + n <= size && memcmp(line, data + offset, n) == 0 && line[n] == '\0';
+        offset += n;
+    }
+    free(line);
+    return same && offset == size;
+}
+
+// Writer side of a pipe: data through an aio_writer, then close.
+typedef struct {
+    int fd;
+    const unsigned char* data;
+    size_t size;
+    int result;
+} pipe_writer;
+
+static void* write_pipe(void* arg) {
+    pipe_writer* w = arg;
+    aio_writer* writer = aio_writer_open(w->fd, 0, 4096, 3);
+    w->result = writer == NULL || write_pieces(aio_writer_write, writer, w->data, w->size) != 0;
+    w->result |= writer == NULL || aio_writer_close(writer) != 0;
+    close(w->fd);
+    return NULL;
+}
+
+// Write data to fd, then close it.
+static void* write_raw(void* arg) {
+    pipe_writer* w = arg;
+    size_t offset = 0;
+    ssize_t n = 0;
+    while (offset < w->size && (n = write(w->fd, w->data + offset, w->size - offset)) > 0) {
+        offset += n;
+    }
+    w->result = offset == w->size ? 0 : -1;
+    close(w->fd);
+    return NULL;
+}
+
+// Open the input end of a pipe fed data by a thread, with decompress_open
+// as the converter does. Return NULL on error.
+static FILE* open_piped(pthread_t* thread, pipe_writer* w, const unsigned char* data, size_t size) {
+    int fds[2];
+    char path[32];
+    if (pipe(fds) != 0) {
+        return NULL;
+    }
+    *w = (pipe_writer){ fds[1], data, size, -1 };
+    pthread_create(thread, NULL, write_raw, w);
+    snprintf(path, sizeof(path), "/dev/fd/%d", fds[0]);
+    FILE* in = decompress_open(path);
+    close(fds[0]);
+    return in;
+}
+
+// Return true if reading in to its end gives data.
+static bool stream_holds(FILE* in, const unsigned char* data, size_t size) {
+    unsigned char buffer[65536];
+    size_t offset = 0, n;
+    bool same = true;
+    while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        same &= offset + n <= size && memcmp(buffer, data + offset, n) == 0;
+        offset += n;
+    }
+    return same && offset == size && !ferror(in);
+}
+
+#define HISTOGRAM_THREADS 4
+#define HISTOGRAM_ROUNDS 100  // times each thread records 1..1000
+
+static void* record_values(void* arg) {
+    for (int round = 0; round < HISTOGRAM_ROUNDS; round++) {
+        for (uint64_t value = 1; value <= 1000; value++) {
+            histogram_record(arg, value);
+        }
+    }
+    return NULL;
+}
+
+// Return member name of object as an integer, or -1 if it has none.
+static int64_t member_int(struct json_object* object, const char* name) {
+    struct json_object* member;
+    return json_object_object_get_ex(object, name, &member) ? json_object_get_int64(member) : -1;
+}
+
+int main(void) {
+    {
+        // Durable blocks: a damaged committed block fails verification, a
+        // torn tail after the last commit marker doesn't.
+        durable_writer* durable = durable_open(TEST_FILE, 4096, 1000000);
+        block_writer* blocks = block_writer_create(durable_write, durable, 1024);
+        char record[100];
+        memset(record, 'r', sizeof(record));
+        for (int i = 0; i < 2000; i++) {
+            if (block_writer_add(blocks, record, sizeof(record)) != 0) {
+                LOG("block_writer_add failed !\n");
+                return -1;
+            }
+        }
+        if (block_writer_flush(blocks) != 0 || durable_close(durable) != 0) {
+            LOG("durable_close failed !\n");
+            return -1;
+        }
+        block_writer_destroy(blocks);
+
+        size_t size;
+        unsigned char* data = read_file(TEST_FILE, &size);
+        remove(TEST_FILE);
+        block_verification v;
+        if (data == NULL || verify(data, size, &v) != 0 || v.records != 2000 || v.torn) {
+            LOG("block_verify failed !\n");
+            return -1;
+        }
+
+        data[size / 2] ^= 0x10;
+        if (verify(data, size, &v) != -1 || v.bad_offset == 0 || v.bad_offset > size / 2) {
+            LOG("block_verify damaged block failed !\n");
+            return -1;
+        }
+        data[size / 2] ^= 0x10;
+
+        // Cut into the final marker and the block before it.
+        if (verify(data, size - 200, &v) != 0 || !v.torn || v.records >= 2000) {
+            LOG("block_verify torn tail failed !\n");
+            return -1;
+        }
+        LOG("block_verify success, %zu records committed before a torn tail \n", v.records);
+        free(data);
+    }
+
+    {
+        // Bulk building matches setting the same keys in turn, duplicates
+        // included: the last value wins.
+        size_t n = 200000, distinct = 150000;
+        char** keys = malloc(n * sizeof(char*));
+        size_t* values = malloc(n * sizeof(size_t));
+        hashtable* sequential = hashtable_create();
+        for (size_t i = 0; i < n; i++) {
+            char key[32];
+            snprintf(key, sizeof(key), "key%zu", i % distinct);
+            keys[i] = strdup(key);
+            values[i] = i;
+            hashtable_set(sequential, keys[i], &values[i]);
+        }
+        void** pointers = malloc(n * sizeof(void*));
+        for (size_t i = 0; i < n; i++) {
+            pointers[i] = &values[i];
+        }
+        hashtable* empty = hashtable_bulk_build(NULL, NULL, 0);
+        hashtable* bulk = hashtable_bulk_build((const char* const*)keys, pointers, n);
+        if (empty == NULL || hashtable_length(empty) != 0 ||
+                bulk == NULL || hashtable_length(bulk) != distinct ||
+                hashtable_length(sequential) != distinct) {
+            LOG("hashtable_bulk_build failed !\n");
+            return -1;
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (hashtable_get(bulk, keys[i]) != hashtable_get(sequential, keys[i])) {
+                LOG("hashtable_bulk_build %s failed !\n", keys[i]);
+                return -1;
+            }
+        }
+        LOG("hashtable_bulk_build success, %zu keys \n", hashtable_length(bulk));
+        hashtable_destroy(empty);
+        hashtable_destroy(bulk);
+        hashtable_destroy(sequential);
+        for (size_t i = 0; i < n; i++) {
+            free(keys[i]);
+        }
+        free(keys);
+        free(values);
+        free(pointers);
+    }
+
+    {
+        // Removing from a probe run that wraps past the last slot: fill the
+        // last two slots' run of a 16-slot table, then take keys out in
+        // different orders, checking every key after each removal.
+        char keys[7][16];
+        int values[7];
+        size_t found = 0;
+        for (int i = 0; found < 7; i++) {
+            char key[16];
+            snprintf(key, sizeof(key), "w%d", i);
+            if (home_slot(key, 16) >= 14) {
+                strcpy(keys[found], key);
+                values[found] = i;
+                found++;
+            }
+        }
+        static const size_t orders[3][7] = {
+            { 0, 1, 2, 3, 4, 5, 6 }, { 6, 5, 4, 3, 2, 1, 0 }, { 3, 0, 6, 1, 5, 2, 4 },
+        };
+        for (size_t o = 0; o < 3; o++) {
+            hashtable* table = hashtable_create();
+            bool present[7];
+            for (size_t i = 0; i < 7; i++) {
+                hashtable_set(table, keys[i], &values[i]);
+                present[i] = true;
+            }
+            if (capacity_of(table) != 16 || !holds(table, keys, values, present, 7)) {
+                LOG("hashtable_set wrapped failed !\n");
+                return -1;
+            }
+            for (size_t r = 0; r < 7; r++) {
+                size_t i = orders[o][r];
+                present[i] = false;
+                if (hashtable_remove(table, keys[i]) != &values[i] ||
+                        hashtable_remove(table, keys[i]) != NULL ||
+                        hashtable_length(table) != 6 - r ||
+                        !holds(table, keys, values, present, 7)) {
+                    LOG("hashtable_remove wrapped failed !\n");
+                    return -1;
+                }
+            }
+            hashtable_destroy(table);
+        }
+        LOG("hashtable_remove success, wrapped run of %zu keys \n", found);
+    }
+
+    {
+        // Removing nearly everything shrinks the table to its 16-slot floor;
+        // compacting keeps every key and value, and the packed keys survive
+        // later removals and the table's destruction.
+        enum { COUNT = 5000 };
+        static char keys[COUNT][16];
+        static int values[COUNT];
+        static bool present[COUNT];
+        hashtable* table = hashtable_create();
+        for (int i = 0; i < COUNT; i++) {
+            snprintf(keys[i], sizeof(keys[i]), "s%d", i);
+            values[i] = i;
+            present[i] = true;
+            hashtable_set(table, keys[i], &values[i]);
+        }
+        size_t grown = capacity_of(table);
+        for (int i = 1; i < COUNT; i++) {
+            present[i] = false;
+            hashtable_remove(table, keys[i]);
+        }
+        if (grown < COUNT || capacity_of(table) != 16 || hashtable_length(table) != 1 ||
+                !holds(table, keys, values, present, COUNT)) {
+            LOG("hashtable_remove shrink failed !\n");
+            return -1;
+        }
+        LOG("hashtable_remove success, shrunk from %zu to %zu slots \n", grown, capacity_of(table));
+
+        for (int i = 1; i < COUNT; i += 3) {
+            present[i] = true;
+            hashtable_set(table, keys[i], &values[i]);
+        }
+        for (int i = 1; i < COUNT; i += 9) {
+            present[i] = false;
+            hashtable_remove(table, keys[i]);
+        }
+        size_t length = hashtable_length(table);
+        bool compacted = hashtable_compact(table);
+        size_t capacity = capacity_of(table);
+        if (!compacted || hashtable_length(table) != length ||
+                capacity / 2 <= length || capacity / 4 > length ||
+                !holds(table, keys, values, present, COUNT)) {
+            LOG("hashtable_compact failed !\n");
+            return -1;
+        }
+        for (int i = 0; i < COUNT; i += 2) {
+            if (present[i]) {
+                present[i] = false;
+                hashtable_remove(table, keys[i]);
+            } else {
+                present[i] = true;
+                hashtable_set(table, keys[i], &values[i]);
+            }
+        }
+        if (!holds(table, keys, values, present, COUNT)) {
+            LOG("hashtable_compact then set and remove failed !\n");
+            return -1;
+        }
+        LOG("hashtable_compact success, %zu keys in %zu slots \n", length, capacity);
+        hashtable_destroy(table);
+    }
+
+    {
+        // Byte-string keys: embedded NULs and prefixes are distinct keys,
+        // the *_hashed calls agree with the plain ones, and many binary
+        // keys survive growing, removal and shrinking.
+        static const struct {
+            const char* bytes;
+            size_t size;
+        } keys[] = { { "a", 1 }, { "a\0", 2 }, { "a\0b", 3 }, { "a\0c", 3 }, { "", 0 }, { "\0", 1 } };
+        size_t count = sizeof(keys) / sizeof(keys[0]);
+        int values[6];
+        bhashtable* table = bhashtable_create(NULL, NULL);
+        for (size_t i = 0; i < count; i++) {
+            values[i] = (int)i;
+            if (bhashtable_set(table, keys[i].bytes, keys[i].size, &values[i]) == NULL) {
+                LOG("bhashtable_set failed !\n");
+                return -1;
+            }
+        }
+        if (bhashtable_length(table) != count) {
+            LOG("bhashtable_set embedded NUL failed !\n");
+            return -1;
+        }
+        for (size_t i = 0; i < count; i++) {
+            uint64_t hash = bhashtable_hash(table, keys[i].bytes, keys[i].size);
+            if (bhashtable_get(table, keys[i].bytes, keys[i].size) != &values[i] ||
+                    bhashtable_get_hashed(table, keys[i].bytes, keys[i].size, hash) != &values[i]) {
+                LOG("bhashtable_get failed !\n");
+                return -1;
+            }
+        }
+        if (bhashtable_remove(table, "a\0", 2) != &values[1] || bhashtable_get(table, "a\0", 2) != NULL ||
+                bhashtable_get(table, "a", 1) != &values[0] || bhashtable_length(table) != count - 1) {
+            LOG("bhashtable_remove failed !\n");
+            return -1;
+        }
+        bhashtable_destroy(table);
+
+        table = bhashtable_create(hash_folded, equal_folded);
+        int first = 1, second = 2;
+        uint64_t hash = bhashtable_hash(table, "Key", 3);
+        bhashtable_set_hashed(table, "Key", 3, hash, &first);
+        bhashtable_set(table, "KEY", 3, &second);
+        if (hash != hash_folded("kEy", 3) || bhashtable_length(table) != 1 ||
+                bhashtable_get(table, "key", 3) != &second ||
+                bhashtable_get_hashed(table, "kEY", 3, bhashtable_hash(table, "kEY", 3)) != &second) {
+            LOG("bhashtable callbacks failed !\n");
+            return -1;
+        }
+        bhashtable_destroy(table);
+
+        enum { COUNT = 20000 };
+        static uint32_t numbers[COUNT];
+        table = bhashtable_create(NULL, NULL);
+        for (uint32_t i = 0; i < COUNT; i++) {
+            numbers[i] = i * 256;  // low byte zero
+            uint64_t h = bhashtable_hash(table, &numbers[i], sizeof(uint32_t));
+            bhashtable_set_hashed(table, &numbers[i], sizeof(uint32_t), h, &numbers[i]);
+        }
+        for (uint32_t i = 0; i < COUNT; i += 2) {
+            bhashtable_remove(table, &numbers[i], sizeof(uint32_t));
+        }
+        size_t seen = 0;
+        bhashtablei it = bhashtable_iterator(table);
+        while (bhashtable_next(&it)) {
+            seen += it.size == sizeof(uint32_t) && memcmp(it.key, it.value, sizeof(uint32_t)) == 0;
+        }
+        for (uint32_t i = 0; i < COUNT; i++) {
+            if (bhashtable_get(table, &numbers[i], sizeof(uint32_t)) != (i % 2 ? &numbers[i] : NULL)) {
+                LOG("bhashtable binary keys failed !\n");
+                return -1;
+            }
+        }
+        for (uint32_t i = 1; i < COUNT - 1; i += 2) {
+            bhashtable_remove(table, &numbers[i], sizeof(uint32_t));
+        }
+        if (seen != COUNT / 2 || bhashtable_length(table) != 1 ||
+                bhashtable_get(table, &numbers[COUNT - 1], sizeof(uint32_t)) != &numbers[COUNT - 1]) {
+            LOG("bhashtable_remove shrink failed !\n");
+            return -1;
+        }
+        bhashtable_destroy(table);
+        LOG("bhashtable success, %zu byte-string keys and %d binary keys \n", count, COUNT);
+    }
+
+    {
+        // Keys longer than the cap are kept whole; a sign is only accepted
+        // at the start of a number or of its exponent.
+        char input[512];
+        char key[101];
+        memset(key, 'k', 100);
+        key[100] = '\0';
+        snprintf(input, sizeof(input),
+                 "{\"a\":1-2,\"b\":3}\n{\"a\":12+}\n{\"a\":-1-2}\n{\"a\":+1}\n"
+                 "{\"%s\":7,\"b\":-5,\"c\":1e+5,\"d\":2E-3}\n", key);
+        jsonstream_handler handler = {
+            .on_field = log_field, .on_record_end = log_record_end, .on_record_error = log_record_error,
+        };
+        stream_log log = { .length = 0 };
+        jsonstream* js = jsonstream_create(&handler, &log, 16);
+        int result = jsonstream_feed(js, input, strlen(input));
+        result |= jsonstream_finish(js);
+        jsonstream_destroy(js);
+        if (result != 0 || log.records != 1 || log.errors != 4 ||
+                strcmp(log.fields, "kkkkkkkk/100=7 b/1=-5 c/1 d/1 ") != 0) {
+            LOG("jsonstream failed: %d records, %d errors, %s !\n", log.records, log.errors, log.fields);
+            return -1;
+        }
+        LOG("jsonstream success, %s\n", log.fields);
+    }
+
+    {
+        // A field callback can reject its record: the tokenizer goes on
+        // with the next line, whatever the value that ended the field.
+        const char* input =
+            "{\"a\":1,\"a\":2,\"b\":\"x\"}\n{\"a\":3,\"b\":\"y\"}\n"
+            "{\"b\":\"s\",\"b\":\"t\"}\n{\"c\":true,\"c\":{\"x\":1}}\n{\"c\":4}\n";
+        jsonstream_handler handler = {
+            .on_field = log_unique_field, .on_record_end = log_record_end,
+            .on_record_error = log_record_error,
+        };
+        stream_log log = { .length = 0 };
+        jsonstream* js = jsonstream_create(&handler, &log, 16);
+        int result = jsonstream_feed(js, input, strlen(input));
+        result |= jsonstream_finish(js);
+        jsonstream_destroy(js);
+        if (result != 0 || log.records != 2 || log.errors != 3 ||
+                strcmp(log.fields, "a/1=3 b/1 c/1=4 ") != 0) {
+            LOG("jsonstream duplicate keys failed: %d records, %d errors, %s !\n",
+                log.records, log.errors, log.fields);
+            return -1;
+        }
+        LOG("jsonstream success, %d records with a duplicate key dropped \n", log.errors);
+    }
+
+    {
+        // Lines json-c accepts but the projection scanner can't follow, and
+        // keys written with escapes, are filtered after parsing: the
+        // excluded key never gets through.
+        const char* lines[] = {
+            "{\"a\":1,\"secret\":\"s3cr3t\"}",
+            "{\"a\":2,\"secret\":\"s3cr3t\",}",
+            "{'a':3,'secret':'s3cr3t'}",
+            "{\"a\":4,/*c*/\"secret\":\"s3cr3t\"}",
+            "{\"a\":5,\"u\":{\"id\":6},\"secret\":\"s3cr3t\",}",
+            "{\"a\":6,\"s\\u0065cret\":\"s3cr3t\"}",
+        };
+        const size_t count = sizeof(lines) / sizeof(lines[0]);
+        const char* lists[] = { "secret", "a,u.id" };
+        char* buffer = NULL;
+        size_t capacity = 0;
+        size_t filtered = 0;
+        for (int include = 0; include < 2; include++) {
+            projection* keys = projection_create(include);
+            projection_add(keys, lists[include]);
+            for (size_t i = 0; i < count; i++) {
+                struct json_object* record;
+                filtered += projection_apply(keys, lines[i], &buffer, &capacity) == lines[i];
+                if (!projection_parse(keys, lines[i], &buffer, &capacity, &record) || record == NULL) {
+                    LOG("projection_parse of %s failed !\n", lines[i]);
+                    return -1;
+                }
+                const char* json = json_object_to_json_string(record);
+                if (strstr(json, "s3cr3t") != NULL || strstr(json, "\"a\"") == NULL ||
+                        (i == 4 && strstr(json, include ? "\"u.id\"" : "\"u\"") == NULL)) {
+                    LOG("projection of %s failed: %s !\n", lines[i], json);
+                    return -1;
+                }
+                json_object_put(record);
+            }
+            projection_destroy(keys);
+        }
+        free(buffer);
+        if (filtered != 2 * (count - 1)) {
+            LOG("projection_apply scanned %zu lines it can't follow !\n", 2 * (count - 1) - filtered);
+            return -1;
+        }
+        LOG("projection success, %zu lines filtered after parsing \n", filtered);
+    }
+
+    {
+        // A schema inferred from samples encodes the bytes the generic
+        // path would, decodes them back, and sends records that don't fit
+        // its layout to the generic path.
+        char samples[] =
+            "{\"id\":1,\"name\":\"a\",\"ok\":true}\n"
+            "{\"id\":2,\"name\":\"b\",\"ok\":false,\"note\":\"n\"}\n"
+            "{\"id\":3,\"name\":\"c\",\"ok\":true}\n";
+        converter conv;
+        converter_init(&conv);
+        FILE* in = fmemopen(samples, strlen(samples), "r");
+        converter_infer_schema(&conv, in, 16);
+        fclose(in);
+        schema* layout = conv.record_schema;
+        const schema_field* fields = layout != NULL ? schema_fields(layout) : NULL;
+        if (layout == NULL || schema_length(layout) != 4 || strcmp(fields[3].key, "note") != 0 ||
+                fields[1].type != SCHEMA_STRING || fields[2].type != SCHEMA_BOOLEAN ||
+                !fields[0].required || fields[3].required || fields[3].tag != 4) {
+            LOG("schema inference failed !\n");
+            return -1;
+        }
+
+        // Records that fit, with and without the optional field.
+        const char* fitting[] = {
+            "{\"id\":-7,\"name\":\"x y\",\"ok\":false}",
+            "{\"id\":8,\"name\":\"\",\"ok\":true,\"note\":\"z\"}",
+        };
+        unsigned char* encoded = NULL;
+        unsigned char* generic = NULL;
+        size_t encoded_capacity = 0, generic_capacity = 0;
+        schema_value values[4];
+        for (int i = 0; i < 2; i++) {
+            struct json_object* record = json_tokener_parse(fitting[i]);
+            int size = schema_encode(layout, record, &encoded, &encoded_capacity);
+            conv.record_schema = NULL;
+            int generic_size = converter_encode(&conv, record, &generic, &generic_capacity);
+            conv.record_schema = layout;
+            json_object_put(record);
+            if (size <= 0 || size != generic_size || memcmp(encoded, generic, size) != 0 ||
+                    schema_decode(layout, encoded, size, values) != 0 ||
+                    values[0].i != (i == 0 ? -7 : 8) || values[2].b != (i == 1) ||
+                    strcmp(values[1].s, i == 0 ? "x y" : "") != 0 || values[3].present != (i == 1)) {
+                LOG("schema round trip of %s failed !\n", fitting[i]);
+                return -1;
+            }
+            // A required field cut off, or a truncated buffer, doesn't decode.
+            int last = 2 * sizeof(int) + sizeof(int);  // the id, stored last
+            if (schema_decode(layout, encoded, size - last, values) != -1 ||
+                    schema_decode(layout, encoded, size - 1, values) != -1) {
+                LOG("schema_decode of a damaged record failed !\n");
+                return -1;
+            }
+        }
+
+        // A type change, a missing required key and an unknown key all
+        // fall back to the generic path.
+        const char* misfits[] = {
+            "{\"id\":\"9\",\"name\":\"a\",\"ok\":true}",
+            "{\"id\":10,\"ok\":true}",
+            "{\"id\":11,\"name\":\"a\",\"ok\":true,\"new\":1}",
+        };
+        for (int i = 0; i < 3; i++) {
+            struct json_object* record = json_tokener_parse(misfits[i]);
+            int fitted = schema_encode(layout, record, &encoded, &encoded_capacity);
+            int size = converter_encode(&conv, record, &generic, &generic_capacity);
+            json_object_put(record);
+            tlv_box_t* box = size > 0 ? tlv_box_parse(generic, size) : NULL;
+            int id = 0;
+            char text[4];
+            int length = sizeof(text);
+            bool found = box != NULL && (i == 0 ? tlv_box_get_string(box, 1, text, &length) == 0 &&
+                                                      strcmp(text, "9") == 0
+                                                : tlv_box_get_int(box, 1, &id) == 0 && id == 10 + i - 1);
+            if (box != NULL) {
+                tlv_box_destroy(box);
+            }
+            if (fitted != 0 || !found) {
+                LOG("schema fallback of %s failed !\n", misfits[i]);
+                return -1;
+            }
+        }
+        free(encoded);
+        free(generic);
+
+        // A key sampled with two types leaves no schema.
+        schema* conflicting = schema_create();
+        struct json_object* first = json_tokener_parse("{\"id\":1}");
+        struct json_object* second = json_tokener_parse("{\"id\":\"1\"}");
+        bool observed = schema_observe(conflicting, first) && schema_observe(conflicting, second);
+        bool finalized = schema_finalize(conflicting, conv.key_hashtable);
+        json_object_put(first);
+        json_object_put(second);
+        schema_destroy(conflicting);
+        converter_free(&conv);
+        if (observed || finalized) {
+            LOG("schema type conflict failed !\n");
+            return -1;
+        }
+        LOG("schema success, round trips and fallbacks \n");
+    }
+
+    {
+        // Rings smaller than a batch wrap around on nearly every push: the
+        // SPSC consumer must see every item in order, and MPMC consumers
+        // each producer's items in order, none lost or repeated.
+        spsc_ring* spsc = spsc_ring_create(4);
+        mpmc_ring* mpmc = mpmc_ring_create(8);
+        void* item = ring_item(0, 0);
+        void* items[8] = { item, item, item, item, item, item, item, item };
+        for (int i = 0; i < 4; i++) {
+            spsc_ring_push(spsc, &item, 1);
+        }
+        if (spsc_ring_push(spsc, &item, 1) != 0 || spsc_ring_pop(spsc, items, 8) != 4 ||
+                spsc_ring_pop(spsc, items, 8) != 0 || mpmc_ring_pop(mpmc, items, 8) != 0 ||
+                mpmc_ring_push(mpmc, (void* const*)items, 8) != 8 ||
+                mpmc_ring_push(mpmc, &item, 1) != 0 || mpmc_ring_pop(mpmc, items, 3) != 3) {
+            LOG("ring bounds failed !\n");
+            return -1;
+        }
+        mpmc_ring_close(mpmc);
+        if (mpmc_ring_push(mpmc, &item, 1) != 0 || mpmc_ring_pop_wait(mpmc, items, 8) != 5 ||
+                mpmc_ring_pop_wait(mpmc, items, 8) != 0) {
+            LOG("mpmc_ring_close failed !\n");
+            return -1;
+        }
+        mpmc_ring_destroy(mpmc);
+
+        ring_side producer = { .ring = spsc }, consumer = { .ring = spsc };
+        pthread_t threads[2 * RING_THREADS];
+        pthread_create(&threads[0], NULL, spsc_produce, &producer);
+        pthread_create(&threads[1], NULL, spsc_consume, &consumer);
+        pthread_join(threads[0], NULL);
+        pthread_join(threads[1], NULL);
+        spsc_ring_destroy(spsc);
+        memset(ring_seen, 0, sizeof(ring_seen));
+        if (consumer.popped != RING_ITEMS || !consumer.ordered || consumer.next[0] != RING_ITEMS) {
+            LOG("spsc_ring failed: %zu items popped !\n", consumer.popped);
+            return -1;
+        }
+
+        mpmc = mpmc_ring_create(16);
+        ring_side sides[2 * RING_THREADS];
+        memset(sides, 0, sizeof(sides));
+        for (size_t i = 0; i < 2 * RING_THREADS; i++) {
+            sides[i].ring = mpmc;
+            sides[i].producer = i;
+            pthread_create(&threads[i], NULL, i < RING_THREADS ? mpmc_produce : mpmc_consume, &sides[i]);
+        }
+        for (size_t i = 0; i < RING_THREADS; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        mpmc_ring_close(mpmc);
+        size_t popped = 0;
+        bool ordered = true;
+        for (size_t i = RING_THREADS; i < 2 * RING_THREADS; i++) {
+            pthread_join(threads[i], NULL);
+            popped += sides[i].popped;
+            ordered &= sides[i].ordered;
+        }
+        mpmc_ring_destroy(mpmc);
+        for (size_t p = 0; p < RING_THREADS; p++) {
+            for (size_t i = 0; i < RING_ITEMS; i++) {
+                ordered &= atomic_load(&ring_seen[p][i]) == 1;
+            }
+        }
+        if (popped != RING_THREADS * RING_ITEMS || !ordered) {
+            LOG("mpmc_ring failed: %zu items popped !\n", popped);
+            return -1;
+        }
+        LOG("ring success, %d items through SPSC and %d through MPMC \n",
+            RING_ITEMS, RING_THREADS * RING_ITEMS);
+    }
+
+    {
+        // Every task spawned runs exactly once, whether split recursively
+        // or spawned by the thousand onto one deque while others steal.
+        range_task fanouts[WS_FANOUTS];
+        for (int round = 0; round < 2; round++) {
+            ws_pool* pool = ws_pool_create(4);
+            if (pool == NULL) {
+                LOG("ws_pool_create failed !\n");
+                return -1;
+            }
+            memset(ws_runs, 0, sizeof(ws_runs));
+            if (round == 0) {
+                ws_tasks[0] = (range_task){ { run_range }, 0, WS_LEAVES };
+                ws_pool_submit(pool, &ws_tasks[0].task);
+            } else {
+                for (size_t i = 0; i < WS_FANOUTS; i++) {
+                    size_t size = WS_LEAVES / WS_FANOUTS;
+                    fanouts[i] = (range_task){ { run_fanout }, i * size, (i + 1) * size };
+                    ws_pool_submit(pool, &fanouts[i].task);
+                }
+            }
+            ws_pool_destroy(pool);
+            for (size_t i = 0; i < WS_LEAVES; i++) {
+                if (atomic_load(&ws_runs[i]) != 1) {
+                    LOG("worksteal %s failed: task %zu ran %d times !\n",
+                        round == 0 ? "split" : "fanout", i, atomic_load(&ws_runs[i]));
+                    return -1;
+                }
+            }
+        }
+        LOG("worksteal success, %d tasks split and %d fanned out \n", WS_LEAVES, WS_LEAVES);
+    }
+
+    {
+        // Overlapped writes land in order, and overlapped reads give back
+        // every byte, from a file (at any offset) and from a pipe.
+        unsigned char* data = malloc(WRITE_SIZE);
+        fill_lines(data, WRITE_SIZE);
+        int fd = open("test_aio.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+        aio_writer* writer = aio_writer_open(fd, 0, 4096, 3);
+        int result = write_pieces(aio_writer_write, writer, data, WRITE_SIZE);
+        result |= aio_writer_close(writer);
+        if (result != 0 || !file_holds("test_aio.bin", data, WRITE_SIZE)) {
+            LOG("aio_writer failed !\n");
+            return -1;
+        }
+        aio_reader* reader = aio_reader_open(fd, 0, 4096, 3);
+        bool same = lines_hold(reader, data, WRITE_SIZE);
+        aio_reader_close(reader);
+        reader = aio_reader_open(fd, 1000, 4096, 3);
+        const unsigned char* block;
+        size_t offset = 1000;
+        ssize_t n;
+        while ((n = aio_reader_next(reader, &block)) > 0) {
+            same &= offset + n <= WRITE_SIZE && memcmp(block, data + offset, n) == 0;
+            offset += n;
+        }
+        aio_reader_close(reader);
+        close(fd);
+        remove("test_aio.bin");
+        if (!same || n != 0 || offset != WRITE_SIZE) {
+            LOG("aio_reader of a file failed !\n");
+            return -1;
+        }
+
+        int fds[2];
+        pthread_t thread;
+        if (pipe(fds) != 0) {
+            LOG("pipe failed !\n");
+            return -1;
+        }
+        pipe_writer w = { fds[1], data, WRITE_SIZE, -1 };
+        pthread_create(&thread, NULL, write_pipe, &w);
+        reader = aio_reader_open(fds[0], 0, 4096, 3);
+        same = lines_hold(reader, data, WRITE_SIZE);
+        aio_reader_close(reader);
+        pthread_join(thread, NULL);
+        close(fds[0]);
+        if (!same || w.result != 0) {
+            LOG("aio through a pipe failed !\n");
+            return -1;
+        }
+        free(data);
+        LOG("aio success, %d bytes through a file and a pipe \n", WRITE_SIZE);
+    }
+
+    {
+        // The mapped writer's file matches what was written, through
+        // mapped_write and through reservations committed in part, across
+        // many slides of a small window.
+        unsigned char* data = malloc(WRITE_SIZE);
+        fill_lines(data, WRITE_SIZE);
+        mapped_writer* writer = mapped_open("test_mapped.bin", 65536);
+        int result = writer == NULL ? -1 : write_pieces(mapped_write, writer, data, WRITE_SIZE / 2);
+        for (size_t offset = WRITE_SIZE / 2, n; result == 0 && offset < WRITE_SIZE; offset += n) {
+            n = offset % 70000 + 1;
+            n = n < WRITE_SIZE - offset ? n : WRITE_SIZE - offset;
+            unsigned char* room = mapped_reserve(writer, n + 100);
+            if (room == NULL) {
+                result = -1;
+                break;
+            }
+            memcpy(room, data + offset, n);
+            mapped_commit(writer, n);
+        }
+        if (writer != NULL) {
+            result |= mapped_close(writer);
+        }
+        bool same = file_holds("test_mapped.bin", data, WRITE_SIZE);
+        remove("test_mapped.bin");
+        free(data);
+        if (result != 0 || !same) {
+            LOG("mapped writer failed !\n");
+            return -1;
+        }
+        LOG("mapped success, %d bytes \n", WRITE_SIZE);
+    }
+
+    {
+        // The direct writer's file matches what was written, aligned
+        // blocks and partial last block alike, whether or not the
+        // filesystem takes O_DIRECT.
+        unsigned char* data = malloc(WRITE_SIZE);
+        fill_lines(data, WRITE_SIZE);
+        size_t sizes[] = { WRITE_SIZE, WRITE_SIZE - 1, DIRECT_ALIGN, 100 };
+        bool bypassed = false;
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            direct_writer* writer = direct_open("test_direct.bin", 3 * DIRECT_ALIGN);
+            int result = writer == NULL ? -1 : write_pieces(direct_write, writer, data, sizes[i]);
+            if (writer != NULL) {
+                bypassed = direct_bypasses_cache(writer);
+                result |= direct_close(writer);
+            }
+            if (result != 0 || !file_holds("test_direct.bin", data, sizes[i])) {
+                LOG("direct writer of %zu bytes failed !\n", sizes[i]);
+                return -1;
+            }
+        }
+        remove("test_direct.bin");
+        free(data);
+        LOG("direct success, %d bytes%s \n", WRITE_SIZE, bypassed ? "" : " (without O_DIRECT)");
+    }
+
+    {
+        // Input from a pipe keeps the bytes read to detect its format;
+        // compressed input reads the same from a file and a pipe, rewinds
+        // from a file, and refuses to seek on a pipe rather than restart.
+        unsigned char* data = malloc(WRITE_SIZE);
+        fill_lines(data, WRITE_SIZE);
+        pthread_t thread;
+        pipe_writer w;
+        signal(SIGPIPE, SIG_IGN);  // a reader giving up early fails the test, not the process
+        FILE* in = open_piped(&thread, &w, data, WRITE_SIZE);
+        bool same = in != NULL && stream_holds(in, data, WRITE_SIZE);
+        if (in != NULL) {
+            fclose(in);
+        }
+        pthread_join(thread, NULL);
+        if (!same) {
+            LOG("decompress_open of a plain pipe failed !\n");
+            return -1;
+        }
+#ifdef HAVE_ZLIB
+        // Two gzip members, read through as one stream.
+        for (int member = 0; member < 2; member++) {
+            gzFile gz = gzopen("test_input.gz", member == 0 ? "wb" : "ab");
+            gzwrite(gz, data + member * (WRITE_SIZE / 2), WRITE_SIZE / 2);
+            gzclose(gz);
+        }
+        in = decompress_open("test_input.gz");
+        same = in != NULL && fileno(in) == -1 && stream_holds(in, data, WRITE_SIZE) &&
+               ftello(in) == WRITE_SIZE;
+        if (in != NULL) {
+            rewind(in);
+            same &= stream_holds(in, data, WRITE_SIZE);
+            fclose(in);
+        }
+        size_t size;
+        unsigned char* compressed = read_file("test_input.gz", &size);
+        remove("test_input.gz");
+        if (!same || compressed == NULL) {
+            LOG("decompress_open of a gzip file failed !\n");
+            return -1;
+        }
+        in = open_piped(&thread, &w, compressed, size);
+        same = in != NULL && fseeko(in, 0, SEEK_CUR) != 0 && stream_holds(in, data, WRITE_SIZE);
+        if (in != NULL) {
+            fclose(in);
+        }
+        pthread_join(thread, NULL);
+        free(compressed);
+        if (!same) {
+            LOG("decompress_open of a gzip pipe failed !\n");
+            return -1;
+        }
+        LOG("decompress success, plain and gzip input from files and pipes \n");
+#else
+        LOG("decompress success, plain input from a pipe (built without HAVE_ZLIB) \n");
+#endif
+        free(data);
+    }
+
+    {
+        // The manifest counts each shard's records, bytes and runs, both
+        // for runs of records and for records sharded by a key's value.
+        const size_t count = 3 * SHARD_RUN + 100;
+        converter conv;
+        converter_init(&conv);
+        converter_tag(&conv, "id");
+        converter_tag(&conv, "name");
+        for (int keyed = 0; keyed < 2; keyed++) {
+            size_t shards = keyed ? 4 : 3;
+            uint64_t expected[4] = { 0 };
+            shard_set* set = shard_open("test_shard", shards, keyed ? 4096 : 0, keyed ? 2 : 0);
+            int result = set == NULL ? -1 : 0;
+            for (size_t i = 0; result == 0 && i < count; i++) {
+                // {"id": i, "name": "k<i % 10>"}
+                unsigned char record[32];
+                int header[2] = { 1, sizeof(int) };
+                int id = (int)i;
+                char name[4];
+                snprintf(name, sizeof(name), "k%zu", i % 10);
+                memcpy(record, header, sizeof(header));
+                memcpy(record + 8, &id, sizeof(int));
+                header[0] = 2;
+                header[1] = (int)strlen(name) + 1;
+                memcpy(record + 12, header, sizeof(header));
+                memcpy(record + 20, name, header[1]);
+                result = shard_write(set, record, 20 + header[1]);
+                expected[keyed ? crc32c(name, header[1]) % shards : i / SHARD_RUN % shards]++;
+            }
+            if (set != NULL) {
+                result |= shard_close(set, &conv, keyed ? "name" : NULL);
+            }
+
+            struct json_object* manifest = json_object_from_file("test_shard.manifest");
+            struct json_object* list = NULL;
+            struct json_object* dictionary = NULL;
+            struct json_object* keys = NULL;
+            bool ok = result == 0 && manifest != NULL && member_int(manifest, "records") == (int64_t)count &&
+                      json_object_object_get_ex(manifest, "shards", &list) &&
+                      json_object_array_length(list) == shards &&
+                      json_object_object_get_ex(manifest, "dictionary", &dictionary) &&
+                      json_object_object_get_ex(dictionary, "keys", &keys) &&
+                      json_object_array_length(keys) == 2;
+            for (size_t i = 0; ok && i < shards; i++) {
+                struct json_object* entry = json_object_array_get_idx(list, i);
+                char path[32];
+                size_t size;
+                snprintf(path, sizeof(path), "test_shard.%zu", i);
+                unsigned char* contents = read_file(path, &size);
+                char crc[9];
+                snprintf(crc, sizeof(crc), "%08x", contents != NULL ? crc32c(contents, size) : 0);
+                struct json_object* crc_member = NULL;
+                ok = contents != NULL && member_int(entry, "records") == (int64_t)expected[i] &&
+                     member_int(entry, "bytes") == (int64_t)size &&
+                     json_object_object_get_ex(entry, "crc32c", &crc_member) &&
+                     strcmp(json_object_get_string(crc_member), crc) == 0;
+                if (ok && keyed) {
+                    // Blocks hold exactly the records counted.
+                    FILE* in = fmemopen(contents, size, "rb");
+                    block_verification v;
+                    ok = in != NULL && block_verify(in, &v) == 0 && v.records == expected[i];
+                    if (in != NULL) {
+                        fclose(in);
+                    }
+                } else if (ok) {
+                    // Runs of SHARD_RUN rotate through the shards.
+                    struct json_object* ranges = NULL;
+                    json_object_object_get_ex(entry, "ranges", &ranges);
+                    size_t runs = i == 0 ? 2 : 1;
+                    ok = ranges != NULL && json_object_array_length(ranges) == runs;
+                    for (size_t r = 0; ok && r < runs; r++) {
+                        struct json_object* range = json_object_array_get_idx(ranges, r);
+                        uint64_t first = (i + r * shards) * SHARD_RUN;
+                        uint64_t end = first + SHARD_RUN < count ? first + SHARD_RUN : count;
+                        ok = json_object_array_length(range) == 2 &&
+                             json_object_get_int64(json_object_array_get_idx(range, 0)) == (int64_t)first &&
+                             json_object_get_int64(json_object_array_get_idx(range, 1)) == (int64_t)end;
+                    }
+                }
+                free(contents);
+                remove(path);
+            }
+            if (manifest != NULL) {
+                json_object_put(manifest);
+            }
+            remove("test_shard.manifest");
+            if (!ok) {
+                LOG("shard manifest %s failed !\n", keyed ? "by key" : "by runs");
+                return -1;
+            }
+        }
+        converter_free(&conv);
+        LOG("shard success, %zu records by runs and by key \n", count);
+    }
+
+    {
+        // A saved checkpoint loads back with its progress and tags, and one
+        // that is damaged, cut short or made for another input is refused.
+        const char* path = "test_checkpoint";
+        converter saved;
+        converter_init(&saved);
+        char key[16];
+        for (int i = 0; i < 1000; i++) {
+            snprintf(key, sizeof(key), "key%d", i);
+            converter_tag(&saved, key);
+        }
+        free(hashtable_remove(saved.key_hashtable, "key500"));  // a rolled-back tag
+        checkpoint cp = { 123456789012ULL, 98765 };
+        int result = checkpoint_save(path, "input.json", &cp, &saved);
+
+        checkpoint loaded_cp = { 0 };
+        converter loaded;
+        converter_init(&loaded);
+        bool ok = result == 0 && checkpoint_load(path, "input.json", &loaded_cp, &loaded) == 1 &&
+                  loaded_cp.input_offset == cp.input_offset &&
+                  loaded_cp.output_length == cp.output_length && loaded.counter == saved.counter &&
+                  hashtable_length(loaded.key_hashtable) == hashtable_length(saved.key_hashtable) &&
+                  hashtable_get(loaded.key_hashtable, "key500") == NULL;
+        for (int i = 0; ok && i < 1000; i++) {
+            snprintf(key, sizeof(key), "key%d", i);
+            int* expected = hashtable_get(saved.key_hashtable, key);
+            int* tag = hashtable_get(loaded.key_hashtable, key);
+            ok = expected == NULL ? tag == NULL : tag != NULL && *tag == *expected;
+        }
+        // The next new key carries on after the saved tags.
+        int* next = ok ? converter_tag(&loaded, "new") : NULL;
+        ok = next != NULL && *next == (int)saved.counter;
+        converter_free(&loaded);
+
+        size_t size = 0;
+        unsigned char* contents = read_file(path, &size);
+        const char* failure = !ok ? "round trip" : contents == NULL ? "read" : NULL;
+        struct {
+            const char* name;
+            const char* input;
+            size_t flip;    // byte to flip, or SIZE_MAX for none
+            size_t length;  // bytes to keep
+        } damage[] = {
+            { "another input", "other.json", SIZE_MAX, size },
+            { "flipped header byte", "input.json", 5, size },
+            { "flipped key byte", "input.json", size / 2, size },
+            { "flipped checksum byte", "input.json", size - 1, size },
+            { "truncated", "input.json", SIZE_MAX, size - 4 },
+            { "empty", "input.json", SIZE_MAX, 0 },
+        };
+        for (size_t i = 0; failure == NULL && i < sizeof(damage) / sizeof(damage[0]); i++) {
+            FILE* out = fopen(path, "wb");
+            if (out == NULL) {
+                failure = "rewrite";
+                break;
+            }
+            size_t flip = damage[i].flip;
+            if (flip < size) {
+                contents[flip] ^= 0x10;
+            }
+            fwrite(contents, 1, damage[i].length, out);
+            fclose(out);
+            if (flip < size) {
+                contents[flip] ^= 0x10;
+            }
+            converter_init(&loaded);
+            if (checkpoint_load(path, damage[i].input, &loaded_cp, &loaded) != -1 ||
+                loaded.counter != 1 || hashtable_length(loaded.key_hashtable) != 0) {
+                failure = damage[i].name;
+            }
+            converter_free(&loaded);
+        }
+        remove(path);
+        converter_init(&loaded);
+        if (failure == NULL && checkpoint_load(path, "input.json", &loaded_cp, &loaded) != 0) {
+            failure = "missing";
+        }
+        converter_free(&loaded);
+        free(contents);
+        converter_free(&saved);
+        if (failure != NULL) {
+            LOG("checkpoint %s failed !\n", failure);
+            return -1;
+        }
+        LOG("checkpoint success, %zu bytes, damage refused \n", size);
+    }
+
+    {
+        // Percentiles are the highest value of their bucket, capped by the
+        // exact maximum: exact below HISTOGRAM_SUB_COUNT, within 1/32 above.
+        struct {
+            const char* name;
+            uint64_t first, last;  // record first..last, or powers of two if last is 0
+            histogram_summary expected;
+        } cases[] = {
+            { "small", 0, 63, { 64, 31, 63, 63, 63 } },
+            { "first pair", 64, 66, { 3, 65, 66, 66, 66 } },
+            { "bucket of 16", 1007, 1024, { 18, 1023, 1024, 1024, 1024 } },
+            { "linear", 1, 1000, { 1000, 503, 991, 1000, 1000 } },
+            { "powers", 0, 0, { 65, (1ULL << 32) + (1ULL << 27) - 1, UINT64_MAX, UINT64_MAX, UINT64_MAX } },
+        };
+        const char* failure = NULL;
+        for (size_t i = 0; failure == NULL && i < sizeof(cases) / sizeof(cases[0]); i++) {
+            histogram* h = histogram_create(cases[i].name);
+            if (h == NULL) {
+                failure = "create";
+                break;
+            }
+            if (cases[i].last == 0) {
+                for (int k = 0; k < 64; k++) {
+                    histogram_record(h, 1ULL << k);
+                }
+                histogram_record(h, UINT64_MAX);
+            } else {
+                for (uint64_t value = cases[i].first; value <= cases[i].last; value++) {
+                    histogram_record(h, value);
+                }
+            }
+            histogram_summary s;
+            histogram_summarize(h, &s);
+            const histogram_summary* e = &cases[i].expected;
+            if (s.count != e->count || s.p50 != e->p50 || s.p99 != e->p99 || s.p999 != e->p999 ||
+                s.max != e->max) {
+                failure = cases[i].name;
+            }
+            histogram_destroy(h);
+        }
+
+        // Threads recording into one histogram are merged.
+        histogram* h = failure == NULL ? histogram_create("threads") : NULL;
+        pthread_t threads[HISTOGRAM_THREADS];
+        for (int i = 0; h != NULL && i < HISTOGRAM_THREADS; i++) {
+            pthread_create(&threads[i], NULL, record_values, h);
+        }
+        for (int i = 0; h != NULL && i < HISTOGRAM_THREADS; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        if (h != NULL) {
+            histogram_summary s;
+            histogram_summarize(h, &s);
+            if (s.count != (uint64_t)HISTOGRAM_THREADS * HISTOGRAM_ROUNDS * 1000 || s.p50 != 503 ||
+                s.p99 != 991 || s.p999 != 1000 || s.max != 1000) {
+                failure = "threads";
+            }
+            histogram_destroy(h);
+        } else if (failure == NULL) {
+            failure = "create";
+        }
+        if (failure != NULL) {
+            LOG("histogram %s failed !\n", failure);
+            return -1;
+        }
+        LOG("histogram success, %d threads merged \n", HISTOGRAM_THREADS);
+    }
+
+    return 0;
+}
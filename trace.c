@@ -0,0 +1,142 @@
+#include "trace.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TRACE_CHUNK 4096  // spans per allocation
+
+bool trace_enabled;
+
+typedef struct {
+    const char* name;
+    uint64_t start;
+    uint64_t end;
+} trace_span;
+
+typedef struct trace_chunk {
+    trace_span spans[TRACE_CHUNK];
+    size_t count;
+    struct trace_chunk* next;
+} trace_chunk;
+
+// One thread's spans. Only that thread appends to it.
+typedef struct trace_buffer {
+    int tid;
+    const char* name;
+    trace_chunk* head;
+    trace_chunk* tail;
+    size_t count;
+    size_t dropped;
+    struct trace_buffer* next;
+} trace_buffer;
+
+static _Atomic(trace_buffer*) buffers;
+static atomic_int next_tid;
+static uint64_t origin;  // trace_start time, the zero of the timeline
+static _Thread_local trace_buffer* local;
+
+void trace_start(void) {
+    trace_enabled = true;
+    origin = trace_begin();
+}
+
+// Return the calling thread's buffer, registering it on first use.
+static trace_buffer* buffer(void) {
+    if (local == NULL) {
+        trace_buffer* b = calloc(1, sizeof(trace_buffer));
+        if (b == NULL) {
+            return NULL;
+        }
+        b->tid = atomic_fetch_add(&next_tid, 1) + 1;
+        b->next = atomic_load(&buffers);
+        while (!atomic_compare_exchange_weak(&buffers, &b->next, b)) {
+        }
+        local = b;
+    }
+    return local;
+}
+
+void trace_thread(const char* name) {
+    trace_buffer* b = trace_enabled ? buffer() : NULL;
+    if (b != NULL) {
+        b->name = name;
+    }
+}
+
+void trace_record(const char* name, uint64_t start) {
+    uint64_t end = trace_begin();
+    trace_buffer* b = buffer();
+    if (b == NULL) {
+        return;
+    }
+    if (b->count == TRACE_MAX_EVENTS) {
+        b->dropped++;
+        return;
+    }
+    if (b->tail == NULL || b->tail->count == TRACE_CHUNK) {
+        trace_chunk* chunk = malloc(sizeof(trace_chunk));
+        if (chunk == NULL) {
+            b->dropped++;
+            return;
+        }
+        chunk->count = 0;
+        chunk->next = NULL;
+        if (b->tail != NULL) {
+            b->tail->next = chunk;
+        } else {
+            b->head = chunk;
+        }
+        b->tail = chunk;
+    }
+    b->tail->spans[b->tail->count++] = (trace_span){ name, start, end };
+    b->count++;
+}
+
+// Write s as a JSON string.
+static void write_json_string(FILE* out, const char* s) {
+    fputc('"', out);
+    for (; *s != '\0'; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+int trace_write(const char* path) {
+    FILE* out = fopen(path, "w");
+    if (out == NULL) {
+        return -1;
+    }
+    // Times are in microseconds since trace_start.
+    const char* separator = "";
+    fputs("{\"displayTimeUnit\": \"ns\", \"traceEvents\": [", out);
+    for (trace_buffer* b = atomic_load(&buffers); b != NULL; b = b->next) {
+        fprintf(out, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                "\"args\": {\"name\": ", separator, b->tid);
+        write_json_string(out, b->name != NULL ? b->name : "thread");
+        fputs("}}", out);
+        separator = ",";
+        for (trace_chunk* chunk = b->head; chunk != NULL; chunk = chunk->next) {
+            for (size_t i = 0; i < chunk->count; i++) {
+                const trace_span* s = &chunk->spans[i];
+                fprintf(out, ",\n{\"name\": ");
+                write_json_string(out, s->name);
+                fprintf(out, ", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                        b->tid, (s->start - origin) / 1e3, (s->end - s->start) / 1e3);
+            }
+        }
+        if (b->dropped > 0) {
+            fprintf(stderr, "%s: dropped %zu spans of thread %d\n", path, b->dropped, b->tid);
+        }
+    }
+    fputs("\n]}\n", out);
+    bool failed = ferror(out);
+    return fclose(out) == 0 && !failed ? 0 : -1;
+}
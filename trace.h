@@ -0,0 +1,53 @@
+// Timelines in the Chrome trace-event format.
+//
+// While tracing, each thread records spans (a name, a start and an end)
+// into a buffer of its own, without locks; trace_write then dumps every
+// thread's spans as complete ("X") events, one track per thread, for
+// chrome://tracing or Perfetto. Spans on one thread nest by time, so a
+// span taken around others shows as their parent.
+//
+// Span names must be string literals, or otherwise outlive the trace.
+
+#ifndef _trace_H
+#define _trace_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define TRACE_MAX_EVENTS (1 << 20)  // per thread; later spans are dropped
+
+// Set by trace_start, before any thread records.
+extern bool trace_enabled;
+
+// Start recording spans.
+void trace_start(void);
+
+// Name the calling thread's track.
+void trace_thread(const char* name);
+
+// Record a span from start (as returned by trace_begin) until now.
+void trace_record(const char* name, uint64_t start);
+
+// Write every span recorded to path as trace-event JSON. Call once the
+// threads that recorded are done. Return 0 on success, -1 on error.
+int trace_write(const char* path);
+
+// Start a span: return its start time, or 0 if not tracing.
+static inline uint64_t trace_begin(void) {
+    if (!trace_enabled) {
+        return 0;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// End the span started at start, named name.
+static inline void trace_end(const char* name, uint64_t start) {
+    if (trace_enabled) {
+        trace_record(name, start);
+    }
+}
+
+#endif // _trace_H
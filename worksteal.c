@@ -0,0 +1,304 @@
+#include "worksteal.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "ring.h"
+#include "trace.h"
+
+#define INITIAL_DEQUE_SIZE 64    // must be a power of two
+#define INJECT_CAPACITY 256      // tasks queued from outside the pool
+#define IDLE_ROUNDS 64           // search rounds before sleeping, on multicore hosts
+
+// Circular array of a deque. Grown arrays are kept until the deque is
+// freed, since a thief may still be reading the old one.
+typedef struct ws_array {
+    struct ws_array* retired;    // previous, smaller array
+    size_t mask;
+    _Atomic(ws_task*) slots[];
+} ws_array;
+
+// Chase-Lev deque, with the C11 orderings of Le et al., "Correct and
+// Efficient Work-Stealing for Weak Memory Models" (PPoPP 2013).
+typedef struct {
+    _Alignas(RING_CACHE_LINE) _Atomic int64_t top;     // next to steal
+    _Alignas(RING_CACHE_LINE) _Atomic int64_t bottom;  // next free, owner only
+    _Atomic(ws_array*) array;
+} ws_deque;
+
+struct ws_worker {
+    ws_deque deque;
+    ws_pool* pool;
+    pthread_t thread;
+    unsigned seed;               // for picking victims
+};
+
+struct ws_pool {
+    ws_worker* workers;
+    size_t threads;
+    size_t started;
+    mpmc_ring* inject;
+    _Atomic size_t idle;         // workers searching for or waiting on work
+    _Atomic bool stopping;
+    ring_event work;             // notified when tasks are queued, and on stop
+    bool spin;                   // search a while before sleeping
+};
+
+static ws_array* array_create(size_t size) {
+    ws_array* a = malloc(sizeof(ws_array) + size * sizeof(_Atomic(ws_task*)));
+    if (a == NULL) {
+        return NULL;
+    }
+    a->retired = NULL;
+    a->mask = size - 1;
+    return a;
+}
+
+static bool deque_init(ws_deque* q) {
+    ws_array* a = array_create(INITIAL_DEQUE_SIZE);
+    if (a == NULL) {
+        return false;
+    }
+    atomic_init(&q->top, 0);
+    atomic_init(&q->bottom, 0);
+    atomic_init(&q->array, a);
+    return true;
+}
+
+static void deque_free(ws_deque* q) {
+    ws_array* a = atomic_load_explicit(&q->array, memory_order_relaxed);
+    while (a != NULL) {
+        ws_array* retired = a->retired;
+        free(a);
+        a = retired;
+    }
+}
+
+// Owner only: double the array, copying the live range [t, b).
+static ws_array* deque_grow(ws_deque* q, ws_array* a, int64_t t, int64_t b) {
+    ws_array* grown = array_create(2 * (a->mask + 1));
+    if (grown == NULL) {
+        return NULL;
+    }
+    for (int64_t i = t; i < b; i++) {
+        ws_task* x = atomic_load_explicit(&a->slots[i & a->mask], memory_order_relaxed);
+        atomic_store_explicit(&grown->slots[i & grown->mask], x, memory_order_relaxed);
+    }
+    grown->retired = a;
+    atomic_store_explicit(&q->array, grown, memory_order_release);
+    return grown;
+}
+
+// Owner only: push x at the bottom. Return false if out of memory.
+static bool deque_push(ws_deque* q, ws_task* x) {
+    int64_t b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&q->top, memory_order_acquire);
+    ws_array* a = atomic_load_explicit(&q->array, memory_order_relaxed);
+    if (b - t > (int64_t)a->mask) {
+        a = deque_grow(q, a, t, b);
+        if (a == NULL) {
+            return false;
+        }
+    }
+    atomic_store_explicit(&a->slots[b & a->mask], x, memory_order_relaxed);
+    // Publishes the task to thieves' acquire loads of bottom; the paper's
+    // release fence with a relaxed store is equivalent.
+    atomic_store_explicit(&q->bottom, b + 1, memory_order_release);
+    return true;
+}
+
+// Owner only: take the task at the bottom, or NULL if empty.
+static ws_task* deque_take(ws_deque* q) {
+    int64_t b = atomic_load_explicit(&q->bottom, memory_order_relaxed) - 1;
+    ws_array* a = atomic_load_explicit(&q->array, memory_order_relaxed);
+    atomic_store_explicit(&q->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&q->top, memory_order_relaxed);
+    ws_task* x = NULL;
+    if (t <= b) {
+        x = atomic_load_explicit(&a->slots[b & a->mask], memory_order_relaxed);
+        if (t == b) {
+            // Last task: race thieves for it.
+            if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
+                    memory_order_seq_cst, memory_order_relaxed)) {
+                x = NULL;
+            }
+            atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+    }
+    return x;
+}
+
+// Any thread: steal the task at the top. Return NULL if empty, and set
+// *lost if another thread won the race for it.
+static ws_task* deque_steal(ws_deque* q, bool* lost) {
+    int64_t t = atomic_load_explicit(&q->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&q->bottom, memory_order_acquire);
+    if (t >= b) {
+        return NULL;
+    }
+    ws_array* a = atomic_load_explicit(&q->array, memory_order_acquire);
+    ws_task* x = atomic_load_explicit(&a->slots[t & a->mask], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
+            memory_order_seq_cst, memory_order_relaxed)) {
+        *lost = true;
+        return NULL;
+    }
+    return x;
+}
+
+static bool deque_empty(ws_deque* q) {
+    return atomic_load_explicit(&q->bottom, memory_order_relaxed) <=
+           atomic_load_explicit(&q->top, memory_order_relaxed);
+}
+
+// Look for a task: own deque first, then the shared queue, then steal
+// from the other workers, starting at a random one.
+static ws_task* find_task(ws_worker* w) {
+    ws_pool* pool = w->pool;
+    ws_task* x = deque_take(&w->deque);
+    if (x != NULL) {
+        return x;
+    }
+    void* item;
+    if (mpmc_ring_pop(pool->inject, &item, 1) == 1) {
+        return item;
+    }
+    bool lost;
+    do {
+        lost = false;
+        size_t start = rand_r(&w->seed) % pool->threads;
+        for (size_t i = 0; i < pool->threads; i++) {
+            ws_worker* victim = &pool->workers[(start + i) % pool->threads];
+            if (victim != w && (x = deque_steal(&victim->deque, &lost)) != NULL) {
+                return x;
+            }
+        }
+    } while (lost);
+    return NULL;
+}
+
+// Wait for a task as an idle worker. Return NULL once the pool stops and
+// no task is left.
+static ws_task* wait_task(ws_worker* w) {
+    ws_pool* pool = w->pool;
+    ws_task* x = NULL;
+    atomic_fetch_add(&pool->idle, 1);
+    for (int round = 0; pool->spin && round < IDLE_ROUNDS && x == NULL; round++) {
+        x = find_task(w);
+    }
+    while (x == NULL) {
+        uint32_t seen = ring_event_prepare(&pool->work);
+        x = find_task(w);
+        if (x != NULL || atomic_load(&pool->stopping)) {
+            ring_event_cancel(&pool->work);
+            break;
+        }
+        ring_event_wait(&pool->work, seen);
+    }
+    atomic_fetch_sub(&pool->idle, 1);
+    return x;
+}
+
+static void* worker_main(void* arg) {
+    ws_worker* w = arg;
+    trace_thread("worker");
+    for (;;) {
+        ws_task* x = find_task(w);
+        if (x == NULL) {
+            uint64_t start = trace_begin();
+            x = wait_task(w);
+            trace_end("idle", start);
+        }
+        if (x == NULL) {
+            return NULL;
+        }
+        x->run(x, w);
+    }
+}
+
+ws_pool* ws_pool_create(size_t threads) {
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (size_t)cpus : 1;
+    }
+    ws_pool* pool = calloc(1, sizeof(ws_pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->threads = threads;
+    pool->workers = calloc(threads, sizeof(ws_worker));
+    pool->inject = mpmc_ring_create(INJECT_CAPACITY);
+    atomic_init(&pool->idle, 0);
+    atomic_init(&pool->stopping, false);
+    ring_event_init(&pool->work);
+    pool->spin = threads > 1 && sysconf(_SC_NPROCESSORS_ONLN) > 1;
+    if (pool->workers == NULL || pool->inject == NULL) {
+        ws_pool_destroy(pool);
+        return NULL;
+    }
+    for (size_t i = 0; i < threads; i++) {
+        ws_worker* w = &pool->workers[i];
+        w->pool = pool;
+        w->seed = (unsigned)i * 2654435761u + 1;
+        if (!deque_init(&w->deque)) {
+            ws_pool_destroy(pool);
+            return NULL;
+        }
+    }
+    for (; pool->started < threads; pool->started++) {
+        ws_worker* w = &pool->workers[pool->started];
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            ws_pool_destroy(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+void ws_pool_destroy(ws_pool* pool) {
+    atomic_store(&pool->stopping, true);
+    ring_event_notify(&pool->work);
+    for (size_t i = 0; i < pool->started; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    if (pool->workers != NULL) {
+        for (size_t i = 0; i < pool->threads; i++) {
+            deque_free(&pool->workers[i].deque);
+        }
+        free(pool->workers);
+    }
+    if (pool->inject != NULL) {
+        mpmc_ring_destroy(pool->inject);
+    }
+    free(pool);
+}
+
+size_t ws_pool_threads(ws_pool* pool) {
+    return pool->threads;
+}
+
+void ws_pool_submit(ws_pool* pool, ws_task* task) {
+    void* item = task;
+    mpmc_ring_push_wait(pool->inject, &item, 1);
+    ring_event_notify(&pool->work);
+}
+
+bool ws_spawn(ws_worker* worker, ws_task* task) {
+    if (!deque_push(&worker->deque, task)) {
+        return false;
+    }
+    ring_event_notify(&worker->pool->work);
+    return true;
+}
+
+bool ws_wanted(ws_worker* worker) {
+    return atomic_load_explicit(&worker->pool->idle, memory_order_relaxed) > 0 ||
+           deque_empty(&worker->deque);
+}
@@ -0,0 +1,52 @@
+// Work-stealing task pool.
+//
+// Each worker thread owns a Chase-Lev deque: it pushes and takes its own
+// tasks at the bottom, without atomic read-modify-writes except for the
+// last task, while workers that run out of work steal from the top of the
+// others' deques. Tasks from outside the pool enter through a shared MPMC
+// ring. Workers with nothing to take or steal sleep on a futex until more
+// work arrives.
+//
+// A task is a struct embedding ws_task as its first member. A running task
+// can split off part of its work with ws_spawn; ws_wanted tells it whether
+// some worker is likely to pick that part up, so large tasks are split
+// only as far as needed to keep every worker busy.
+
+#ifndef _worksteal_H
+#define _worksteal_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct ws_pool ws_pool;
+typedef struct ws_worker ws_worker;
+typedef struct ws_task ws_task;
+
+// Unit of work, run once on some worker.
+struct ws_task {
+    void (*run)(ws_task* task, ws_worker* worker);
+};
+
+// Create pool with threads workers, or one per online CPU if threads is 0.
+// Return NULL if out of memory or threads can't be started.
+ws_pool* ws_pool_create(size_t threads);
+
+// Run every task still queued, then stop the workers and free the pool.
+void ws_pool_destroy(ws_pool* pool);
+
+// Return the number of workers.
+size_t ws_pool_threads(ws_pool* pool);
+
+// Queue task from outside the pool, waiting while the queue is full.
+void ws_pool_submit(ws_pool* pool, ws_task* task);
+
+// Queue task on the running worker's deque, where it's run next by the
+// worker or stolen by another. Return false if out of memory; the caller
+// should then run the task itself.
+bool ws_spawn(ws_worker* worker, ws_task* task);
+
+// Return true if work spawned now would likely be picked up: another
+// worker is idle, or this worker has nothing queued for thieves.
+bool ws_wanted(ws_worker* worker);
+
+#endif // _worksteal_H